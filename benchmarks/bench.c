@@ -97,13 +97,17 @@ typedef struct {
     size_t data_size;
     float error_margin;
     uint64_t insert_time;
+    uint64_t insert_batch_time;
     uint64_t percentile_time;
     uint64_t percentiles_time;
     uint64_t serialize_time;
+    uint64_t serialize_into_time;
     uint64_t deserialize_time;
+    uint64_t deserialize_into_time;
     size_t serialized_size;
     uint64_t serialized_percentile_time;
     uint64_t serialized_percentiles_time;
+    uint64_t view_percentile_time;
     uint64_t merge_time;
     uint64_t merge_inplace_time;
     uint64_t merge_serialized_time;
@@ -133,6 +137,15 @@ static BenchmarkResult run_benchmark(uint64_t* data, size_t size, float error_ma
     result.insert_time = get_microseconds() - start;
     printf("done\n");
 
+    printf("Benchmarking batch inserts .. ");
+    // Measure batch insertion time over the same data
+    start = get_microseconds();
+    Heistogram* hb = heistogram_create();
+    heistogram_add_batch(hb, data, size);
+    result.insert_batch_time = get_microseconds() - start;
+    heistogram_free(hb);
+    printf("done\n");
+
     printf("Min value is %lu, max value is %lu, bucket_count is %u, min bucket id is %u\n", h->min, h->max, h->capacity, h->min_bucket_id);
 
     printf("Benchmarking percentile .. ");
@@ -149,7 +162,6 @@ static BenchmarkResult run_benchmark(uint64_t* data, size_t size, float error_ma
     }
     result.percentile_time = get_microseconds() - start;
     printf("done\n");
-    /*
     printf("Benchmarking percentiles .. ");
     // Measure multiple percentiles calculation (1M times)
     double percentiles[] = {50, 75, 90, 95, 99, 99.9, 99.99};
@@ -167,7 +179,6 @@ static BenchmarkResult run_benchmark(uint64_t* data, size_t size, float error_ma
     result.m_p999 = results[5];
     result.m_p9999 = results[6];
     printf("done\n");
-    */
     printf("Benchmarking serialize .. ");
 
     // Measure serialization (10K times)
@@ -181,6 +192,18 @@ static BenchmarkResult run_benchmark(uint64_t* data, size_t size, float error_ma
     result.serialize_time = get_microseconds() - start;
     result.serialized_size = ser_size;
     printf("done\n");
+    printf("Benchmarking serialize_into .. ");
+
+    // Measure serialization into a reused buffer
+    size_t buffer_size = heistogram_serialized_size_bound(h);
+    void* buffer = malloc(buffer_size);
+    start = get_microseconds();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        heistogram_serialize_into(h, buffer, buffer_size);
+    }
+    result.serialize_into_time = get_microseconds() - start;
+    free(buffer);
+    printf("done\n");
     printf("Benchmarking percentile_serialized .. ");
 
     // Measure serialized percentile calculations (1M times)
@@ -196,15 +219,14 @@ static BenchmarkResult run_benchmark(uint64_t* data, size_t size, float error_ma
     }
     result.serialized_percentile_time = get_microseconds() - start;
     printf("done\n");
-    /*
     printf("Benchmarking percentiles_serialized .. ");
 
     // Measure multiple serialized percentiles calculation (1M times)
-    //start = get_microseconds();
-    //for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
-        //heistogram_percentiles_serialized(serialized, ser_size, percentiles, 7, results);
-    //}
-    //result.serialized_percentiles_time = get_microseconds() - start;
+    start = get_microseconds();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        heistogram_percentiles_serialized(serialized, ser_size, percentiles, 7, results);
+    }
+    result.serialized_percentiles_time = get_microseconds() - start;
     result.sm_p50 = results[0];
     result.sm_p75 = results[1];
     result.sm_p90 = results[2];
@@ -213,7 +235,20 @@ static BenchmarkResult run_benchmark(uint64_t* data, size_t size, float error_ma
     result.sm_p999 = results[5];
     result.sm_p9999 = results[6];
     printf("done\n");
-    */
+    printf("Benchmarking view_percentile .. ");
+
+    // Measure percentiles on a view of the serialized data, the index is built on the first call
+    HeistogramView view;
+    heistogram_view_init(&view, serialized, ser_size);
+    start = get_microseconds();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        for (int k = 0; k < 7; k++) {
+            results[k] = heistogram_view_percentile(&view, percentiles[k]);
+        }
+    }
+    result.view_percentile_time = get_microseconds() - start;
+    heistogram_view_release(&view);
+    printf("done\n");
     printf("Benchmarking deserialize .. ");
 
     // Measure deserialization (10K times)
@@ -224,6 +259,17 @@ static BenchmarkResult run_benchmark(uint64_t* data, size_t size, float error_ma
     }
     result.deserialize_time = get_microseconds() - start;
     printf("done\n");
+    printf("Benchmarking deserialize_into .. ");
+
+    // Measure deserialization into a reused histogram
+    Heistogram* reused = heistogram_create();
+    start = get_microseconds();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        heistogram_deserialize_into(reused, serialized, ser_size);
+    }
+    result.deserialize_into_time = get_microseconds() - start;
+    heistogram_free(reused);
+    printf("done\n");
     printf("Benchmarking merge .. ");
 
     // Measure merge operation (10K times)
@@ -308,20 +354,23 @@ static void print_results(const BenchmarkResult* result) {
            result->insert_time / 1000.0,
            (double)result->insert_time * 1000 / (result->data_size));
 
+    printf("\nBatch Insertion:\n");
+    printf("  Time: %.3f ms (%.3f ns per operation)\n",
+           result->insert_batch_time / 1000.0,
+           (double)result->insert_batch_time * 1000 / (result->data_size));
+
     printf("\nPercentile Calculation (%lu iterations):\n", 7 * BENCH_ITERATIONS);
     printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
            result->percentile_time / 1000.0,
            (result->percentile_time * 1000.0) / (7 * BENCH_ITERATIONS));
     printf("  Values: p50=%.2f, p75=%.2f, p90=%.2f, p95=%.2f, p99=%.2f, p99.9=%.2F, p99.99=%.2F\n",
            result->p50, result->p75, result->p90, result->p95, result->p99, result->p999, result->p9999);
-    /*
     printf("\nMultiple Percentiles Calculation (%lu iterations):\n", 7 * BENCH_ITERATIONS);
     printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
            result->percentiles_time / 1000.0,
            (result->percentiles_time * 1000.0) / (7 * BENCH_ITERATIONS));
            printf("  Values: p50=%.2f, p75=%.2f, p90=%.2f, p95=%.2f, p99=%.2F, p99.9=%.2F, p99.99=%.2F\n",
             result->m_p50, result->m_p75, result->m_p90, result->m_p95, result->m_p99, result->m_p999, result->m_p9999);
-    */
     printf("\nMerge Operation (%lu iterations):\n", BENCH_ITERATIONS);
     printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
             result->merge_time / 1000.0,
@@ -338,18 +387,27 @@ static void print_results(const BenchmarkResult* result) {
            (double)result->serialize_time * 1000 / BENCH_ITERATIONS);
     printf("  Serialized Size: %zu bytes\n", result->serialized_size);
 
+    printf("\nSerialization Into Buffer (%lu iterations):\n", BENCH_ITERATIONS);
+    printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
+           result->serialize_into_time / 1000.0,
+           (double)result->serialize_into_time * 1000 / BENCH_ITERATIONS);
+
     printf("\nDeserialization (%lu iterations):\n", BENCH_ITERATIONS);
     printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
            result->deserialize_time / 1000.0,
            (double)result->deserialize_time * 1000 / BENCH_ITERATIONS);
 
+    printf("\nDeserialization Into Histogram (%lu iterations):\n", BENCH_ITERATIONS);
+    printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
+           result->deserialize_into_time / 1000.0,
+           (double)result->deserialize_into_time * 1000 / BENCH_ITERATIONS);
+
     printf("\nSerialized Percentile Calculation (%lu iterations):\n", 7 * BENCH_ITERATIONS);
     printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
            result->serialized_percentile_time / 1000.0,
            (result->serialized_percentile_time * 1000.0) / (7 * BENCH_ITERATIONS));
     printf("  Values: p50=%.2f, p75=%.2f, p90=%.2f, p95=%.2f, p99=%.2f, p99.9=%.2f, p99.99=%.2f\n",
            result->s_p50, result->s_p75, result->s_p90, result->s_p95, result->s_p99, result->s_p999, result->s_p9999);
-    /*
     printf("\nMultiple Serialized Percentiles Calculation (%lu iterations):\n", 7 * BENCH_ITERATIONS);
     printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
            result->serialized_percentiles_time / 1000.0,
@@ -357,7 +415,11 @@ static void print_results(const BenchmarkResult* result) {
 
            printf("  Values: p50=%.2f, p75=%.2f, p90=%.2f, p95=%.2f, p99=%.2f, p99.9=%.2f, p99.99=%.2f\n",
             result->sm_p50, result->sm_p75, result->sm_p90, result->sm_p95, result->sm_p99, result->sm_p999, result->sm_p9999);
-    */
+
+    printf("\nView Percentile Calculation (%lu iterations):\n", 7 * BENCH_ITERATIONS);
+    printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
+           result->view_percentile_time / 1000.0,
+           (result->view_percentile_time * 1000.0) / (7 * BENCH_ITERATIONS));
     printf("\nMerge with Serialized Data (%lu iterations):\n", BENCH_ITERATIONS);
     printf("  Total Time: %.3f ms (%.3f ns per operation)\n",
            result->merge_serialized_time / 1000.0,
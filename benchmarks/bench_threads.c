@@ -0,0 +1,102 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "../src/heistogram.h"
+
+// Insert throughput of a mutex guarded Heistogram against HeistogramSharded for 1 to N threads
+//   gcc -O3 -march=native -pthread -o bench_threads ./bench_threads.c -lm
+//   ./bench_threads [max_threads]
+
+static uint64_t BENCH_INSERTS_PER_THREAD = 10000000;
+
+typedef enum { MODE_MUTEX, MODE_SHARDED } BenchMode;
+
+typedef struct {
+    BenchMode mode;
+    Heistogram* h;
+    pthread_mutex_t* mutex;
+    HeistogramSharded* hs;
+    uint64_t seed;
+} BenchThread;
+
+static uint64_t get_microseconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+// Latency like values spread over 10^6, without calling the libc rand lock from every thread
+static inline uint64_t next_value(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (*state % 1000000) >> (*state % 11);
+}
+
+static void* bench_thread(void* arg) {
+    BenchThread* t = arg;
+    uint64_t state = t->seed;
+    if (t->mode == MODE_MUTEX) {
+        for (uint64_t i = 0; i < BENCH_INSERTS_PER_THREAD; i++) {
+            uint64_t value = next_value(&state);
+            pthread_mutex_lock(t->mutex);
+            heistogram_add(t->h, value);
+            pthread_mutex_unlock(t->mutex);
+        }
+    } else {
+        for (uint64_t i = 0; i < BENCH_INSERTS_PER_THREAD; i++) {
+            heistogram_sharded_add(t->hs, next_value(&state));
+        }
+    }
+    return NULL;
+}
+
+// Returns inserts per microsecond across all threads
+static double run(BenchMode mode, int num_threads) {
+    Heistogram* h = heistogram_create();
+    HeistogramSharded* hs = heistogram_sharded_create(num_threads);
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t threads[num_threads];
+    BenchThread args[num_threads];
+
+    uint64_t start = get_microseconds();
+    for (int i = 0; i < num_threads; i++) {
+        args[i] = (BenchThread){mode, h, &mutex, hs, 0x9E3779B97F4A7C15ULL * (i + 1)};
+        pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = get_microseconds() - start;
+
+    // Make sure nothing was lost
+    uint64_t expected = BENCH_INSERTS_PER_THREAD * num_threads;
+    Heistogram* snapshot = mode == MODE_SHARDED ? heistogram_sharded_snapshot(hs) : NULL;
+    uint64_t total = mode == MODE_SHARDED ? heistogram_count(snapshot) : heistogram_count(h);
+    if (total != expected) {
+        fprintf(stderr, "Lost inserts: %llu of %llu\n", (unsigned long long)total, (unsigned long long)expected);
+    }
+
+    heistogram_free(snapshot);
+    heistogram_sharded_free(hs);
+    heistogram_free(h);
+    return (double)expected / elapsed;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 1) max_threads = 1;
+
+    printf("Threads\t|Mutex (M inserts/s)\t|Sharded (M inserts/s)\t|Speedup\n");
+    printf("---|---|---|---\n");
+    // Doubling thread counts, always ending with max_threads
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads) threads = max_threads;
+        double mutex = run(MODE_MUTEX, threads);
+        double sharded = run(MODE_SHARDED, threads);
+        printf("%d\t|%.1f\t|%.1f\t|%.1fx\n", threads, mutex, sharded, sharded / mutex);
+        if (threads == max_threads) break;
+    }
+
+    return 0;
+}
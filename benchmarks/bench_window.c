@@ -0,0 +1,83 @@
+#include <sys/time.h>
+#include "../src/heistogram.h"
+
+// p99 over a sliding window: HeistogramWindow against re-merging every slot for each query
+//   gcc -O3 -march=native -o bench_window ./bench_window.c -lm
+//   ./bench_window [num_slots] [values_per_slot] [queries_per_slot]
+
+static uint64_t get_microseconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+// Latency like values spread over 10^6
+static inline uint64_t next_value(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (*state % 1000000) >> (*state % 11);
+}
+
+int main(int argc, char** argv) {
+    uint32_t num_slots = argc > 1 ? atoi(argv[1]) : 60;
+    uint64_t values_per_slot = argc > 2 ? atoll(argv[2]) : 10000;
+    uint64_t queries_per_slot = argc > 3 ? atoll(argv[3]) : 10;
+    uint64_t rounds = num_slots * 10;  // Runs through the ring ten times
+    if (num_slots == 0 || queries_per_slot == 0) return 1;
+
+    // Sliding window: values go into the slot and the aggregate, queries read the aggregate
+    HeistogramWindow* w = heistogram_window_create(num_slots, 1000000);
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    double window_p99 = 0;
+    uint64_t insert_time = 0, query_time = 0, start;
+    for (uint64_t round = 0; round < rounds; round++) {
+        uint64_t now = round * 1000000;
+        start = get_microseconds();
+        for (uint64_t i = 0; i < values_per_slot; i++) heistogram_window_add(w, next_value(&state), now);
+        insert_time += get_microseconds() - start;
+        start = get_microseconds();
+        for (uint64_t q = 0; q < queries_per_slot; q++) {
+            heistogram_window_advance(w, now + q);
+            window_p99 += heistogram_window_percentile(w, 99);
+        }
+        query_time += get_microseconds() - start;
+    }
+
+    // Naive: a ring of slots, every query merges all of them into a reused histogram
+    Heistogram** slots = malloc(num_slots * sizeof(Heistogram*));
+    for (uint32_t i = 0; i < num_slots; i++) slots[i] = heistogram_create();
+    Heistogram* merged = heistogram_create();
+    state = 0x9E3779B97F4A7C15ULL;
+    double naive_p99 = 0;
+    uint64_t naive_insert_time = 0, naive_query_time = 0;
+    for (uint64_t round = 0; round < rounds; round++) {
+        Heistogram* slot = slots[round % num_slots];
+        start = get_microseconds();
+        heistogram_reset(slot);
+        for (uint64_t i = 0; i < values_per_slot; i++) heistogram_add(slot, next_value(&state));
+        naive_insert_time += get_microseconds() - start;
+        start = get_microseconds();
+        for (uint64_t q = 0; q < queries_per_slot; q++) {
+            heistogram_reset(merged);
+            heistogram_merge_many(merged, (const Heistogram* const*)slots, num_slots);
+            naive_p99 += heistogram_percentile(merged, 99);
+        }
+        naive_query_time += get_microseconds() - start;
+    }
+    if (window_p99 != naive_p99) fprintf(stderr, "Results differ: %f vs %f\n", window_p99, naive_p99);
+
+    uint64_t queries = rounds * queries_per_slot;
+    printf("%u slots, %llu values and %llu queries per slot\n", num_slots,
+           (unsigned long long)values_per_slot, (unsigned long long)queries_per_slot);
+    printf("Method\t|Insert (ns/value)\t|Query (ns)\n");
+    printf("---|---|---\n");
+    printf("Naive re-merge\t|%.1f\t|%.0f\n", naive_insert_time * 1000.0 / (rounds * values_per_slot), naive_query_time * 1000.0 / queries);
+    printf("HeistogramWindow\t|%.1f\t|%.0f\n", insert_time * 1000.0 / (rounds * values_per_slot), query_time * 1000.0 / queries);
+
+    for (uint32_t i = 0; i < num_slots; i++) heistogram_free(slots[i]);
+    free(slots);
+    heistogram_free(merged);
+    heistogram_window_free(w);
+    return 0;
+}
@@ -7,26 +7,145 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-static float HEIST_GROWTH_FACTOR = 0.02;
-static float HEIST_INV_LOG_GROWTH_FACTOR = 35.00278878;//116.2767475;
-static uint16_t HEIST_MAX_UNMAPPED_BUCKET = 57; // after this point multiple values can fall in the same bucket
-static uint16_t HEIST_BUCKET_MAPPING_DELTA = 147; // 205 - 57 - 1; //shift the mappings to continue from the last artificial one
+#if !defined(HEIST_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HEIST_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Precision tiers. Bucket bounds grow by a fixed factor, which bounds the relative error of every
+ * reported value. HEIST_PRECISION picks the tier at compile time, and the mapping constants, the
+ * mantissa bits of the lookup tables and the size of the bucket space all follow from it, so a
+ * tier costs nothing at runtime. Every function is static: translation units built with different
+ * tiers can share one binary, each with its own code and tables. Format 2 records the tier in its
+ * mapping byte and readers of another tier reject the buffer. Format 1 has no such byte, it is
+ * only written and read by the 2% tier.
+ */
+#define HEIST_PRECISION_2 0    // 2%, the original mapping
+#define HEIST_PRECISION_0_5 1  // 0.5%, about 4 times the buckets of 2%
+#define HEIST_PRECISION_1 2    // 1%, about twice the buckets of 2%
+#define HEIST_PRECISION_5 3    // 5%, about 40% of the buckets of 2%
+
+#ifndef HEIST_PRECISION
+#define HEIST_PRECISION HEIST_PRECISION_2
+#endif
+
+// Tier constants are constexpr in C++, see heistogram.hpp
+#ifdef __cplusplus
+#define HEIST_TIER_CONST static constexpr
+#else
+#define HEIST_TIER_CONST static const
+#endif
+
+// Values up to HEIST_MAX_UNMAPPED_BUCKET get a bucket each, after this point multiple values can
+// fall in the same bucket. HEIST_BUCKET_MAPPING_DELTA shifts the log mapping to continue from there.
+// HEIST_MANTISSA_BITS is the smallest number of bits that makes a table slot narrower than a bucket
+#if HEIST_PRECISION == HEIST_PRECISION_2
+HEIST_TIER_CONST float HEIST_GROWTH_FACTOR = 0.02;
+HEIST_TIER_CONST float HEIST_INV_LOG_GROWTH_FACTOR = 35.00278878;  // 1 / log2(1 + HEIST_GROWTH_FACTOR)
+HEIST_TIER_CONST uint16_t HEIST_MAX_UNMAPPED_BUCKET = 57;
+HEIST_TIER_CONST uint16_t HEIST_BUCKET_MAPPING_DELTA = 147;
+#define HEIST_MANTISSA_BITS 6
+#define HEIST_MAX_BUCKET_ID 2093  // get_bucket_id(UINT64_MAX)
+#elif HEIST_PRECISION == HEIST_PRECISION_0_5
+HEIST_TIER_CONST float HEIST_GROWTH_FACTOR = 0.005;
+HEIST_TIER_CONST float HEIST_INV_LOG_GROWTH_FACTOR = 138.97572327;
+HEIST_TIER_CONST uint16_t HEIST_MAX_UNMAPPED_BUCKET = 210;
+HEIST_TIER_CONST uint16_t HEIST_BUCKET_MAPPING_DELTA = 862;
+#define HEIST_MANTISSA_BITS 8
+#define HEIST_MAX_BUCKET_ID 8032
+#elif HEIST_PRECISION == HEIST_PRECISION_1
+HEIST_TIER_CONST float HEIST_GROWTH_FACTOR = 0.01;
+HEIST_TIER_CONST float HEIST_INV_LOG_GROWTH_FACTOR = 69.66071320;
+HEIST_TIER_CONST uint16_t HEIST_MAX_UNMAPPED_BUCKET = 112;
+HEIST_TIER_CONST uint16_t HEIST_BUCKET_MAPPING_DELTA = 362;
+#define HEIST_MANTISSA_BITS 7
+#define HEIST_MAX_BUCKET_ID 4096
+#elif HEIST_PRECISION == HEIST_PRECISION_5
+HEIST_TIER_CONST float HEIST_GROWTH_FACTOR = 0.05;
+HEIST_TIER_CONST float HEIST_INV_LOG_GROWTH_FACTOR = 14.20669937;
+HEIST_TIER_CONST uint16_t HEIST_MAX_UNMAPPED_BUCKET = 23;
+HEIST_TIER_CONST uint16_t HEIST_BUCKET_MAPPING_DELTA = 41;
+#define HEIST_MANTISSA_BITS 5
+#define HEIST_MAX_BUCKET_ID 868
+#else
+#error "HEIST_PRECISION must be one of the HEIST_PRECISION_* tiers"
+#endif
 
 // Simplified Bucket structure - only stores count
 typedef struct {
     uint64_t count;
 } Bucket;
 
+// How cumulative counts are kept for queries, chosen when the histogram is created
+typedef enum {
+    HEIST_INDEX_NONE = 0,    // Queries scan the buckets, no extra memory
+    HEIST_INDEX_LAZY,        // Prefix sums, rebuilt by the first query after a write
+    HEIST_INDEX_FENWICK      // Fenwick tree, updated by every insert and remove
+} HeistIndexMode;
+
+// A serialized histogram, see heistogram_merge_many_serialized
+typedef struct {
+    const void* data;
+    size_t size;
+} HeistBuffer;
+
+// Memory hooks for a histogram, see heistogram_create_with_allocator. realloc may be NULL, the
+// histogram then allocates, copies and frees instead
+typedef struct {
+    void* (*alloc)(void* ctx, size_t size);
+    void* (*realloc)(void* ctx, void* ptr, size_t old_size, size_t new_size);
+    void (*free)(void* ctx, void* ptr);
+    void* ctx;
+} HeistAllocator;
+
 // Updated Heistogram structure
 typedef struct {
     uint16_t capacity;       // Current capacity of buckets array
-    uint16_t min_bucket_id;  // Smalles bucket id, for optimizing serialization
+    uint16_t base_bucket_id; // Bucket id stored at buckets[0]
+    uint16_t min_bucket_id;  // Lowest non-empty bucket id, 0 when empty
+    uint16_t max_bucket_id;  // Highest non-empty bucket id, 0 when empty
     uint64_t total_count;    // Total count of all values
     uint64_t min;            // Minimum value
     uint64_t max;            // Maximum value
-    Bucket* buckets;         // Array of buckets, index = bucket ID
+    Bucket* buckets;         // Array of buckets, index = bucket ID - base_bucket_id, narrower counters when count_size < 8
+    uint64_t* occupied;      // Bit per bucket of the array, set while its count is non-zero
+    uint64_t* index;         // Cumulative counts laid out according to index_mode
+    uint16_t index_capacity; // Number of buckets the index was built for
+    uint8_t index_mode;      // HeistIndexMode
+    uint8_t index_dirty;     // Index must be rebuilt before it is used
+    uint8_t flags;           // HEIST_FLAG_* bits
+    uint8_t count_size;      // Bytes per bucket counter, 1, 2 or 4 in compact histograms, otherwise 8
+    uint16_t sparse_size;    // Pairs in use while HEIST_FLAG_SPARSE is set
+    const HeistAllocator* allocator; // Hooks all memory of the histogram comes from, NULL for malloc
 } Heistogram;
 
+// Buckets are preallocated and updated with atomics, see heistogram_create_shared
+#define HEIST_FLAG_SHARED 1
+
+// Non-empty buckets are kept as sorted (bucket id, count) pairs, see heistogram_create_sparse
+#define HEIST_FLAG_SPARSE 2
+
+// The bucket array and the bitmap sit in the same allocation as the Heistogram, right after it,
+// until growth moves them out. See heistogram_create_with_allocator
+#define HEIST_FLAG_INLINE_BUCKETS 4
+#define HEIST_FLAG_INLINE_BITMAP 8
+
+// Pair arrays of sparse histograms, capacity counts followed by capacity bucket ids
+#define HEIST_SPARSE_COUNTS(h) ((uint64_t*)(h)->buckets)
+#define HEIST_SPARSE_IDS(h) ((uint16_t*)((uint64_t*)(h)->buckets + (h)->capacity))
+#define HEIST_SPARSE_PAIR_SIZE (sizeof(uint64_t) + sizeof(uint16_t))
+
+// 64-bit words of the occupancy bitmap for capacity buckets
+#define HEIST_BITMAP_WORDS(capacity) (((size_t)(capacity) + 63) / 64)
+
+// Bucket bid of a histogram with 8 byte counters, which must lie within
+// [base_bucket_id, base_bucket_id + capacity)
+#define HEIST_BUCKET(h, bid) ((h)->buckets[(bid) - (h)->base_bucket_id])
+
+// Shared histograms change under concurrent readers, their fields are read with atomic loads
+#define HEIST_LOAD(h, field) (((h)->flags & HEIST_FLAG_SHARED) ? __atomic_load_n(&(field), __ATOMIC_ACQUIRE) : (field))
+
 
 /*************************/
 /* VARINT HELPER METHODS */
@@ -61,7 +180,8 @@ static inline size_t encode_varint(uint64_t val, uint8_t* buf) {
     else if (val <= 0xFFFFFFFFFFFFFF) bytes = 7;
     else bytes = 8;
     
-    buf[0] = 249 + bytes; // 250-255 based on size
+    // 252-255 for 3-6 bytes, 3 byte values never need the 1 and 2 byte codes, so 250 and 251 mark 7 and 8 bytes
+    buf[0] = bytes <= 6 ? 249 + bytes : 243 + bytes;
     for (int i = bytes; i > 0; i--) {
         buf[i] = (uint8_t)(val & 0xFF);
         val >>= 8;
@@ -86,7 +206,7 @@ static inline size_t decode_varint(const uint8_t* buf, uint64_t* val) {
         return 3;
     }
     
-    int bytes = a0 - 249; // Number of bytes following
+    int bytes = a0 >= 252 ? a0 - 249 : a0 - 243; // Number of bytes following
     uint64_t result = 0;
     for (int i = 1; i <= bytes; i++) {
         result = (result << 8) | buf[i];
@@ -95,6 +215,14 @@ static inline size_t decode_varint(const uint8_t* buf, uint64_t* val) {
     return bytes + 1;
 }
 
+// Encoded length of a varint from its first byte
+static inline size_t heist_varint_length(uint8_t a0) {
+    if (a0 <= 240) return 1;
+    if (a0 <= 248) return 2;
+    if (a0 == 249) return 3;
+    return a0 >= 252 ? a0 - 248 : a0 - 242;
+}
+
 /***********************/
 /* MATH HELPER METHODS */
 /***********************/
@@ -118,29 +246,198 @@ static inline double fast_pow_int(float x, int y) {
 /* HEISTOGRAM HELPER METHODS */
 /*****************************/
 
-static inline int16_t get_bucket_id(double value) {
+// Reference mapping, only used to generate the lookup tables below
+static inline int16_t get_bucket_id_log2(double value) {
     if (value <= HEIST_MAX_UNMAPPED_BUCKET) return value;
     return (int16_t)((float)log2(value) * HEIST_INV_LOG_GROWTH_FACTOR) - HEIST_BUCKET_MAPPING_DELTA;
 }
 
-static inline uint64_t get_bucket_min(uint16_t bid) {
+// Reference bucket bounds, only used to generate the bound tables below
+static inline uint64_t get_bucket_min_pow(uint16_t bid) {
     if(bid <= HEIST_MAX_UNMAPPED_BUCKET) return bid;
-    return (uint64_t)ceil(fast_pow_int(1 + HEIST_GROWTH_FACTOR, bid + HEIST_BUCKET_MAPPING_DELTA));
+    double min = ceil(fast_pow_int(1 + HEIST_GROWTH_FACTOR, bid + HEIST_BUCKET_MAPPING_DELTA));
+    return min < 18446744073709551616.0 ? (uint64_t)min : UINT64_MAX;
 }
 
-static inline uint64_t get_bucket_max(uint32_t min) {
+static inline uint64_t get_bucket_max_of(uint64_t min) {
     if(min <= HEIST_MAX_UNMAPPED_BUCKET) return min;
-    return (uint64_t)(min * HEIST_GROWTH_FACTOR) + min;
+    uint64_t width = (uint64_t)((float)min * HEIST_GROWTH_FACTOR);
+    return UINT64_MAX - min > width ? min + width : UINT64_MAX;
+}
+
+/*
+ * Integer bucket mapping
+ *
+ * A value is located by its highest set bit and the HEIST_MANTISSA_BITS bits that follow it.
+ * Each such slot is narrower than a bucket, so it holds at most one bucket boundary: the slot
+ * table gives the bucket of the smallest value in the slot, and comparing against the last
+ * value of that bucket tells whether the value is past the boundary. Both tables are generated
+ * from get_bucket_id_log2, so the ids are exactly the ones the log2 formula produces.
+ */
+#define HEIST_MANTISSA_MASK ((1u << HEIST_MANTISSA_BITS) - 1)
+
+// Spare entries so vector kernels can gather whole 64-bit words at the last index
+static uint16_t heist_slot_bucket[(64 << HEIST_MANTISSA_BITS) + 3];
+static uint64_t heist_bucket_last[HEIST_MAX_BUCKET_ID + 1];
+
+// Bucket bounds reported by queries, indexed by bucket id
+static uint64_t heist_bucket_lower[HEIST_MAX_BUCKET_ID + 1];
+static uint64_t heist_bucket_upper[HEIST_MAX_BUCKET_ID + 1];
+
+// Serialization format 2 groups four counts behind a control byte of 2-bit size codes
+static const uint8_t heist_group_code_size[4] = {1, 2, 4, 8};
+static uint8_t heist_group_size[256];         // Data bytes following each control byte
+#ifdef HEIST_X86_SIMD
+static uint8_t heist_group_shuffle[256][32];  // Spreads up to 16 data bytes into four uint64_t
+#endif
+
+static inline int heist_clz64(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(value);
+#else
+    int n = 0;
+    while (!(value & 0x8000000000000000ULL)) { value <<= 1; n++; }
+    return n;
+#endif
+}
+
+static inline int heist_ctz64(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(value);
+#else
+    int n = 0;
+    while (!(value & 1)) { value >>= 1; n++; }
+    return n;
+#endif
+}
+
+static void heist_build_tables(void) {
+    for (uint16_t b = 0; b < HEIST_MAX_UNMAPPED_BUCKET; b++) {
+        heist_bucket_last[b] = b;
+    }
+
+    // Find where each bucket starts, lo always maps below the bucket being searched for
+    uint64_t lo = HEIST_MAX_UNMAPPED_BUCKET;
+    for (uint16_t b = HEIST_MAX_UNMAPPED_BUCKET + 1; b <= HEIST_MAX_BUCKET_ID; b++) {
+        uint64_t step = lo / 64 + 1;
+        uint64_t hi = lo + step;
+        while (get_bucket_id_log2(hi) < b) {
+            lo = hi;
+            step *= 2;
+            hi = UINT64_MAX - lo > step ? lo + step : UINT64_MAX;
+        }
+        while (hi - lo > 1) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (get_bucket_id_log2(mid) >= b) hi = mid;
+            else lo = mid;
+        }
+        heist_bucket_last[b - 1] = hi - 1;
+        lo = hi - 1;
+    }
+    heist_bucket_last[HEIST_MAX_BUCKET_ID] = UINT64_MAX;
+
+    for (int e = 0; e < 64; e++) {
+        for (uint32_t m = 0; m <= HEIST_MANTISSA_MASK; m++) {
+            uint64_t top = (1u << HEIST_MANTISSA_BITS) | m;
+            uint64_t first = e >= HEIST_MANTISSA_BITS
+                ? top << (e - HEIST_MANTISSA_BITS)
+                : (top + (1u << (HEIST_MANTISSA_BITS - e)) - 1) >> (HEIST_MANTISSA_BITS - e);
+            heist_slot_bucket[(e << HEIST_MANTISSA_BITS) | m] = get_bucket_id_log2(first);
+        }
+    }
+
+    // The 2% tier keeps the bounds its queries have always reported, the others report the exact
+    // first and last value of each bucket
+    for (uint16_t b = 0; b <= HEIST_MAX_BUCKET_ID; b++) {
+#if HEIST_PRECISION == HEIST_PRECISION_2
+        heist_bucket_lower[b] = get_bucket_min_pow(b);
+        heist_bucket_upper[b] = get_bucket_max_of(heist_bucket_lower[b]);
+#else
+        heist_bucket_lower[b] = b > 0 ? heist_bucket_last[b - 1] + 1 : 0;
+        heist_bucket_upper[b] = heist_bucket_last[b];
+#endif
+    }
+
+    for (uint32_t control = 0; control < 256; control++) {
+        uint8_t offset = 0;
+        for (int k = 0; k < 4; k++) {
+            uint8_t size = heist_group_code_size[(control >> (2 * k)) & 3];
+#ifdef HEIST_X86_SIMD
+            // Both 128-bit lanes see the same 16 data bytes, lane k / 2 produces count k
+            for (int b = 0; b < 8; b++) {
+                heist_group_shuffle[control][8 * k + b] = b < size && offset + b < 16 ? offset + b : 0x80;
+            }
+#endif
+            offset += size;
+        }
+        heist_group_size[control] = offset;
+    }
+}
+
+// Builds the mapping tables once, every entry point that maps values calls this first
+static void heist_tables_init(void) {
+    static int state = 0; // 0 = not built, 1 = building, 2 = ready
+    if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == 2) return;
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&state, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        heist_build_tables();
+        __atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != 2);
+}
+
+static inline int16_t get_bucket_id(uint64_t value) {
+    if (value <= HEIST_MAX_UNMAPPED_BUCKET) return value;
+    int shift = heist_clz64(value);
+    uint32_t slot = ((63 - shift) << HEIST_MANTISSA_BITS)
+        | (uint32_t)((value << shift) >> (63 - HEIST_MANTISSA_BITS) & HEIST_MANTISSA_MASK);
+    uint16_t bid = heist_slot_bucket[slot];
+    return bid + (value > heist_bucket_last[bid]);
+}
+
+static inline uint64_t get_bucket_min(uint16_t bid) {
+    return heist_bucket_lower[bid];
+}
+
+static inline uint64_t get_bucket_max(uint16_t bid) {
+    return heist_bucket_upper[bid];
+}
+
+// Value at pos within a bucket (0 = upper end, 1 = lower end), clamped to the histogram's min/max
+static inline double heist_bucket_interpolate(uint16_t bid, double pos, uint64_t min, uint64_t max) {
+    uint64_t min_val = get_bucket_min(bid);
+    uint64_t max_val = get_bucket_max(bid);
+    if (max_val > max) max_val = max;
+    if (min_val < min) min_val = min;
+    return max_val - pos * (max_val - min_val);
+}
+
+// Sorts indexes of the requested percentiles in ascending order, walking it backwards visits
+// them from the top bucket down. Already sorted input costs a single pass
+static inline void heist_percentile_order(const double* percentiles, size_t n, size_t* order) {
+    for (size_t i = 0; i < n; i++) {
+        size_t idx = i;
+        size_t j = i;
+        while (j > 0 && percentiles[order[j - 1]] > percentiles[idx]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = idx;
+    }
 }
 
-static inline size_t encode_bucket(uint32_t count, uint8_t* buffer) {
+// Stack space for percentile orders, longer requests allocate
+#define HEIST_PERCENTILES_STACK 32
+
+static inline size_t encode_bucket(uint64_t count, uint8_t* buffer) {
     uint8_t* ptr = buffer;
     ptr += encode_varint(count, ptr);
     return ptr - buffer;
 }
 
 static inline size_t encode_empty_buckets(uint32_t count, uint8_t* buffer) {
-    for(int i = 0; i < count; i++){
+    for(uint32_t i = 0; i < count; i++){
         buffer[i] = 0;
     }
     return count;
@@ -198,687 +495,3978 @@ static inline size_t decode_bucket(const uint8_t* buffer, uint64_t* count) {
     return ptr - buffer;
 }
 
-/**************************/
-/* HEISTOGRAM API METHODS */
-/**************************/
+/*****************************/
+/* BATCH KERNELS             */
+/*****************************/
 
-static Heistogram* heistogram_create(void) {
-    Heistogram* h = malloc(sizeof(Heistogram));
-    if (!h) return NULL;
-    
-    h->capacity = 16;
-    h->total_count = 0;
-    h->max = 0;
-    h->min = 0;
-    h->min_bucket_id = 0;
-    
-    // Initialize all buckets with zero count
-    h->buckets = calloc(h->capacity, sizeof(Bucket));
-    if (!h->buckets) {
-        free(h);
-        return NULL;
+// Values are processed in chunks of this many bucket ids to keep the scratch space on the stack
+#define HEIST_BATCH_CHUNK 256
+
+typedef void (*heist_minmax_kernel)(const uint64_t* values, size_t n, uint64_t* min, uint64_t* max);
+typedef void (*heist_bucket_ids_kernel)(const uint64_t* values, size_t n, uint16_t* bids);
+typedef void (*heist_add_counts_kernel)(uint64_t* dst, const uint64_t* src, size_t n);
+
+static void heist_minmax_scalar(const uint64_t* values, size_t n, uint64_t* min, uint64_t* max) {
+    uint64_t mn = UINT64_MAX, mx = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (values[i] < mn) mn = values[i];
+        if (values[i] > mx) mx = values[i];
     }
-    
-    return h;
+    *min = mn;
+    *max = mx;
 }
 
-static void heistogram_free(Heistogram* h) {
-    if (!h) return;
-    free(h->buckets);
-    free(h);
+static void heist_bucket_ids_scalar(const uint64_t* values, size_t n, uint16_t* bids) {
+    for (size_t i = 0; i < n; i++) {
+        bids[i] = get_bucket_id(values[i]);
+    }
 }
 
-static uint64_t heistogram_count(const Heistogram* h) {
-    return h ? h->total_count : 0;
+// Adds n 8 byte counts of src to dst, for merging bucket arrays
+static void heist_add_counts_scalar(uint64_t* dst, const uint64_t* src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] += src[i];
+    }
 }
 
-static uint64_t heistogram_max(const Heistogram* h) {
-    return h ? h->max : 0;
-}
+#ifdef HEIST_X86_SIMD
 
-static uint64_t heistogram_min(const Heistogram* h) {
-    return h ? h->min : 0;
+// AVX2 has no unsigned 64-bit compare, flip the sign bit and use the signed one
+__attribute__((target("avx2")))
+static void heist_minmax_avx2(const uint64_t* values, size_t n, uint64_t* min, uint64_t* max) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    __m256i vmin = _mm256_set1_epi64x(INT64_MAX);
+    __m256i vmax = _mm256_set1_epi64x(INT64_MIN);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(values + i)), sign);
+        vmin = _mm256_blendv_epi8(vmin, x, _mm256_cmpgt_epi64(vmin, x));
+        vmax = _mm256_blendv_epi8(vmax, x, _mm256_cmpgt_epi64(x, vmax));
+    }
+    uint64_t lanes_min[4], lanes_max[4];
+    _mm256_storeu_si256((__m256i*)lanes_min, _mm256_xor_si256(vmin, sign));
+    _mm256_storeu_si256((__m256i*)lanes_max, _mm256_xor_si256(vmax, sign));
+    uint64_t mn, mx;
+    heist_minmax_scalar(values + i, n - i, &mn, &mx);
+    for (int k = 0; k < 4; k++) {
+        if (lanes_min[k] < mn) mn = lanes_min[k];
+        if (lanes_max[k] > mx) mx = lanes_max[k];
+    }
+    *min = mn;
+    *max = mx;
 }
 
-static uint32_t heistogram_memory_size(const Heistogram* h) {
-    return h ? sizeof(Heistogram) + (sizeof(Bucket) * h->capacity) : 0;
+// Values below 2^52 convert to doubles exactly, whose exponent and top mantissa bits are the
+// slot index. Larger values are rare enough to go through get_bucket_id
+__attribute__((target("avx2")))
+static void heist_bucket_ids_avx2(const uint64_t* values, size_t n, uint16_t* bids) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i limit = _mm256_set1_epi64x((int64_t)HEIST_MAX_UNMAPPED_BUCKET ^ INT64_MIN);
+    const __m256i exact = _mm256_set1_epi64x((int64_t)((1ULL << 52) ^ INT64_MIN));
+    const __m256i magic = _mm256_set1_epi64x(0x4330000000000000LL); // 2^52
+    const __m256i bias = _mm256_set1_epi64x(1023LL << HEIST_MANTISSA_BITS);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(values + i));
+        __m256i xs = _mm256_xor_si256(x, sign);
+        __m256i mapped = _mm256_cmpgt_epi64(xs, limit);
+        __m256i d = _mm256_castpd_si256(_mm256_sub_pd(
+            _mm256_castsi256_pd(_mm256_or_si256(x, magic)), _mm256_castsi256_pd(magic)));
+        __m256i wide = _mm256_cmpgt_epi64(xs, exact);
+        __m256i slot = _mm256_andnot_si256(wide, _mm256_and_si256(
+            _mm256_sub_epi64(_mm256_srli_epi64(d, 52 - HEIST_MANTISSA_BITS), bias), mapped));
+        __m256i bid = _mm256_and_si256(
+            _mm256_i64gather_epi64((const long long*)heist_slot_bucket, slot, 2), _mm256_set1_epi64x(0xFFFF));
+        __m256i last = _mm256_xor_si256(
+            _mm256_i64gather_epi64((const long long*)heist_bucket_last, bid, 8), sign);
+        bid = _mm256_add_epi64(bid, _mm256_and_si256(_mm256_cmpgt_epi64(xs, last), one));
+        bid = _mm256_blendv_epi8(x, bid, mapped);
+        __m128i narrow = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bid, low_halves));
+        _mm_storel_epi64((__m128i*)(bids + i), _mm_packus_epi32(narrow, narrow));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(wide));
+        while (mask) {
+            int k = __builtin_ctz(mask);
+            bids[i + k] = get_bucket_id(values[i + k]);
+            mask &= mask - 1;
+        }
+    }
+    heist_bucket_ids_scalar(values + i, n - i, bids + i);
 }
 
-static void heistogram_add(Heistogram* h, uint64_t value) {
-    if (!h || value < 0) return;
-    
-    int16_t bid = get_bucket_id(value);
-    if (h->total_count == 0) {
-        h->min = value;
-        h->max = value;
-        h->min_bucket_id = bid;
-    } else {
-        if (h->min > value) h->min = value;
-        if (h->max < value) h->max = value;
-        if(bid < h->min_bucket_id) h->min_bucket_id = bid;
-    }
-    
-    // Expand array if needed
-    if (bid >= h->capacity) {
-        size_t new_capacity = bid + 16;// + 16; // Add some extra space
-        Bucket* new_buckets = realloc(h->buckets, new_capacity * sizeof(Bucket));
-        if (!new_buckets) return;
-        
-        // Initialize new buckets to zero
-        memset(new_buckets + h->capacity, 0, (new_capacity - h->capacity) * sizeof(Bucket));
-        
-        h->buckets = new_buckets;
-        h->capacity = new_capacity;
+__attribute__((target("avx2")))
+static void heist_add_counts_avx2(uint64_t* dst, const uint64_t* src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(dst + i)), _mm256_loadu_si256((const __m256i*)(src + i)));
+        __m256i b = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(dst + i + 4)), _mm256_loadu_si256((const __m256i*)(src + i + 4)));
+        _mm256_storeu_si256((__m256i*)(dst + i), a);
+        _mm256_storeu_si256((__m256i*)(dst + i + 4), b);
     }
-    
-    // Increment count in the appropriate bucket
-    h->buckets[bid].count++;
-    h->total_count++;
+    heist_add_counts_scalar(dst + i, src + i, n - i);
 }
 
-static void heistogram_remove(Heistogram* h, uint64_t value) {
-    if (!h || value < 0 || h->total_count == 0) return;
-    
-    int16_t bid = get_bucket_id(value);
-    if (bid >= h->capacity || h->buckets[bid].count == 0) return;
+// GCC's AVX-512 intrinsics start from _mm512_undefined_* vectors, which g++ reports as uninitialized
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
 
-    h->buckets[bid].count--;
-    h->total_count--;
-    
-    // Check if histogram is now empty
-    if (h->total_count == 0) {
-        h->min = 0;
-        h->max = 0;
-        h->min_bucket_id = 0;
-        return;
+__attribute__((target("avx512f")))
+static void heist_minmax_avx512(const uint64_t* values, size_t n, uint64_t* min, uint64_t* max) {
+    __m512i vmin = _mm512_set1_epi64(-1);
+    __m512i vmax = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i x = _mm512_loadu_si512((const void*)(values + i));
+        vmin = _mm512_min_epu64(vmin, x);
+        vmax = _mm512_max_epu64(vmax, x);
     }
-    
-    // Only update min/max values if the bucket count went to zero
-    if (h->buckets[bid].count == 0) {
-        // Check if this was the bucket containing the max value
-        uint64_t bucket_min = get_bucket_min(bid);
-        uint64_t bucket_max = get_bucket_max(bucket_min);
-        
-        if (h->max <= bucket_max && h->max >= bucket_min) {
-            // Find new max by scanning buckets backward from the highest bucket
-            h->max = 0;
-            for (int16_t i = h->capacity - 1; i >= 0; i--) {
-                if (h->buckets[i].count > 0) {
-                    // For the max, we use the upper bound of the bucket range
-                    uint64_t b_min = get_bucket_min(i);
-                    uint64_t b_max = get_bucket_max(b_min);
-                    h->max = b_max;
-                    break;
-                }
-            }
-        }
-        
-        // Check if this was the bucket containing the min value
-        if (h->min >= bucket_min && h->min <= bucket_max) {
-            // Find new min by scanning buckets forward from the lowest bucket
-            h->min = UINT64_MAX;
-            for (int16_t i = 0; i < h->capacity; i++) {
-                if (h->buckets[i].count > 0) {
-                    // For the min, we use the lower bound of the bucket range
-                    h->min = get_bucket_min(i);
-                    h->min_bucket_id = i;
-                    break;
-                }
-            }
-        }
-        
-        // Update min_bucket_id if needed
-        if (bid == h->min_bucket_id) {
-            // Find new min_bucket_id
-            for (int16_t i = h->min_bucket_id; i < h->capacity; i++) {
-                if (h->buckets[i].count > 0) {
-                    h->min_bucket_id = i;
-                    break;
-                }
-            }
-        }
+    if (i < n) {
+        __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        vmin = _mm512_mask_min_epu64(vmin, tail, vmin, _mm512_maskz_loadu_epi64(tail, values + i));
+        vmax = _mm512_mask_max_epu64(vmax, tail, vmax, _mm512_maskz_loadu_epi64(tail, values + i));
     }
+    *min = _mm512_reduce_min_epu64(vmin);
+    *max = _mm512_reduce_max_epu64(vmax);
 }
 
-static Heistogram* heistogram_merge(const Heistogram* h1, const Heistogram* h2) {
-    if (!h1 || !h2) return NULL;
-        
-    Heistogram* result = heistogram_create();
-    if (!result) return NULL;
-    
-    // Find the maximum capacity needed
-    uint16_t max_capacity = h1->capacity > h2->capacity ? h1->capacity : h2->capacity;
-    
-    // Resize result to accommodate all buckets
-    if (max_capacity > result->capacity) {
-        Bucket* new_buckets = realloc(result->buckets, max_capacity * sizeof(Bucket));
-        if (!new_buckets) {
-            heistogram_free(result);
-            return NULL;
-        }
-        
-        // Initialize new buckets to zero
-        memset(new_buckets + result->capacity, 0, (max_capacity - result->capacity) * sizeof(Bucket));
-        
-        result->buckets = new_buckets;
-        result->capacity = max_capacity;
+__attribute__((target("avx512f,avx512cd")))
+static void heist_bucket_ids_avx512(const uint64_t* values, size_t n, uint16_t* bids) {
+    const __m512i limit = _mm512_set1_epi64(HEIST_MAX_UNMAPPED_BUCKET);
+    const __m512i mantissa = _mm512_set1_epi64(HEIST_MANTISSA_MASK);
+    const __m512i top = _mm512_set1_epi64(63);
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i low16 = _mm512_set1_epi64(0xFFFF);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i x = _mm512_loadu_si512((const void*)(values + i));
+        __mmask8 mapped = _mm512_cmpgt_epu64_mask(x, limit);
+        __m512i shift = _mm512_lzcnt_epi64(x);
+        __m512i slot = _mm512_or_si512(
+            _mm512_slli_epi64(_mm512_sub_epi64(top, shift), HEIST_MANTISSA_BITS),
+            _mm512_and_si512(_mm512_srli_epi64(_mm512_sllv_epi64(x, shift), 63 - HEIST_MANTISSA_BITS), mantissa));
+        __m512i bid = _mm512_and_si512(_mm512_cvtepu32_epi64(
+            _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), mapped, slot, heist_slot_bucket, 2)), low16);
+        __m512i last = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), mapped, bid, heist_bucket_last, 8);
+        bid = _mm512_mask_add_epi64(bid, _mm512_cmpgt_epu64_mask(x, last), bid, one);
+        bid = _mm512_mask_blend_epi64(mapped, x, bid);
+        _mm_storeu_si128((__m128i*)(bids + i), _mm512_cvtepi64_epi16(bid));
     }
-    
-    // Merge buckets by adding counts
-    for (uint16_t i = 0; i < h1->capacity; i++) {
-        result->buckets[i].count += h1->buckets[i].count;
+    heist_bucket_ids_scalar(values + i, n - i, bids + i);
+}
+
+__attribute__((target("avx512f")))
+static void heist_add_counts_avx512(uint64_t* dst, const uint64_t* src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i sum = _mm512_add_epi64(_mm512_loadu_si512((const void*)(dst + i)), _mm512_loadu_si512((const void*)(src + i)));
+        _mm512_storeu_si512((void*)(dst + i), sum);
     }
-    
-    for (uint16_t i = 0; i < h2->capacity; i++) {
-        result->buckets[i].count += h2->buckets[i].count;
+    if (i < n) {
+        __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512i sum = _mm512_add_epi64(_mm512_maskz_loadu_epi64(tail, dst + i), _mm512_maskz_loadu_epi64(tail, src + i));
+        _mm512_mask_storeu_epi64(dst + i, tail, sum);
     }
-    
-    // Update result metadata
-    result->total_count = h1->total_count + h2->total_count;
-    result->min = h1->min < h2->min ? h1->min : h2->min;
-    result->max = h1->max > h2->max ? h1->max : h2->max;
-    result->min_bucket_id = h1->min_bucket_id < h2->min_bucket_id ? h1->min_bucket_id : h2->min_bucket_id;
+}
 
-    return result;
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif /* HEIST_X86_SIMD */
+
+typedef struct {
+    heist_minmax_kernel minmax;
+    heist_bucket_ids_kernel bucket_ids;
+    heist_add_counts_kernel add_counts;
+} HeistBatchKernels;
+
+// Picks the widest kernels the running CPU supports, resolved once per process. Racing threads
+// pick the same table, the relaxed atomics only keep the cached pointer access race free
+static const HeistBatchKernels* heist_batch_kernels(void) {
+    static const HeistBatchKernels scalar = { heist_minmax_scalar, heist_bucket_ids_scalar, heist_add_counts_scalar };
+    static const HeistBatchKernels* selected = NULL;
+    const HeistBatchKernels* kernels = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+    if (kernels) return kernels;
+    kernels = &scalar;
+#ifdef HEIST_X86_SIMD
+    static const HeistBatchKernels avx2 = { heist_minmax_avx2, heist_bucket_ids_avx2, heist_add_counts_avx2 };
+    static const HeistBatchKernels avx512 = { heist_minmax_avx512, heist_bucket_ids_avx512, heist_add_counts_avx512 };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd")) kernels = &avx512;
+    else if (__builtin_cpu_supports("avx2")) kernels = &avx2;
+#endif
+    __atomic_store_n(&selected, kernels, __ATOMIC_RELAXED);
+    return kernels;
 }
 
-// NEW: In-place merge of h2 into h1
-static int heistogram_merge_inplace(Heistogram* h1, const Heistogram* h2) {
-    if (!h1 || !h2) return 0;
-    
-    // Expand h1 if needed to accommodate h2's buckets
-    if (h2->capacity > h1->capacity) {
-        Bucket* new_buckets = realloc(h1->buckets, h2->capacity * sizeof(Bucket));
-        if (!new_buckets) return 0;
-        
-        // Initialize new buckets to zero
-        memset(new_buckets + h1->capacity, 0, (h2->capacity - h1->capacity) * sizeof(Bucket));
-        
-        h1->buckets = new_buckets;
-        h1->capacity = h2->capacity;
-    }
-    
-    // Merge buckets by adding counts
-    for (uint16_t i = 0; i < h2->capacity; i++) {
-        h1->buckets[i].count += h2->buckets[i].count;
-    }
-    
-    // Update h1 metadata
-    h1->total_count += h2->total_count;
-    if (h2->min < h1->min) h1->min = h2->min;
-    if (h2->max > h1->max) h1->max = h2->max;
-    if (h2->min_bucket_id < h1->min_bucket_id) h1->min_bucket_id = h2->min_bucket_id;
-    
-    return 1;
+/*****************************/
+/* MEMORY ALLOCATION         */
+/*****************************/
+
+/*
+ * Everything a histogram owns is allocated through its allocator, or malloc when it has none.
+ * Inline storage is part of the histogram's own allocation: it is never resized or freed on its
+ * own, growing it allocates an out of line copy and clears the inline flag.
+ */
+
+static inline void* heist_alloc(const Heistogram* h, size_t size) {
+    const HeistAllocator* a = h->allocator;
+    return a ? a->alloc(a->ctx, size) : malloc(size);
 }
 
-static double heistogram_percentile(const Heistogram* h, double p) {
-    if (!h || p < 0 || p > 100) return 0;
+static inline void* heist_zalloc(const Heistogram* h, size_t size) {
+    if (!h->allocator) return calloc(1, size);
+    void* ptr = heist_alloc(h, size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
 
-    double target = ((100.0 - p) / 100.0) * h->total_count;
-    uint64_t cumsum = 0;
-    double pos;
-    uint64_t min_val;
-    uint64_t max_val;
-    //printf("total min is %u, max is %u\n", h->min, h->max);
-    for (int16_t i = h->capacity - 1; i >= 0; i--) {
-        if (h->buckets[i].count > 0) {
-            if (cumsum + h->buckets[i].count >= target) {
-                pos = ((double)(target - cumsum)) / (double)h->buckets[i].count;
-                min_val = get_bucket_min(i);
-                max_val = get_bucket_max(min_val);
-
-                if (max_val > h->max) max_val = h->max;
-                if (min_val < h->min) min_val = h->min;
-                //printf("in bucket %u, max_bucket_id is %u, looking for pos %f in count %u, min is %u, max is %u\n", i, h->capacity - 1, pos, h->buckets[i].count, min_val, max_val);
-
-                return (max_val) - pos * (max_val - min_val);
-            }
-            cumsum += h->buckets[i].count;
-        }
+static inline void heist_dealloc(const Heistogram* h, void* ptr) {
+    const HeistAllocator* a = h->allocator;
+    if (!ptr) return;
+    if (a) {
+        a->free(a->ctx, ptr);
+    } else {
+        free(ptr);
     }
-    
-    return h->min;
 }
 
-// Fixed heistogram_prank function
-static double heistogram_prank(const Heistogram* h, double value) {
-    if (!h || h->total_count == 0) return 0;
-    if (value < h->min) return 0;
-    if (value >= h->max) return 100.0;  // Fixed: was returning h->max
-    
-    int16_t bid = get_bucket_id(value);
-    if (bid >= h->capacity) return 100.0;
-    
-    uint64_t cumsum = 0;
-    
-    // Count all buckets below the target bucket
-    for (int16_t i = 0; i < bid; i++) {
-        cumsum += h->buckets[i].count;
+// Resizes ptr, or the inline block it points to when h has inline_flag set. Returns NULL and
+// leaves ptr as it was if memory runs out
+static void* heist_resize(Heistogram* h, void* ptr, size_t old_size, size_t new_size, uint8_t inline_flag) {
+    const HeistAllocator* a = h->allocator;
+    if (!(h->flags & inline_flag)) {
+        if (!a) return realloc(ptr, new_size);
+        if (a->realloc) return a->realloc(a->ctx, ptr, old_size, new_size);
     }
-    
-    // Calculate position within the target bucket
-    uint64_t min_val = get_bucket_min(bid);
-    uint64_t max_val = get_bucket_max(min_val);
-    
-    // Clamp bucket bounds to actual histogram bounds
-    if (max_val > h->max) max_val = h->max;
-    if (min_val < h->min) min_val = h->min;
-    
-    double pos;
-    if (max_val == min_val) {
-        pos = 1.0;  // All values in bucket are <= value
+    void* moved = heist_alloc(h, new_size);
+    if (!moved) return NULL;
+    if (ptr) memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+    if (h->flags & inline_flag) {
+        h->flags &= ~inline_flag;
     } else {
-        pos = ((double)(value - min_val)) / ((double)(max_val - min_val));
-        if (pos > 1.0) pos = 1.0;  // Clamp to bucket bounds
+        heist_dealloc(h, ptr);
     }
-    
-    // Add the fraction of the target bucket
-    cumsum += (uint64_t)(pos * h->buckets[bid].count);
-    
-    return 100.0 * cumsum / h->total_count;
+    return moved;
 }
 
-// New function: count elements <= value
-static uint64_t heistogram_count_upto(const Heistogram* h, uint64_t value) {
-    if (!h || h->total_count == 0) return 0;
-    if (value < h->min) return 0;
-    if (value >= h->max) return h->total_count;
-    
-    int16_t bid = get_bucket_id(value);
-    if (bid >= h->capacity) return h->total_count;
-    
-    uint64_t cumsum = 0;
-    
-    // Count all buckets below the target bucket
-    for (int16_t i = 0; i < bid; i++) {
-        cumsum += h->buckets[i].count;
+/*****************************/
+/* COMPACT COUNTERS          */
+/*****************************/
+
+/*
+ * Compact histograms keep their bucket counters as uint8_t, uint16_t or uint32_t, and widen the
+ * whole array to the smallest size that fits once a count would overflow. Histograms whose buckets
+ * stay small take 1/8 to 1/2 of the memory and merge bandwidth. Every other histogram has 8 byte
+ * counters, its buckets array holds plain Bucket structs. Counters never narrow again.
+ */
+
+static const uint64_t heist_count_limit[9] = {0, 0xFF, 0xFFFF, 0, 0xFFFFFFFF, 0, 0, 0, UINT64_MAX};
+
+// Smallest counter size in bytes that holds count
+static inline uint8_t heist_count_size(uint64_t count) {
+    if (count <= 0xFF) return 1;
+    if (count <= 0xFFFF) return 2;
+    if (count <= 0xFFFFFFFF) return 4;
+    return 8;
+}
+
+static inline uint64_t heist_counter_load(const void* counters, uint8_t size, size_t k) {
+    switch (size) {
+        case 1: return ((const uint8_t*)counters)[k];
+        case 2: return ((const uint16_t*)counters)[k];
+        case 4: return ((const uint32_t*)counters)[k];
+        default: return ((const Bucket*)counters)[k].count;
     }
-    
-    // Calculate position within the target bucket
-    uint64_t min_val = get_bucket_min(bid);
-    uint64_t max_val = get_bucket_max(min_val);
-    
-    // Clamp bucket bounds to actual histogram bounds
-    if (max_val > h->max) max_val = h->max;
-    if (min_val < h->min) min_val = h->min;
-    
-    double pos;
-    if (max_val == min_val) {
-        pos = 1.0;  // All values in bucket are <= value
-    } else {
-        pos = ((double)(value - min_val)) / ((double)(max_val - min_val));
-        if (pos > 1.0) pos = 1.0;  // Clamp to bucket bounds
+}
+
+static inline void heist_counter_store(void* counters, uint8_t size, size_t k, uint64_t count) {
+    switch (size) {
+        case 1: ((uint8_t*)counters)[k] = (uint8_t)count; break;
+        case 2: ((uint16_t*)counters)[k] = (uint16_t)count; break;
+        case 4: ((uint32_t*)counters)[k] = (uint32_t)count; break;
+        default: ((Bucket*)counters)[k].count = count; break;
     }
-    
-    // Add the fraction of the target bucket
-    cumsum += (uint64_t)(pos * h->buckets[bid].count);
-    
-    return cumsum;
 }
 
-static inline void* heistogram_serialize(const Heistogram* h, size_t* size) {
-    if (!h || !size) return NULL;
-    
-    // Find the highest used bucket ID
-    int16_t max_bucket_id = h->capacity - 1;
-    //printf("original bucket count %u\n", h->capacity);
-   
-    while (max_bucket_id >= 0 && h->buckets[max_bucket_id].count == 0) {
-        max_bucket_id--;
+// Position of the first pair of a sparse histogram whose bucket id is not below bid
+static inline size_t heist_sparse_find(const Heistogram* h, int32_t bid) {
+    const uint16_t* ids = HEIST_SPARSE_IDS(h);
+    size_t lo = 0, hi = h->sparse_size;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ids[mid] < bid) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
+}
 
-    //printf("max bucket id is %u and its count is %lu\n", max_bucket_id, h->buckets[max_bucket_id].count);
-    //printf("min bucket id is %u\n", h->min_bucket_id);
+// Count of bucket bid of a histogram with a bucket array, which must have a slot for it
+static inline uint64_t heist_dense_count(const Heistogram* h, int32_t bid) {
+    size_t k = bid - h->base_bucket_id;
+    if (h->count_size == 8) return HEIST_LOAD(h, h->buckets[k].count);
+    return heist_counter_load(h->buckets, h->count_size, k);
+}
 
-    // Max varint size is 9 bytes, allocate maximum possible size
-    size_t max_var_size = 9;
-    // We store: error_margin, max_bucket_id, total_count, min, max
-    size_t header_size = 5 * max_var_size;
-    // For each bucket we store the count
-    size_t bucket_size = max_var_size;
-    size_t max_total_size = header_size + ((max_bucket_id - h->min_bucket_id + 1) * bucket_size);
-    
-    uint8_t* buffer = malloc(max_total_size);
-    if (!buffer) return NULL;
-    
-    uint8_t* ptr = buffer;
-    //printf("encoding bucket count %u\n", max_bucket_id - h->min_bucket_id + 1);
-    ptr += encode_varint(max_bucket_id - h->min_bucket_id + 1, ptr); // Number of buckets to store
-    ptr += encode_varint(h->total_count, ptr);
-    ptr += encode_varint(h->min, ptr);
-    ptr += encode_varint(h->max - h->min, ptr);
-    ptr += encode_varint(h->min_bucket_id, ptr);
-    
-    // Write buckets in reverse order (higher ids first)
-    for (int16_t i = max_bucket_id; i >= h->min_bucket_id; i--) {
-        //printf("%lu-", h->buckets[i].count);
-        ptr += encode_bucket(h->buckets[i].count, ptr);
+// Count of bucket bid, which must have a slot unless h is sparse
+static inline uint64_t heist_bucket_count(const Heistogram* h, int32_t bid) {
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        size_t k = heist_sparse_find(h, bid);
+        return k < h->sparse_size && HEIST_SPARSE_IDS(h)[k] == bid ? HEIST_SPARSE_COUNTS(h)[k] : 0;
     }
-    //printf("\n");
-    // Calculate actual size used
-    *size = ptr - buffer;
-    
-    // Reallocate to actual size
-    buffer = realloc(buffer, *size);
-    return buffer;
+    return heist_dense_count(h, bid);
 }
 
-static inline Heistogram* heistogram_deserialize(const void* buffer, size_t size) {
-    if (!buffer) return NULL;
-    
-    const uint8_t* ptr = buffer;
-    uint16_t bucket_count;
-    uint64_t total_count;
-    uint64_t min;
-    uint64_t max;
-    uint16_t min_bucket_id;
-    
-    // Read header
-    size_t bytes_read = decode_header(ptr, &bucket_count, &total_count, &min, &max, &min_bucket_id);
-    if (bytes_read == 0) return NULL;
-    
-    ptr += bytes_read;
-    
-    uint16_t max_bucket_id = min_bucket_id + bucket_count - 1;
-
-    Heistogram* h = heistogram_create();
-    if (!h) return NULL;
-    
-    // Ensure we have enough capacity
-    if (max_bucket_id >= h->capacity) {
-        Bucket* new_buckets = realloc(h->buckets, (max_bucket_id + 1) * sizeof(Bucket));
-        if (!new_buckets) {
-            heistogram_free(h);
-            return NULL;
-        }
-        
-        // Initialize new buckets to zero
-        memset(new_buckets + h->capacity, 0, (max_bucket_id + 1 - h->capacity) * sizeof(Bucket));
-        
-        h->buckets = new_buckets;
-        h->capacity = max_bucket_id + 1;
+// Copies the counts of buckets [lo, lo + n) into out, with a single dispatch on the counter size
+static inline void heist_counts_get(const Heistogram* h, int32_t lo, size_t n, uint64_t* out) {
+    size_t first = lo - h->base_bucket_id;
+    switch (h->count_size) {
+        case 1: for (size_t k = 0; k < n; k++) out[k] = ((const uint8_t*)h->buckets)[first + k]; break;
+        case 2: for (size_t k = 0; k < n; k++) out[k] = ((const uint16_t*)h->buckets)[first + k]; break;
+        case 4: for (size_t k = 0; k < n; k++) out[k] = ((const uint32_t*)h->buckets)[first + k]; break;
+        default:
+            if (h->flags & HEIST_FLAG_SHARED) {
+                for (size_t k = 0; k < n; k++) out[k] = __atomic_load_n(&h->buckets[first + k].count, __ATOMIC_ACQUIRE);
+            } else {
+                memcpy(out, h->buckets + first, n * sizeof(uint64_t));
+            }
     }
-    
-    h->total_count = total_count;
-    h->min = min;
-    h->max = max;
-    
-    // Read buckets in reverse order
-    uint64_t count;
-    for (int16_t i = max_bucket_id; i >= min_bucket_id; i--) {
-        bytes_read = decode_bucket(ptr, &count);
-        if (bytes_read == 0) {
-            heistogram_free(h);
-            return NULL;
-        }
-        ptr += bytes_read;
-        h->buckets[i].count = count;
+}
+
+// The counts of buckets [lo, lo + n): read in place from 8 byte counters, otherwise copied to out
+static inline const uint64_t* heist_counts_span(const Heistogram* h, int32_t lo, size_t n, uint64_t* out) {
+    if (h->count_size == 8 && !(h->flags & HEIST_FLAG_SHARED)) return &h->buckets[lo - h->base_bucket_id].count;
+    heist_counts_get(h, lo, n, out);
+    return out;
+}
+
+// Widens every counter so count fits, returns 0 if the wider array can't be allocated
+static int heist_widen(Heistogram* h, uint64_t count) {
+    uint8_t size = heist_count_size(count);
+    if (size <= h->count_size) return 1;
+    void* counters = heist_resize(h, h->buckets, (size_t)h->capacity * h->count_size, (size_t)h->capacity * size, HEIST_FLAG_INLINE_BUCKETS);
+    if (!counters) return 0;
+    // From the top down, so no counter is overwritten before it is read
+    for (size_t k = h->capacity; k-- > 0;) {
+        heist_counter_store(counters, size, k, heist_counter_load(counters, h->count_size, k));
     }
-    for (int16_t i = 0; i < min_bucket_id && i < 16; i++){
-        h->buckets[i].count = 0;
+    h->buckets = (Bucket*)counters;
+    h->count_size = size;
+    return 1;
+}
+
+// Stores count in bucket bid, widening the counters if it doesn't fit. Returns 0 if they can't grow
+static inline int heist_bucket_set(Heistogram* h, int32_t bid, uint64_t count) {
+    size_t k = bid - h->base_bucket_id;
+    if (h->count_size == 8) {
+        h->buckets[k].count = count;
+        return 1;
     }
-    return h;
+    if (count > heist_count_limit[h->count_size] && !heist_widen(h, count)) return 0;
+    heist_counter_store(h->buckets, h->count_size, k, count);
+    return 1;
 }
 
-/*********************************************
-    FUNCTIONS OPERATING ON SERIALIZED DATA
-**********************************************/
+// Stores n counts into buckets [lo, lo + n), each of which must fit the counter size
+static inline void heist_counts_put(Heistogram* h, int32_t lo, size_t n, const uint64_t* counts) {
+    size_t first = lo - h->base_bucket_id;
+    switch (h->count_size) {
+        case 1: for (size_t k = 0; k < n; k++) ((uint8_t*)h->buckets)[first + k] = (uint8_t)counts[k]; break;
+        case 2: for (size_t k = 0; k < n; k++) ((uint16_t*)h->buckets)[first + k] = (uint16_t)counts[k]; break;
+        case 4: for (size_t k = 0; k < n; k++) ((uint32_t*)h->buckets)[first + k] = (uint32_t)counts[k]; break;
+        default: memcpy(h->buckets + first, counts, n * sizeof(uint64_t));
+    }
+}
 
-// Updated heistogram_percentile_serialized function
-static double heistogram_percentile_serialized(const void* buffer, size_t size, double p) {
-    if (!buffer || size < 3) return 0;  // Minimum size check for header
+// Counts are added in chunks of up to this many buckets
+#define HEIST_COUNTS_CHUNK 64
 
-    const uint8_t* ptr = buffer;
-    uint16_t bucket_count;   
-    uint64_t total_count;
-    uint64_t min;
-    uint64_t max;
-    uint16_t min_bucket_id;
-    // Decode the header
-    size_t bytes_read = decode_header(ptr, &bucket_count, &total_count, &min, &max, &min_bucket_id);
-    if (bytes_read == 0) return 0;
+// Adds n <= HEIST_COUNTS_CHUNK counts to buckets [lo, lo + n), widening the counters first if a
+// sum doesn't fit. Returns 0 and leaves the buckets unchanged if they can't grow
+static int heist_counts_add(Heistogram* h, int32_t lo, size_t n, const uint64_t* counts) {
+    if (h->count_size == 8) {
+        Bucket* buckets = h->buckets + (lo - h->base_bucket_id);
+        for (size_t k = 0; k < n; k++) buckets[k].count += counts[k];
+        return 1;
+    }
+    // The OR of all sums has the same highest bit as the largest one
+    uint64_t sums[HEIST_COUNTS_CHUNK], any = 0;
+    heist_counts_get(h, lo, n, sums);
+    for (size_t k = 0; k < n; k++) {
+        sums[k] += counts[k];
+        any |= sums[k];
+    }
+    if (any > heist_count_limit[h->count_size] && !heist_widen(h, any)) return 0;
+    heist_counts_put(h, lo, n, sums);
+    return 1;
+}
 
-    ptr += bytes_read;
+// Adds the counts of from's buckets [lo, hi], times scale, to those of h, which must have slots
+// for them. Returns 0 and leaves the counts of h unchanged if its counters can't grow
+static int heist_add_counts_from(Heistogram* h, const Heistogram* from, int32_t lo, int32_t hi, uint64_t scale) {
+    if (h->count_size == 8 && from->count_size == 8 && scale == 1) {
+        if (lo <= hi) heist_batch_kernels()->add_counts(&HEIST_BUCKET(h, lo).count, &HEIST_BUCKET(from, lo).count, hi - lo + 1);
+        return 1;
+    }
+    uint64_t counts[HEIST_COUNTS_CHUNK], sums[HEIST_COUNTS_CHUNK];
+    for (int32_t i = lo; i <= hi; i += HEIST_COUNTS_CHUNK) {
+        size_t n = hi - i + 1 < HEIST_COUNTS_CHUNK ? hi - i + 1 : HEIST_COUNTS_CHUNK;
+        heist_counts_get(from, i, n, counts);
+        if (scale != 1) for (size_t k = 0; k < n; k++) counts[k] *= scale;
+        if (heist_counts_add(h, i, n, counts)) continue;
 
-    uint16_t max_bucket_id = min_bucket_id + bucket_count - 1;
-    
-    double target = ((100.0 - p) / 100.0) * total_count;
-    uint64_t cumsum = 0;
-    uint64_t count;
-    //printf("total min is %u, max is %u\n", min, max);
-
-    // Process buckets in reverse order (higher IDs first)
-    for (int16_t i = max_bucket_id; i >= min_bucket_id; i--) {
-        bytes_read = decode_bucket(ptr, &count);
-        if (bytes_read == 0) return 0;
-        ptr += bytes_read;
-        
-        if (count > 0 && cumsum + count >= target) {
-            double pos = ((double)(target - cumsum)) / (double)count;
-            uint64_t min_val = get_bucket_min(i);
-            uint64_t max_val = get_bucket_max(min_val);
-            if (max_val > max) max_val = max;
-            if (min_val < min) min_val = min;
-            //printf("in bucket %u, max_bucket_id is %u, looking for pos %f in count %u, min is %u, max is %u\n", i, max_bucket_id, pos, count, min_val, max_val);
-            return max_val - pos * (max_val - min_val);
+        // Take back what the earlier chunks added
+        for (int32_t j = lo; j < i; j += HEIST_COUNTS_CHUNK) {
+            heist_counts_get(from, j, HEIST_COUNTS_CHUNK, counts);
+            heist_counts_get(h, j, HEIST_COUNTS_CHUNK, sums);
+            for (size_t k = 0; k < HEIST_COUNTS_CHUNK; k++) sums[k] -= counts[k] * scale;
+            heist_counts_put(h, j, HEIST_COUNTS_CHUNK, sums);
         }
-        cumsum += count;
+        return 0;
     }
+    return 1;
+}
 
-    return min;
+/*****************************/
+/* SERIALIZATION FORMATS     */
+/*****************************/
+
+/*
+ * Format 1 is five header varints (bucket count, total count, min, max - min, min bucket id)
+ * followed by one varint count per bucket, highest bucket id first. Format 2 prefixes the same
+ * header with HEIST_FORMAT_MAGIC, the format version and the bucket mapping, then stores the
+ * counts in the same order in groups of four. All control bytes come first, one per group with
+ * a 2-bit width code per count (1, 2, 4 or 8 little-endian bytes, first count in the low bits),
+ * followed by the count bytes. Since the data offsets only depend on the control bytes, a group
+ * decodes with one table lookup and one byte shuffle. The last group is padded with zero counts.
+ * A format 1 buffer starts with a bucket count varint, which is never 0xFE.
+ */
+
+#define HEIST_FORMAT_MAGIC 0xFE
+#define HEIST_FORMAT_V1 1
+#define HEIST_FORMAT_V2 2
+#define HEIST_FORMAT_MAPPING HEIST_PRECISION  // Bucket mapping recorded by format 2, the precision tier
+#define HEIST_V2_PREAMBLE 3      // Magic, version and mapping bytes
+
+// Format written by heistogram_serialize and heistogram_serialize_into. Format 1 stays the default
+// so existing readers can parse the output, define HEIST_SERIALIZE_VERSION as 2 to opt in to
+// format 2. Tiers other than 2% always write format 2, format 1 can't record their mapping
+#ifndef HEIST_SERIALIZE_VERSION
+#define HEIST_SERIALIZE_VERSION (HEIST_PRECISION == HEIST_PRECISION_2 ? HEIST_FORMAT_V1 : HEIST_FORMAT_V2)
+#endif
+#if HEIST_SERIALIZE_VERSION == HEIST_FORMAT_V1 && HEIST_PRECISION != HEIST_PRECISION_2
+#error "Format 1 can't record the precision, it only supports HEIST_PRECISION_2"
+#endif
+
+// Whether this precision can write the given format
+static inline int heist_format_supported(uint8_t version) {
+    return version == HEIST_FORMAT_V2 || (version == HEIST_FORMAT_V1 && HEIST_PRECISION == HEIST_PRECISION_2);
 }
 
+// Max varint size is 9 bytes, the header holds 5 varints after the optional preamble
+#define HEIST_MAX_VARINT_SIZE 9
+#define HEIST_HEADER_SIZE_BOUND (5 * HEIST_MAX_VARINT_SIZE)
+#define HEIST_MAX_GROUP_SIZE 33  // Control byte and four 8 byte counts
+#define HEIST_GROUPS(n) (((size_t)(n) + 3) / 4)
 
+// Upper bound of the encoded counts in either format
+#define HEIST_COUNTS_SIZE_BOUND(n) ((size_t)(n) * HEIST_MAX_VARINT_SIZE + HEIST_MAX_GROUP_SIZE)
 
-// Fixed function to merge in-memory Heistogram with serialized Heistogram
-static Heistogram* heistogram_merge_serialized(Heistogram* h, const void* buffer, size_t size) {
-    if (!h || !buffer || size < 3) return NULL;
-    
-    const uint8_t* ptr = buffer;
+typedef struct {
+    uint8_t version;
     uint16_t bucket_count;
+    uint16_t min_bucket_id;
     uint64_t total_count;
     uint64_t min;
     uint64_t max;
-    uint16_t min_bucket_id;
-    
-    
-    // Decode the header
-    size_t bytes_read = decode_header(ptr, &bucket_count, &total_count, &min, &max, &min_bucket_id);
-    if (bytes_read == 0) return NULL;
-    ptr += bytes_read;
-    
-    uint16_t max_bucket_id = min_bucket_id + bucket_count - 1;
-    
-    // Create a new Heistogram for the result
-    Heistogram* result = heistogram_create();
-    if (!result) return NULL;
-    
-    // Find the maximum capacity needed
-    uint16_t new_capacity = h->capacity > (max_bucket_id + 1) ? h->capacity : (max_bucket_id + 1);
-    
-    // Resize result to accommodate all buckets
-    if (new_capacity > result->capacity) {
-        Bucket* new_buckets = realloc(result->buckets, new_capacity * sizeof(Bucket));
-        if (!new_buckets) {
-            heistogram_free(result);
-            return NULL;
-        }
-        
-        // Initialize new buckets to zero
-        memset(new_buckets + result->capacity, 0, (new_capacity - result->capacity) * sizeof(Bucket));
-        
-        result->buckets = new_buckets;
-        result->capacity = new_capacity;
+} HeistHeader;
+
+// Decodes the header of either format, returns the offset of the first count or 0 if the buffer is invalid
+static size_t heist_read_header(const void* buffer, size_t size, HeistHeader* hdr) {
+    heist_tables_init();
+    const uint8_t* bytes = (const uint8_t*)buffer;
+    size_t preamble = 0;
+    hdr->version = HEIST_FORMAT_V1;
+    if (size > 0 && bytes[0] == HEIST_FORMAT_MAGIC) {
+        if (size < HEIST_V2_PREAMBLE || bytes[1] != HEIST_FORMAT_V2 || bytes[2] != HEIST_FORMAT_MAPPING) return 0;
+        hdr->version = HEIST_FORMAT_V2;
+        preamble = HEIST_V2_PREAMBLE;
+    } else if (HEIST_PRECISION != HEIST_PRECISION_2) {
+        return 0;  // Format 1 buffers always use the 2% mapping
     }
-    
-    // Copy counts from h
-    for (uint16_t i = 0; i < h->capacity; i++) {
-        result->buckets[i].count += h->buckets[i].count;
+
+    // Short buffers are decoded from a padded copy so the varints never read past the end
+    const uint8_t* header = bytes + preamble;
+    size_t available = size - preamble;
+    uint8_t padded[HEIST_HEADER_SIZE_BOUND];
+    if (available < HEIST_HEADER_SIZE_BOUND) {
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, header, available);
+        header = padded;
     }
-    
-    // Add counts from serialized data
-    uint64_t count;
-    for (int16_t i = max_bucket_id; i >= min_bucket_id; i--) {
-        bytes_read = decode_bucket(ptr, &count);
-        if (bytes_read == 0) {
-            heistogram_free(result);
-            return NULL;
+    size_t bytes_read = decode_header(header, &hdr->bucket_count, &hdr->total_count, &hdr->min, &hdr->max, &hdr->min_bucket_id);
+    if (bytes_read == 0 || bytes_read > available) return 0;
+    if (hdr->bucket_count > 0 && (uint32_t)hdr->min_bucket_id + hdr->bucket_count - 1 > HEIST_MAX_BUCKET_ID) return 0;
+    return preamble + bytes_read;
+}
+
+// Precision tier a serialized histogram was written with, whatever tier this code uses, or -1 if
+// the buffer isn't a histogram. Lets a binary that mixes tiers pick the code that can read it
+static int heistogram_serialized_precision(const void* buffer, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)buffer;
+    if (!buffer || size == 0) return -1;
+    if (bytes[0] != HEIST_FORMAT_MAGIC) return HEIST_PRECISION_2;
+    if (size < HEIST_V2_PREAMBLE || bytes[1] != HEIST_FORMAT_V2 || bytes[2] > HEIST_PRECISION_5) return -1;
+    return bytes[2];
+}
+
+// Width code by the number of significant bytes of a count
+static const uint8_t heist_group_code_of[9] = {0, 0, 1, 2, 2, 3, 3, 3, 3};
+
+static inline uint8_t heist_group_code(uint64_t count) {
+    return heist_group_code_of[(71 - heist_clz64(count | 1)) >> 3];
+}
+
+// Writes all 8 bytes of value in little-endian order
+static inline void heist_store_le64(uint8_t* ptr, uint64_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(ptr, &value, sizeof(value));
+#else
+    for (int b = 0; b < 8; b++) ptr[b] = (uint8_t)(value >> (8 * b));
+#endif
+}
+
+// Encodes up to four counts as one format 2 group, missing counts are written as zero.
+// Returns the control byte, data holds the count bytes and advances past them. Every count is
+// stored as 8 bytes before advancing by its width, so data needs 7 bytes of slack
+#define HEIST_GROUP_SLACK 7
+static inline uint8_t heist_encode_group(const uint64_t* counts, size_t n, uint8_t** data) {
+    uint8_t* ptr = *data;
+    uint8_t control = 0;
+    for (size_t k = 0; k < 4; k++) {
+        uint64_t count = k < n ? counts[k] : 0;
+        uint8_t code = heist_group_code(count);
+        control |= code << (2 * k);
+        heist_store_le64(ptr, count);
+        ptr += heist_group_code_size[code];
+    }
+    *data = ptr;
+    return control;
+}
+
+typedef size_t (*heist_decode_groups_kernel)(const uint8_t* control, const uint8_t* ptr, const uint8_t* end, uint64_t* out, size_t groups);
+
+// Decodes format 2 groups, four counts each. Returns the data bytes read or 0 if the buffer ends first
+static size_t heist_decode_groups_scalar(const uint8_t* control, const uint8_t* ptr, const uint8_t* end, uint64_t* out, size_t groups) {
+    const uint8_t* start = ptr;
+    for (size_t g = 0; g < groups; g++) {
+        if ((size_t)(end - ptr) < heist_group_size[control[g]]) return 0;
+        for (int k = 0; k < 4; k++) {
+            uint8_t size = heist_group_code_size[(control[g] >> (2 * k)) & 3];
+            uint64_t count = 0;
+            for (uint8_t b = 0; b < size; b++) {
+                count |= (uint64_t)ptr[b] << (8 * b);
+            }
+            out[4 * g + k] = count;
+            ptr += size;
         }
-        ptr += bytes_read;
-        
-        result->buckets[i].count += count;
     }
-    
-    // Update result metadata
-    result->total_count = h->total_count + total_count;
-    result->min = h->min < min ? h->min : min;
-    result->max = h->max > max ? h->max : max;
-    result->min_bucket_id = h->min_bucket_id < min_bucket_id ? h->min_bucket_id : min_bucket_id;
-    
-    return result;
+    return ptr - start;
+}
 
+#ifdef HEIST_X86_SIMD
+// Loads 16 data bytes and spreads them into four counts with one shuffle. Groups wider than
+// 16 bytes or too close to the end of the buffer take the scalar path
+__attribute__((target("avx2")))
+static size_t heist_decode_groups_avx2(const uint8_t* control, const uint8_t* ptr, const uint8_t* end, uint64_t* out, size_t groups) {
+    const uint8_t* start = ptr;
+    for (size_t g = 0; g < groups; g++) {
+        uint8_t c = control[g];
+        uint8_t size = heist_group_size[c];
+        if (end - ptr >= 16 && size <= 16) {
+            __m256i data = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ptr));
+            __m256i shuffle = _mm256_loadu_si256((const __m256i*)heist_group_shuffle[c]);
+            _mm256_storeu_si256((__m256i*)(out + 4 * g), _mm256_shuffle_epi8(data, shuffle));
+            ptr += size;
+        } else {
+            size_t bytes_read = heist_decode_groups_scalar(control + g, ptr, end, out + 4 * g, 1);
+            if (bytes_read == 0) return 0;
+            ptr += bytes_read;
+        }
+    }
+    return ptr - start;
 }
+#endif /* HEIST_X86_SIMD */
 
-// Fixed function to merge two serialized Heistograms
-static Heistogram* heistogram_merge_two_serialized(const void* buffer1, size_t size1, const void* buffer2, size_t size2) {
-    if (!buffer1 || size1 < 3 || !buffer2 || size2 < 3) return NULL;
-    
-    // Decode headers
-    const uint8_t* ptr1 = buffer1;
-    uint16_t bucket_count1;
-    uint64_t total_count1;
-    uint64_t min1;
-    uint64_t max1;
-    uint16_t min_bucket_id1;
-    
-    size_t bytes_read1 = decode_header(ptr1, &bucket_count1, &total_count1, &min1, &max1, &min_bucket_id1);
-    if (bytes_read1 == 0) return NULL;
-    ptr1 += bytes_read1;
-    
-    uint16_t max_bucket_id1 = min_bucket_id1 + bucket_count1 - 1;
-    
-    const uint8_t* ptr2 = buffer2;
-    uint16_t bucket_count2;
-    uint64_t total_count2;
-    uint64_t min2;
-    uint64_t max2;
-    uint16_t min_bucket_id2;
-    
-    size_t bytes_read2 = decode_header(ptr2, &bucket_count2, &total_count2, &min2, &max2, &min_bucket_id2);
-    if (bytes_read2 == 0) return NULL;
-    ptr2 += bytes_read2;
-    
-    uint16_t max_bucket_id2 = min_bucket_id2 + bucket_count2 - 1;
-    
-    // Create a new Heistogram for the result
-    Heistogram* result = heistogram_create();
-    if (!result) return NULL;
-    
-    // Find the maximum capacity needed
-    uint16_t max_bucket_id = max_bucket_id1 > max_bucket_id2 ? max_bucket_id1 : max_bucket_id2;
-    uint16_t min_bucket_id = min_bucket_id1 < min_bucket_id2 ? min_bucket_id1 : min_bucket_id2;
-    uint16_t new_capacity = max_bucket_id + 1;
-    
-    // Resize result to accommodate all buckets
-    if (new_capacity > result->capacity) {
-        Bucket* new_buckets = realloc(result->buckets, new_capacity * sizeof(Bucket));
-        if (!new_buckets) {
-            heistogram_free(result);
-            return NULL;
+// Picks the group decoder for the running CPU, resolved once per process with the same relaxed
+// caching as heist_batch_kernels
+static heist_decode_groups_kernel heist_group_decoder(void) {
+    static heist_decode_groups_kernel selected = NULL;
+    heist_decode_groups_kernel decode = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+    if (decode) return decode;
+    decode = heist_decode_groups_scalar;
+#ifdef HEIST_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) decode = heist_decode_groups_avx2;
+#endif
+    __atomic_store_n(&selected, decode, __ATOMIC_RELAXED);
+    return decode;
+}
+
+// Counts are decoded in chunks of this size, a multiple of the format 2 group size
+#define HEIST_DECODE_CHUNK 32
+
+typedef struct {
+    const uint8_t* ptr;       // Next encoded count, for format 2 its first data byte
+    const uint8_t* end;       // End of the buffer
+    const uint8_t* data;      // First encoded count, for format 2 the start of the data bytes
+    const uint8_t* controls;  // Format 2 control bytes
+    const uint8_t* control;   // Control byte of the next group
+    uint8_t version;
+} HeistCountDecoder;
+
+// Prepares to decode the counts stored at ptr, returns 0 if the format 2 control bytes don't fit the buffer
+static inline int heist_count_decoder_init(HeistCountDecoder* d, const HeistHeader* hdr, const uint8_t* ptr, const uint8_t* end) {
+    d->version = hdr->version;
+    d->end = end;
+    d->controls = d->control = ptr;
+    if (hdr->version == HEIST_FORMAT_V2) {
+        if ((size_t)(end - ptr) < HEIST_GROUPS(hdr->bucket_count)) return 0;
+        ptr += HEIST_GROUPS(hdr->bucket_count);
+    }
+    d->data = d->ptr = ptr;
+    return 1;
+}
+
+// Moves to the count at stored position first (a multiple of 4), whose bytes start offset bytes after data
+static inline void heist_count_decoder_seek(HeistCountDecoder* d, size_t first, size_t offset) {
+    d->control = d->controls + first / 4;
+    d->ptr = d->data + offset;
+}
+
+// Decodes the next n counts in stored order, returns 0 if the buffer ends first. Format 2 works
+// on whole groups: n must be a multiple of 4 except on the last call, and out needs room for n
+// rounded up to a multiple of 4
+static inline int heist_decode_counts(HeistCountDecoder* d, uint64_t* out, size_t n) {
+    if (d->version == HEIST_FORMAT_V2) {
+        size_t bytes_read = heist_group_decoder()(d->control, d->ptr, d->end, out, HEIST_GROUPS(n));
+        d->ptr += bytes_read;
+        d->control += HEIST_GROUPS(n);
+        return bytes_read > 0 || n == 0;
+    }
+
+    const uint8_t* ptr = d->ptr;
+    if ((size_t)(d->end - ptr) >= n * HEIST_MAX_VARINT_SIZE) {
+        for (size_t k = 0; k < n; k++) {
+            ptr += decode_bucket(ptr, &out[k]);
+        }
+    } else {
+        for (size_t k = 0; k < n; k++) {
+            if (ptr >= d->end || (size_t)(d->end - ptr) < heist_varint_length(*ptr)) return 0;
+            ptr += decode_bucket(ptr, &out[k]);
         }
-        
-        // Initialize new buckets to zero
-        memset(new_buckets + result->capacity, 0, (new_capacity - result->capacity) * sizeof(Bucket));
-        
-        result->buckets = new_buckets;
-        result->capacity = new_capacity;
     }
-    
-    // Read counts from first serialized Heistogram
-    uint64_t count;
-    for (int16_t i = max_bucket_id1; i >= min_bucket_id1; i--) {
-        bytes_read1 = decode_bucket(ptr1, &count);
-        if (bytes_read1 == 0) {
-            heistogram_free(result);
-            return NULL;
+    d->ptr = ptr;
+    return 1;
+}
+
+// Adds every serialized count, times scale, to the buckets of h, which must hold the header's
+// bucket range. Returns 0 if the buffer is truncated or compact counters can't grow
+static int heist_read_counts(const HeistHeader* hdr, HeistCountDecoder* d, Heistogram* h, uint64_t scale) {
+    uint64_t counts[HEIST_DECODE_CHUNK], ascending[HEIST_DECODE_CHUNK];
+    int32_t i = (int32_t)hdr->min_bucket_id + hdr->bucket_count - 1;
+    while (i >= hdr->min_bucket_id) {
+        size_t n = i - hdr->min_bucket_id + 1;
+        if (n > HEIST_DECODE_CHUNK) n = HEIST_DECODE_CHUNK;
+        if (!heist_decode_counts(d, counts, n)) return 0;
+        if (scale != 1) for (size_t k = 0; k < n; k++) counts[k] *= scale;
+        i -= n;
+        // counts[k] belongs to bucket i + n - k
+        if (h->count_size == 8) {
+            Bucket* chunk = &HEIST_BUCKET(h, i + 1);
+            for (size_t k = 0; k < n; k++) chunk[n - 1 - k].count += counts[k];
+            continue;
         }
-        ptr1 += bytes_read1;
-        result->buckets[i].count += count;
+        for (size_t k = 0; k < n; k++) ascending[n - 1 - k] = counts[k];
+        if (!heist_counts_add(h, i + 1, n, ascending)) return 0;
     }
+    return 1;
+}
+
+// Sets the fields of an empty histogram without any storage
+static void heist_init_fields(Heistogram* h, const HeistAllocator* allocator) {
+    heist_tables_init();
+
+    h->capacity = 16;
+    h->base_bucket_id = 0;
+    h->total_count = 0;
+    h->max = 0;
+    h->min = 0;
+    h->min_bucket_id = 0;
+    h->max_bucket_id = 0;
+    h->index = NULL;
+    h->index_capacity = 0;
+    h->index_mode = HEIST_INDEX_NONE;
+    h->index_dirty = 0;
+    h->flags = 0;
+    h->count_size = 8;
+    h->sparse_size = 0;
+    h->allocator = allocator;
+    h->buckets = NULL;
+    h->occupied = NULL;
+}
+
+// Sets up an empty histogram in caller provided storage, returns 0 if buckets can't be allocated
+static int heist_init(Heistogram* h, const HeistAllocator* allocator) {
+    heist_init_fields(h, allocator);
     
-    // Read counts from second serialized Heistogram
-    for (int16_t i = max_bucket_id2; i >= min_bucket_id2; i--) {
-        bytes_read2 = decode_bucket(ptr2, &count);
-        if (bytes_read2 == 0) {
-            heistogram_free(result);
-            return NULL;
+    // Initialize all buckets with zero count
+    h->buckets = (Bucket*)heist_zalloc(h, h->capacity * sizeof(Bucket));
+    h->occupied = (uint64_t*)heist_zalloc(h, HEIST_BITMAP_WORDS(h->capacity) * sizeof(uint64_t));
+    if (!h->buckets || !h->occupied) {
+        heist_dealloc(h, h->buckets);
+        heist_dealloc(h, h->occupied);
+        h->buckets = NULL;
+        h->occupied = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Frees what heist_init and later growth allocated, not the Heistogram itself
+static void heist_release(Heistogram* h) {
+    heist_dealloc(h, h->index);
+    if (!(h->flags & HEIST_FLAG_INLINE_BUCKETS)) heist_dealloc(h, h->buckets);
+    if (!(h->flags & HEIST_FLAG_INLINE_BITMAP)) heist_dealloc(h, h->occupied);
+}
+
+/*
+ * The occupancy bitmap lets scans skip the empty runs log scale latency histograms are full of:
+ * a zero word stands for 64 empty buckets, and a bit scan finds the first and last non-empty
+ * bucket of any other word. Buckets in between are walked one by one, which is cheaper than
+ * jumping bit to bit once a window is even half full. Bit k belongs to buckets[k], bits outside
+ * the occupied window are always clear. Shared histograms have every bit set, their writers
+ * don't maintain the bitmap.
+ */
+
+static inline void heist_mark_occupied(Heistogram* h, uint16_t bid) {
+    uint32_t k = bid - h->base_bucket_id;
+    h->occupied[k >> 6] |= 1ULL << (k & 63);
+}
+
+static inline void heist_mark_empty(Heistogram* h, uint16_t bid) {
+    uint32_t k = bid - h->base_bucket_id;
+    h->occupied[k >> 6] &= ~(1ULL << (k & 63));
+}
+
+// The bits of buckets [bid, bid + 63], zero for buckets without a slot
+static inline uint64_t heist_occupancy_bits(const Heistogram* h, int32_t bid) {
+    int32_t k = bid - h->base_bucket_id;
+    if (k < 0) return k > -64 ? heist_occupancy_bits(h, h->base_bucket_id) << -k : 0;
+    int32_t words = HEIST_BITMAP_WORDS(h->capacity), word = k >> 6, shift = k & 63;
+    if (word >= words) return 0;
+    uint64_t bits = h->occupied[word] >> shift;
+    if (shift && word + 1 < words) bits |= h->occupied[word + 1] << (64 - shift);
+    return bits;
+}
+
+// Sets the bits of from's non-empty buckets within [lo, hi], the two arrays may start at
+// different buckets
+static inline void heist_occupancy_or(Heistogram* h, const Heistogram* from, int32_t lo, int32_t hi) {
+    int32_t base = h->base_bucket_id;
+    if (base == from->base_bucket_id) {
+        for (int32_t word = (lo - base) >> 6; word <= (hi - base) >> 6; word++) {
+            h->occupied[word] |= from->occupied[word];
         }
-        ptr2 += bytes_read2;
-        result->buckets[i].count += count;
+        return;
+    }
+    for (int32_t word = (lo - base) >> 6; word <= (hi - base) >> 6; word++) {
+        h->occupied[word] |= heist_occupancy_bits(from, base + (word << 6));
     }
-    
-    // Update result metadata
-    result->total_count = total_count1 + total_count2;
-    result->min = min1 < min2 ? min1 : min2;
-    result->max = max1 > max2 ? max1 : max2;
-    result->min_bucket_id = min_bucket_id;
-    
-    return result;
 }
 
-// New function to merge serialized Heistogram into an existing in-memory Heistogram
-static int heistogram_merge_inplace_serialized(Heistogram* h, const void* buffer, size_t size) {
-    if (!h || !buffer || size < 3) return 0;
-    
-    const uint8_t* ptr = buffer;
-    uint16_t bucket_count;
-    uint64_t total_count;
-    uint64_t min;
-    uint64_t max;
-    uint16_t min_bucket_id;
-    
-    // Decode the header
-    size_t bytes_read = decode_header(ptr, &bucket_count, &total_count, &min, &max, &min_bucket_id);
-    if (bytes_read == 0) return 0;
+// Recomputes the bits of buckets [lo, hi] from their counts
+static void heist_occupancy_rebuild(Heistogram* h, int32_t lo, int32_t hi) {
+    for (int32_t i = lo; i <= hi; i++) {
+        if (heist_dense_count(h, i)) heist_mark_occupied(h, i);
+        else heist_mark_empty(h, i);
+    }
+}
 
-    if(total_count == 0) return 1; // we are merging with an empty heistgram
+// Narrows [*first, *last] to the non-empty buckets of bitmap word, returns 0 if it has none
+static inline int heist_word_span(const Heistogram* h, int32_t word, int32_t* first, int32_t* last) {
+    uint64_t bits = h->occupied[word];
+    if (!bits) return 0;
+    int32_t start = h->base_bucket_id + (word << 6);
+    int32_t lowest = start + heist_ctz64(bits);
+    int32_t highest = start + 63 - heist_clz64(bits);
+    if (lowest > *first) *first = lowest;
+    if (highest < *last) *last = highest;
+    return *first <= *last;
+}
 
-    ptr += bytes_read;
-    
-    uint16_t max_bucket_id = min_bucket_id + bucket_count - 1;
-    
+// Highest non-empty bucket at or below i, -1 if there is none
+static inline int32_t heist_prev_occupied(const Heistogram* h, int32_t i) {
+    int32_t k = i - h->base_bucket_id;
+    if (k < 0) return -1;
+    if (k >= h->capacity) k = h->capacity - 1;
+    int32_t word = k >> 6;
+    uint64_t bits = h->occupied[word] & (~0ULL >> (63 - (k & 63)));
+    while (!bits) {
+        if (--word < 0) return -1;
+        bits = h->occupied[word];
+    }
+    return h->base_bucket_id + (word << 6) + 63 - heist_clz64(bits);
+}
 
-    // Expand h if needed to accommodate serialized Heistogram's buckets
-    if (max_bucket_id >= h->capacity) {
-        uint16_t new_capacity = max_bucket_id + 1;
-        Bucket* new_buckets = realloc(h->buckets, new_capacity * sizeof(Bucket));
+// Lowest non-empty bucket at or above i, -1 if there is none
+static inline int32_t heist_next_occupied(const Heistogram* h, int32_t i) {
+    int32_t k = i - h->base_bucket_id;
+    if (k < 0) k = 0;
+    int32_t words = HEIST_BITMAP_WORDS(h->capacity);
+    int32_t word = k >> 6;
+    if (word >= words) return -1;
+    uint64_t bits = h->occupied[word] & (~0ULL << (k & 63));
+    while (!bits) {
+        if (++word >= words) return -1;
+        bits = h->occupied[word];
+    }
+    return h->base_bucket_id + (word << 6) + heist_ctz64(bits);
+}
+
+/*
+ * The bucket array only covers [base_bucket_id, base_bucket_id + capacity), so a histogram of
+ * values between 10^6 and 10^7 doesn't carry the hundreds of empty buckets below them. The array
+ * grows at either end, and an empty histogram is rebased to wherever its first values land.
+ */
+
+// Whether bucket bid has a slot in the bucket array
+static inline int heist_has_bucket(const Heistogram* h, int32_t bid) {
+    return (uint32_t)(bid - h->base_bucket_id) < h->capacity;
+}
+
+// Makes buckets [lo, hi] addressable, new buckets start empty
+static int heist_reserve(Heistogram* h, int32_t lo, int32_t hi) {
+    int32_t base = h->base_bucket_id, top = base + h->capacity - 1;
+
+    // Without counts there is nothing to keep in place. Inline buckets are sized for the expected
+    // spread of values, so they move even when they cover the first ones, to center them
+    int rebase = h->total_count == 0 && !(h->flags & HEIST_FLAG_SHARED);
+    int center = rebase && (h->flags & HEIST_FLAG_INLINE_BUCKETS);
+    if (lo >= base && hi <= top && !center) return 1;
+    int32_t new_base = rebase || lo < base ? lo : base;
+    if (center && hi - lo + 1 < h->capacity) {
+        int32_t slack = (h->capacity - (hi - lo + 1)) / 2;
+        new_base = lo > slack ? lo - slack : 0;
+    }
+    int32_t new_top = rebase ? new_base + h->capacity - 1 : top;
+    if (hi > new_top) new_top = hi;
+    size_t capacity = new_top - new_base + 1;
+    size_t shift = rebase ? 0 : base - new_base;
+
+    size_t words = HEIST_BITMAP_WORDS(h->capacity), new_words = HEIST_BITMAP_WORDS(capacity);
+    if (new_words > words) {
+        uint64_t* occupied = (uint64_t*)heist_resize(h, h->occupied, words * sizeof(uint64_t), new_words * sizeof(uint64_t), HEIST_FLAG_INLINE_BITMAP);
+        if (!occupied) return 0;
+        memset(occupied + words, 0, (new_words - words) * sizeof(uint64_t));
+        h->occupied = occupied;
+    }
+    size_t size = h->count_size;
+    if (capacity > h->capacity) {
+        uint8_t* new_buckets = (uint8_t*)heist_resize(h, h->buckets, h->capacity * size, capacity * size, HEIST_FLAG_INLINE_BUCKETS);
         if (!new_buckets) return 0;
-        
-        // Initialize new buckets to zero
-        memset(new_buckets + h->capacity, 0, (new_capacity - h->capacity) * sizeof(Bucket));
-        
-        h->buckets = new_buckets;
-        h->capacity = new_capacity;
+        memset(new_buckets + h->capacity * size, 0, (capacity - h->capacity) * size);
+        h->buckets = (Bucket*)new_buckets;
     }
-    
-    // Add counts from serialized data
-    uint64_t count;
-    for (int16_t i = max_bucket_id; i >= min_bucket_id; i--) {
-        bytes_read = decode_bucket(ptr, &count);
-        if (bytes_read == 0) return 0;
-        ptr += bytes_read;
-        
-        h->buckets[i].count += count;
+
+    // Growing downward moves the counts up, their bits are recomputed at the new positions
+    if (shift) {
+        uint8_t* counters = (uint8_t*)h->buckets;
+        memmove(counters + shift * size, counters, h->capacity * size);
+        memset(counters, 0, shift * size);
+        memset(h->occupied, 0, new_words * sizeof(uint64_t));
     }
-    
-    // Update h metadata
-    h->total_count += total_count;
-    if (min < h->min) h->min = min;
-    if (max > h->max) h->max = max;
-    if (min_bucket_id < h->min_bucket_id) h->min_bucket_id = min_bucket_id;
-    
+    h->base_bucket_id = new_base;
+    h->capacity = capacity;
+    if (shift && h->total_count) heist_occupancy_rebuild(h, h->min_bucket_id, h->max_bucket_id);
+    h->index_dirty = 1;
     return 1;
 }
 
+// Like heist_reserve, but leaves room for 16 more buckets past each end that has to grow
+static inline int heist_reserve_slack(Heistogram* h, int32_t lo, int32_t hi) {
+    if (lo < h->base_bucket_id) lo = lo > 16 ? lo - 16 : 0;
+    if (hi >= h->base_bucket_id + h->capacity) hi += 16;
+    return heist_reserve(h, lo, hi);
+}
+
+
+/*
+ * Every non-empty bucket lies in [min_bucket_id, max_bucket_id], kept exact by inserts, removes,
+ * merges and deserialization, so scans never touch the slack above or the zeros below it.
+ * Windows are passed around as int32_t pairs where lo > hi means empty.
+ */
+
+// Bucket range a scan has to cover. Shared histograms don't track it under concurrent writers,
+// their scans cover all preallocated buckets
+static inline void heist_scan_window(const Heistogram* h, int32_t* lo, int32_t* hi) {
+    if (h->flags & HEIST_FLAG_SHARED) {
+        *lo = h->base_bucket_id;
+        *hi = h->base_bucket_id + h->capacity - 1;
+    } else if (h->total_count == 0) {
+        *lo = 0;
+        *hi = -1;
+    } else {
+        *lo = h->min_bucket_id;
+        *hi = h->max_bucket_id;
+    }
+}
+
+static inline void heist_window_union(int32_t* lo, int32_t* hi, int32_t lo2, int32_t hi2) {
+    if (lo2 > hi2) return;
+    if (*lo > *hi) {
+        *lo = lo2;
+        *hi = hi2;
+        return;
+    }
+    if (lo2 < *lo) *lo = lo2;
+    if (hi2 > *hi) *hi = hi2;
+}
+
+static inline void heist_set_window(Heistogram* h, int32_t lo, int32_t hi) {
+    h->min_bucket_id = lo <= hi ? lo : 0;
+    h->max_bucket_id = lo <= hi ? hi : 0;
+}
+
+// Sets the window to the non-empty buckets within [lo, hi], for ranges that may have empty ends
+static inline void heist_trim_window(Heistogram* h, int32_t lo, int32_t hi) {
+    heist_occupancy_rebuild(h, lo, hi);
+    int32_t first = heist_next_occupied(h, lo);
+    if (first < 0 || first > hi) {
+        heist_set_window(h, 0, -1);
+        return;
+    }
+    heist_set_window(h, first, heist_prev_occupied(h, hi));
+}
+
+/*****************************/
+/* CUMULATIVE COUNT INDEX    */
+/*****************************/
+
+/*
+ * Indexed histograms answer percentile, prank and count_upto with a binary search instead of a
+ * scan. HEIST_INDEX_LAZY keeps prefix sums (index[i] = buckets[0..i]) and HEIST_INDEX_FENWICK a
+ * Fenwick tree (1-based, index[0] unused), both over the slots of the bucket array. Bulk writes such as merges only mark the index dirty,
+ * the next query rebuilds it in O(capacity). A query that rebuilds writes to the histogram, so
+ * lazily indexed histograms must not be queried concurrently right after a write.
+ */
+
+static void heist_index_build(Heistogram* h) {
+    uint16_t n = h->capacity;
+    if (h->index_capacity != n || !h->index) {
+        size_t old_size = h->index ? (h->index_capacity + 1) * sizeof(uint64_t) : 0;
+        uint64_t* index = (uint64_t*)heist_resize(h, h->index, old_size, (n + 1) * sizeof(uint64_t), 0);
+        if (!index) return;
+        h->index = index;
+        h->index_capacity = n;
+    }
+
+    if (h->index_mode == HEIST_INDEX_LAZY) {
+        uint64_t sum = 0;
+        for (uint16_t i = 0; i < n; i++) {
+            sum += heist_counter_load(h->buckets, h->count_size, i);
+            h->index[i] = sum;
+        }
+    } else {
+        h->index[0] = 0;
+        for (uint16_t i = 1; i <= n; i++) {
+            h->index[i] = heist_counter_load(h->buckets, h->count_size, i - 1);
+        }
+        for (uint16_t i = 1; i <= n; i++) {
+            uint32_t parent = i + (i & -i);
+            if (parent <= n) h->index[parent] += h->index[i];
+        }
+    }
+    h->index_dirty = 0;
+}
+
+// Makes the index usable, returns 0 when queries have to fall back to scanning
+static inline int heist_index_ready(const Heistogram* h) {
+    if (h->index_mode == HEIST_INDEX_NONE) return 0;
+    if (h->index_dirty || h->index_capacity != h->capacity) heist_index_build((Heistogram*)h);
+    return !h->index_dirty && h->index_capacity == h->capacity;
+}
+
+// Records delta (may wrap around to subtract) added to bucket bid
+static inline void heist_index_update(Heistogram* h, uint16_t bid, uint64_t delta) {
+    if (h->index_mode != HEIST_INDEX_FENWICK || h->index_dirty || h->index_capacity != h->capacity) {
+        h->index_dirty = 1;
+        return;
+    }
+    for (uint32_t i = bid - h->base_bucket_id + 1; i <= h->index_capacity; i += i & -i) {
+        h->index[i] += delta;
+    }
+}
+
+// Sum of all buckets below bid
+static inline uint64_t heist_index_prefix(const Heistogram* h, uint16_t bid) {
+    int32_t k = bid - h->base_bucket_id;
+    if (k <= 0) return 0;
+    if (k > h->capacity) k = h->capacity;
+    if (h->index_mode == HEIST_INDEX_LAZY) return h->index[k - 1];
+    uint64_t sum = 0;
+    for (uint32_t i = k; i > 0; i -= i & -i) {
+        sum += h->index[i];
+    }
+    return sum;
+}
+
+// Finds the highest bucket where the count from the top reaches target, the bucket the
+// percentile walk stops at. Returns -1 when no bucket qualifies, *below gets the count under it
+static inline int16_t heist_index_search(const Heistogram* h, double target, uint64_t* below) {
+    uint64_t total = h->total_count;
+    uint16_t n = h->capacity;
+    if (h->index_mode == HEIST_INDEX_LAZY) {
+        // Largest i whose suffix total - index[i - 1] is non-empty and reaches target
+        int32_t lo = -1, hi = n;
+        while (hi - lo > 1) {
+            int32_t mid = lo + (hi - lo) / 2;
+            uint64_t under = mid ? h->index[mid - 1] : 0;
+            if (total - under > 0 && (double)(total - under) >= target) lo = mid;
+            else hi = mid;
+        }
+        if (lo < 0) return -1;
+        *below = lo ? h->index[lo - 1] : 0;
+        return (int16_t)(h->base_bucket_id + lo);
+    }
+
+    uint32_t pos = 0;
+    uint64_t under = 0;
+    uint32_t step = 1;
+    while (step * 2 <= n) step *= 2;
+    for (; step > 0; step >>= 1) {
+        uint32_t next = pos + step;
+        if (next > n) continue;
+        uint64_t sum = under + h->index[next];
+        if (total - sum > 0 && (double)(total - sum) >= target) {
+            pos = next;
+            under = sum;
+        }
+    }
+    // pos buckets can be skipped, bucket pos is the answer if it is non-empty
+    if (pos >= n || total - under == 0 || (double)(total - under) < target) return -1;
+    *below = under;
+    return (int16_t)(h->base_bucket_id + pos);
+}
+
+/*****************************/
+/* SHARED ATOMIC HISTOGRAMS  */
+/*****************************/
+
+/*
+ * A shared histogram never reallocates its buckets, so any number of threads can update it with
+ * relaxed atomic increments while others query it. Values above the range it was created for are
+ * counted in the top bucket. Writers publish min and max before the counts and release the total,
+ * queries that acquire the total first therefore see bounds covering every counted value. A query
+ * racing with writers may see some of the newest counts and miss others.
+ */
+
+static inline void heist_atomic_min(uint64_t* target, uint64_t value) {
+    uint64_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value < current && !__atomic_compare_exchange_n(target, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void heist_atomic_max(uint64_t* target, uint64_t value) {
+    uint64_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value > current && !__atomic_compare_exchange_n(target, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Shared histograms keep their bucket array based at bucket 0
+static inline uint16_t heist_shared_bucket(const Heistogram* h, uint16_t bid) {
+    return bid < h->capacity ? bid : h->capacity - 1;
+}
+
+static inline void heist_shared_add(Heistogram* h, uint64_t value, uint64_t count) {
+    uint16_t bid = heist_shared_bucket(h, get_bucket_id(value));
+    heist_atomic_min(&h->min, value);
+    heist_atomic_max(&h->max, value);
+    __atomic_fetch_add(&HEIST_BUCKET(h, bid).count, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total_count, count, __ATOMIC_RELEASE);
+}
+
+static inline void heist_shared_remove(Heistogram* h, uint64_t value) {
+    uint16_t bid = heist_shared_bucket(h, get_bucket_id(value));
+    uint64_t count = __atomic_load_n(&HEIST_BUCKET(h, bid).count, __ATOMIC_RELAXED);
+    do {
+        if (count == 0) return;
+    } while (!__atomic_compare_exchange_n(&HEIST_BUCKET(h, bid).count, &count, count - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    // min and max stay as they are, they still bound every remaining value
+    __atomic_fetch_sub(&h->total_count, 1, __ATOMIC_RELEASE);
+}
+
+// Adds the counts of a regular histogram to a shared one
+static void heist_shared_merge(Heistogram* h, const Heistogram* from, uint64_t scale) {
+    if (from->total_count == 0) return;
+    heist_atomic_min(&h->min, from->min);
+    heist_atomic_max(&h->max, from->max);
+    int32_t lo, hi;
+    heist_scan_window(from, &lo, &hi);
+    for (int32_t i = lo; i <= hi; i++) {
+        uint64_t count = heist_bucket_count(from, i);
+        if (count > 0) {
+            __atomic_fetch_add(&HEIST_BUCKET(h, heist_shared_bucket(h, i)).count, count * scale, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&h->total_count, from->total_count * scale, __ATOMIC_RELEASE);
+}
+
+/*****************************/
+/* SPARSE HISTOGRAMS         */
+/*****************************/
+
+/*
+ * Most series of a large fleet only see a few dozen distinct buckets per interval, often spread
+ * over a range whose bucket array would be mostly zeros. A sparse histogram keeps just its
+ * non-empty buckets, as pairs sorted by bucket id in one allocation that grows 4, 8, 16... pairs at
+ * a time. min_bucket_id and max_bucket_id are its first and last pair, occupied is NULL and
+ * base_bucket_id stays 0. Once a new pair would take more memory than a bucket array for the
+ * window, or there would be more than HEIST_SPARSE_MAX pairs, the histogram turns dense for good.
+ */
+
+#define HEIST_SPARSE_MAX 64
+
+// Whether n pairs within buckets [lo, hi] are no larger than a bucket array and bitmap for them,
+// which never cover fewer than the 16 buckets a new histogram starts with
+static inline int heist_sparse_fits(const Heistogram* h, size_t n, int32_t lo, int32_t hi) {
+    int32_t span = hi - lo + 1;
+    if (span < 16) span = 16;
+    return n <= HEIST_SPARSE_MAX && n * HEIST_SPARSE_PAIR_SIZE <= (size_t)span * h->count_size + HEIST_BITMAP_WORDS(span) * sizeof(uint64_t);
+}
+
+// Grows the pair arrays to hold at least n pairs
+static int heist_sparse_grow(Heistogram* h, size_t n) {
+    size_t capacity = h->capacity ? h->capacity : 4;
+    while (capacity < n) capacity *= 2;
+    if (capacity <= h->capacity) return 1;
+    uint64_t* counts = (uint64_t*)heist_resize(h, h->buckets, h->capacity * HEIST_SPARSE_PAIR_SIZE, capacity * HEIST_SPARSE_PAIR_SIZE, 0);
+    if (!counts) return 0;
+
+    // The ids follow the counts, so they move up past the new ones
+    memmove(counts + capacity, counts + h->capacity, h->sparse_size * sizeof(uint16_t));
+    h->buckets = (Bucket*)counts;
+    h->capacity = capacity;
+    return 1;
+}
+
+// Turns a sparse histogram into a regular one whose bucket array covers its pairs and [lo, hi].
+// Returns 0 and leaves h sparse if memory runs out
+static int heist_densify(Heistogram* h, int32_t lo, int32_t hi) {
+    const uint64_t* counts = HEIST_SPARSE_COUNTS(h);
+    const uint16_t* ids = HEIST_SPARSE_IDS(h);
+    size_t n = h->sparse_size;
+    uint64_t largest = 0;
+    for (size_t k = 0; k < n; k++) largest |= counts[k];
+    if (n) heist_window_union(&lo, &hi, ids[0], ids[n - 1]);
+
+    // Compact counters start out as wide as the largest count needs
+    uint8_t size = heist_count_size(largest) > h->count_size ? heist_count_size(largest) : h->count_size;
+    size_t capacity = hi - lo + 1;
+    void* buckets = heist_zalloc(h, capacity * size);
+    uint64_t* occupied = (uint64_t*)heist_zalloc(h, HEIST_BITMAP_WORDS(capacity) * sizeof(uint64_t));
+    if (!buckets || !occupied) {
+        heist_dealloc(h, buckets);
+        heist_dealloc(h, occupied);
+        return 0;
+    }
+    for (size_t k = 0; k < n; k++) {
+        size_t slot = ids[k] - lo;
+        heist_counter_store(buckets, size, slot, counts[k]);
+        occupied[slot >> 6] |= 1ULL << (slot & 63);
+    }
+
+    heist_dealloc(h, h->buckets);
+    h->buckets = (Bucket*)buckets;
+    h->occupied = occupied;
+    h->base_bucket_id = lo;
+    h->capacity = capacity;
+    h->count_size = size;
+    h->sparse_size = 0;
+    h->flags &= ~HEIST_FLAG_SPARSE;
+    h->index_dirty = 1;
+    return 1;
+}
+
+// Adds count to bucket bid of a sparse histogram, or turns it dense first when a new pair doesn't
+// pay off. Leaves total_count, min/max and the window to the caller, returns 0 if memory runs out
+static int heist_sparse_add(Heistogram* h, int32_t bid, uint64_t count) {
+    size_t n = h->sparse_size, k = heist_sparse_find(h, bid);
+    if (k < n && HEIST_SPARSE_IDS(h)[k] == bid) {
+        HEIST_SPARSE_COUNTS(h)[k] += count;
+        return 1;
+    }
+
+    int32_t lo = bid, hi = bid;
+    if (n) heist_window_union(&lo, &hi, HEIST_SPARSE_IDS(h)[0], HEIST_SPARSE_IDS(h)[n - 1]);
+    if (!heist_sparse_fits(h, n + 1, lo, hi)) {
+        if (!heist_densify(h, bid, bid) || !heist_bucket_set(h, bid, count)) return 0;
+        heist_mark_occupied(h, bid);
+        return 1;
+    }
+    if (n == h->capacity && !heist_sparse_grow(h, n + 1)) return 0;
+
+    uint64_t* counts = HEIST_SPARSE_COUNTS(h);
+    uint16_t* ids = HEIST_SPARSE_IDS(h);
+    memmove(counts + k + 1, counts + k, (n - k) * sizeof(uint64_t));
+    memmove(ids + k + 1, ids + k, (n - k) * sizeof(uint16_t));
+    counts[k] = count;
+    ids[k] = bid;
+    h->sparse_size++;
+    return 1;
+}
+
+// Takes one value out of bucket bid of a sparse histogram and stores the count left in it,
+// returns 0 if the bucket is empty
+static int heist_sparse_remove(Heistogram* h, int32_t bid, uint64_t* left) {
+    uint64_t* counts = HEIST_SPARSE_COUNTS(h);
+    uint16_t* ids = HEIST_SPARSE_IDS(h);
+    size_t n = h->sparse_size, k = heist_sparse_find(h, bid);
+    if (k == n || ids[k] != bid) return 0;
+    *left = --counts[k];
+    if (*left == 0) {
+        memmove(counts + k, counts + k + 1, (n - k - 1) * sizeof(uint64_t));
+        memmove(ids + k, ids + k + 1, (n - k - 1) * sizeof(uint16_t));
+        h->sparse_size--;
+    }
+    return 1;
+}
+
+// Sum of the counts below bucket bid of a sparse histogram
+static inline uint64_t heist_sparse_rank(const Heistogram* h, int32_t bid) {
+    const uint64_t* counts = HEIST_SPARSE_COUNTS(h);
+    size_t k = heist_sparse_find(h, bid);
+    uint64_t below = 0;
+    for (size_t i = 0; i < k; i++) below += counts[i];
+    return below;
+}
+
+// Adds the pairs of sparse histogram from to those of sparse histogram h, [lo, hi] is the window
+// the merged histogram ends up with. Returns -1 without touching h when the union would be better
+// off dense, 0 if memory runs out
+static int heist_sparse_union(Heistogram* h, const Heistogram* from, uint64_t scale, int32_t lo, int32_t hi) {
+    const uint16_t* from_ids = HEIST_SPARSE_IDS(from);
+    size_t n = h->sparse_size, m = from->sparse_size, total = n + m;
+    for (size_t i = 0, j = 0; i < n && j < m; ) {
+        uint16_t id = HEIST_SPARSE_IDS(h)[i];
+        if (id == from_ids[j]) total--;
+        i += id <= from_ids[j];
+        j += id >= from_ids[j];
+    }
+    if (!heist_sparse_fits(h, total, lo, hi)) return -1;
+    if (total > h->capacity && !heist_sparse_grow(h, total)) return 0;
+
+    // Merging from the top down only overwrites pairs that were already moved up
+    uint64_t* counts = HEIST_SPARSE_COUNTS(h);
+    uint16_t* ids = HEIST_SPARSE_IDS(h);
+    const uint64_t* from_counts = HEIST_SPARSE_COUNTS(from);
+    size_t i = n, j = m, k = total;
+    while (j > 0) {
+        k--;
+        if (i > 0 && ids[i - 1] >= from_ids[j - 1]) {
+            i--;
+            uint64_t count = counts[i];
+            if (ids[i] == from_ids[j - 1]) count += from_counts[--j] * scale;
+            counts[k] = count;
+            ids[k] = ids[i];
+        } else {
+            j--;
+            counts[k] = from_counts[j] * scale;
+            ids[k] = from_ids[j];
+        }
+    }
+    h->sparse_size = total;
+    return 1;
+}
+
+// Adds the counts of from to h when either of them is sparse, h keeps its window and metadata.
+// [window_lo, window_hi] is the window of the merged result, whether h stays sparse is judged on it
+// rather than on the window h has so far
+static int heist_sparse_merge(Heistogram* h, const Heistogram* from, uint64_t scale, int32_t window_lo, int32_t window_hi) {
+    if (from->total_count == 0) return 1;
+    int32_t lo, hi;
+    heist_scan_window(from, &lo, &hi);
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        if (from->flags & HEIST_FLAG_SPARSE) {
+            int merged = heist_sparse_union(h, from, scale, window_lo, window_hi);
+            if (merged >= 0) return merged;
+        }
+        if (!heist_densify(h, window_lo, window_hi)) return 0;
+    } else if (!heist_reserve(h, lo, hi)) {
+        return 0;
+    }
+    if (!(from->flags & HEIST_FLAG_SPARSE)) {
+        if (!heist_add_counts_from(h, from, lo, hi, scale)) return 0;
+        heist_occupancy_or(h, from, lo, hi);
+        return 1;
+    }
+
+    // The widest sum decides the counter size before anything is written
+    const uint64_t* counts = HEIST_SPARSE_COUNTS(from);
+    const uint16_t* ids = HEIST_SPARSE_IDS(from);
+    uint64_t sums = 0;
+    for (size_t k = 0; k < from->sparse_size; k++) sums |= heist_dense_count(h, ids[k]) + counts[k] * scale;
+    if (sums > heist_count_limit[h->count_size] && !heist_widen(h, sums)) return 0;
+    for (size_t k = 0; k < from->sparse_size; k++) {
+        heist_bucket_set(h, ids[k], heist_dense_count(h, ids[k]) + counts[k] * scale);
+        heist_mark_occupied(h, ids[k]);
+    }
+    h->index_dirty = 1;
+    return 1;
+}
+
+// Loads serialized counts into an empty sparse histogram. Returns -1 without touching h when they
+// would be better off dense, 0 if the buffer is truncated or memory runs out
+static int heist_sparse_read(Heistogram* h, const HeistHeader* hdr, const uint8_t* ptr, const uint8_t* end) {
+    uint64_t counts[HEIST_DECODE_CHUNK];
+    HeistCountDecoder d;
+    int32_t top = (int32_t)hdr->min_bucket_id + hdr->bucket_count - 1;
+
+    // The first pass finds how many buckets are non-empty and where
+    size_t n = 0;
+    int32_t lo = 0, hi = -1;
+    if (!heist_count_decoder_init(&d, hdr, ptr, end)) return 0;
+    for (int32_t i = top; i >= hdr->min_bucket_id; ) {
+        size_t len = i - hdr->min_bucket_id + 1 < HEIST_DECODE_CHUNK ? i - hdr->min_bucket_id + 1 : HEIST_DECODE_CHUNK;
+        if (!heist_decode_counts(&d, counts, len)) return 0;
+        for (size_t k = 0; k < len; k++, i--) {
+            if (counts[k] == 0) continue;
+            if (n++ == 0) hi = i;
+            lo = i;
+        }
+    }
+    if (!heist_sparse_fits(h, n, lo, hi)) return -1;
+    if (n > h->capacity && !heist_sparse_grow(h, n)) return 0;
+
+    // Buckets come highest first, so the pairs fill in from the end
+    uint64_t* out = HEIST_SPARSE_COUNTS(h);
+    uint16_t* ids = HEIST_SPARSE_IDS(h);
+    size_t next = n;
+    heist_count_decoder_init(&d, hdr, ptr, end);
+    for (int32_t i = top; i >= hdr->min_bucket_id; ) {
+        size_t len = i - hdr->min_bucket_id + 1 < HEIST_DECODE_CHUNK ? i - hdr->min_bucket_id + 1 : HEIST_DECODE_CHUNK;
+        heist_decode_counts(&d, counts, len);
+        for (size_t k = 0; k < len; k++, i--) {
+            if (counts[k] == 0) continue;
+            out[--next] = counts[k];
+            ids[next] = i;
+        }
+    }
+    h->sparse_size = n;
+    heist_set_window(h, lo, hi);
+    return 1;
+}
+
+/**************************/
+/* HEISTOGRAM API METHODS */
+/**************************/
+
+static Heistogram* heistogram_create(void) {
+    Heistogram* h = (Heistogram*)malloc(sizeof(Heistogram));
+    if (!h) return NULL;
+    if (!heist_init(h, NULL)) {
+        free(h);
+        return NULL;
+    }
+    
+    return h;
+}
+
+// Creates a histogram whose memory all comes from allocator, or malloc if it is NULL. With
+// inline_buckets > 0 the histogram and a bucket array for that many buckets are one allocation,
+// values that fit its window never allocate again. The allocator must outlive the histogram
+static Heistogram* heistogram_create_with_allocator(const HeistAllocator* allocator, uint16_t inline_buckets) {
+    size_t words = HEIST_BITMAP_WORDS(inline_buckets);
+    size_t size = sizeof(Heistogram) + inline_buckets * sizeof(Bucket) + words * sizeof(uint64_t);
+    Heistogram* h = (Heistogram*)(allocator ? allocator->alloc(allocator->ctx, size) : malloc(size));
+    if (!h) return NULL;
+    if (inline_buckets == 0) {
+        if (!heist_init(h, allocator)) {
+            heist_dealloc(h, h);
+            return NULL;
+        }
+        return h;
+    }
+
+    // The bucket array follows the histogram and the bitmap follows the buckets
+    heist_init_fields(h, allocator);
+    h->capacity = inline_buckets;
+    h->buckets = (Bucket*)(h + 1);
+    h->occupied = (uint64_t*)(h->buckets + inline_buckets);
+    memset(h->buckets, 0, size - sizeof(Heistogram));
+    h->flags = HEIST_FLAG_INLINE_BUCKETS | HEIST_FLAG_INLINE_BITMAP;
+    return h;
+}
+
+// Creates a histogram that keeps a cumulative count index for logarithmic time queries
+static Heistogram* heistogram_create_indexed(HeistIndexMode mode) {
+    Heistogram* h = heistogram_create();
+    if (!h) return NULL;
+    h->index_mode = mode;
+    h->index_dirty = 1;
+    return h;
+}
+
+// Creates a histogram whose bucket counters start at a single byte and widen as its counts grow,
+// for keeping many histograms with small counts in memory
+static Heistogram* heistogram_create_compact(void) {
+    Heistogram* h = heistogram_create();
+    if (!h) return NULL;
+    Bucket* counters = (Bucket*)heist_resize(h, h->buckets, h->capacity * sizeof(Bucket), h->capacity, 0);
+    if (counters) h->buckets = counters;
+    h->count_size = 1;
+    return h;
+}
+
+// Creates a histogram that keeps only its non-empty buckets, as sorted (bucket id, count) pairs,
+// until a bucket array would be smaller. For the long tail of series that see few distinct values
+static Heistogram* heistogram_create_sparse(void) {
+    Heistogram* h = heistogram_create();
+    if (!h) return NULL;
+    heist_release(h);
+    h->buckets = NULL;
+    h->occupied = NULL;
+    h->capacity = 0;
+    h->flags = HEIST_FLAG_SPARSE;
+    return h;
+}
+
+static void heistogram_free(Heistogram* h) {
+    if (!h) return;
+    heist_release(h);
+    heist_dealloc(h, h);
+}
+
+// Empties the histogram but keeps its bucket array, so refilling it over the same range doesn't
+// allocate. Only the occupied window is cleared. A shared histogram must have no active writers
+static void heistogram_reset(Heistogram* h) {
+    if (!h) return;
+    int32_t lo, hi;
+    heist_scan_window(h, &lo, &hi);
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        h->sparse_size = 0;
+    } else {
+        if (lo <= hi) memset((uint8_t*)h->buckets + (size_t)(lo - h->base_bucket_id) * h->count_size, 0, (size_t)(hi - lo + 1) * h->count_size);
+        if (!(h->flags & HEIST_FLAG_SHARED)) heist_occupancy_rebuild(h, lo, hi);
+    }
+    h->total_count = 0;
+    h->min = h->flags & HEIST_FLAG_SHARED ? UINT64_MAX : 0;
+    h->max = 0;
+    h->min_bucket_id = 0;
+    h->max_bucket_id = 0;
+    h->index_dirty = 1;
+}
+
+// Exchanges the contents of two histograms in O(1), for handing a filled histogram to a reporter
+// and carrying on with an empty one. Returns 0 and changes nothing if their storage can't move:
+// inline buckets belong to their histogram, and both must use the same allocator
+static int heistogram_swap(Heistogram* a, Heistogram* b) {
+    if (!a || !b || a->allocator != b->allocator) return 0;
+    if ((a->flags | b->flags) & (HEIST_FLAG_INLINE_BUCKETS | HEIST_FLAG_INLINE_BITMAP)) return 0;
+    Heistogram tmp = *a;
+    *a = *b;
+    *b = tmp;
+    return 1;
+}
+
+// Creates a histogram that threads can update and query concurrently without locks. Buckets for
+// values up to max_value are allocated up front and never grow
+static Heistogram* heistogram_create_shared(uint64_t max_value) {
+    Heistogram* h = heistogram_create();
+    if (!h) return NULL;
+    if (!heist_reserve(h, 0, get_bucket_id(max_value))) {
+        heistogram_free(h);
+        return NULL;
+    }
+    memset(h->occupied, 0xFF, HEIST_BITMAP_WORDS(h->capacity) * sizeof(uint64_t));
+    h->flags = HEIST_FLAG_SHARED;
+    h->min = UINT64_MAX;
+    return h;
+}
+
+// Copies a shared histogram into a regular one, consistent with itself even while writers are
+// active: the total is the sum of the copied counts and min/max are widened to cover them
+static Heistogram* heistogram_shared_snapshot(const Heistogram* h) {
+    if (!h) return NULL;
+    Heistogram* copy = heistogram_create();
+    if (!copy) return NULL;
+
+    // The copy only gets the range that was non-empty in a first pass, counts writers add
+    // outside of it are left for the next snapshot
+    uint64_t min = HEIST_LOAD(h, h->min);
+    uint64_t max = HEIST_LOAD(h, h->max);
+    int32_t lo, hi, lowest = -1, highest = -1;
+    heist_scan_window(h, &lo, &hi);
+    for (int32_t i = lo; i <= hi; i++) {
+        if (heist_dense_count(h, i) == 0) continue;
+        if (lowest < 0) lowest = i;
+        highest = i;
+    }
+    if (lowest < 0) return copy;
+    if (!heist_reserve(copy, lowest, highest)) {
+        heistogram_free(copy);
+        return NULL;
+    }
+
+    lo = lowest;
+    hi = highest;
+    lowest = highest = -1;
+    for (int32_t i = lo; i <= hi; i++) {
+        uint64_t count = heist_dense_count(h, i);
+        if (count == 0) continue;
+        HEIST_BUCKET(copy, i).count = count;
+        copy->total_count += count;
+        if (lowest < 0) lowest = i;
+        highest = i;
+    }
+
+    if (copy->total_count > 0) {
+        if (min > get_bucket_max(lowest)) min = get_bucket_min(lowest);
+        if (max < get_bucket_min(highest)) max = get_bucket_max(highest);
+        copy->min = min;
+        copy->max = max;
+        heist_trim_window(copy, lowest, highest);
+    }
+    return copy;
+}
+
+static uint64_t heistogram_count(const Heistogram* h) {
+    return h ? HEIST_LOAD(h, h->total_count) : 0;
+}
+
+static uint64_t heistogram_max(const Heistogram* h) {
+    return h ? HEIST_LOAD(h, h->max) : 0;
+}
+
+static uint64_t heistogram_min(const Heistogram* h) {
+    return h && HEIST_LOAD(h, h->total_count) ? HEIST_LOAD(h, h->min) : 0;
+}
+
+// Bytes held by the histogram, the bucket array and bitmap only cover its based window
+static uint32_t heistogram_memory_size(const Heistogram* h) {
+    if (!h) return 0;
+    if (h->flags & HEIST_FLAG_SPARSE) return sizeof(Heistogram) + h->capacity * HEIST_SPARSE_PAIR_SIZE;
+    uint32_t index_size = h->index ? sizeof(uint64_t) * (h->index_capacity + 1) : 0;
+    return sizeof(Heistogram) + ((uint32_t)h->count_size * h->capacity) + HEIST_BITMAP_WORDS(h->capacity) * sizeof(uint64_t) + index_size;
+}
+
+// Counts value count times, the body of heistogram_add and heistogram_add_n. Returns 0 and leaves
+// h unchanged if memory runs out
+static inline int heist_add_count(Heistogram* h, uint64_t value, uint64_t count) {
+    if (h->flags & HEIST_FLAG_SHARED) {
+        heist_shared_add(h, value, count);
+        return 1;
+    }
+    
+    int16_t bid = get_bucket_id(value);
+
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        // Counts the value in a pair, or turns the histogram dense for it
+        if (!heist_sparse_add(h, bid, count)) return 0;
+    } else {
+        // Expand array if needed
+        if ((!heist_has_bucket(h, bid) || h->total_count == 0) && !heist_reserve_slack(h, bid, bid)) return 0;
+
+        // Increment count in the appropriate bucket, compact counters may have to widen first
+        uint64_t previous;
+        if (h->count_size == 8) {
+            previous = HEIST_BUCKET(h, bid).count;
+            HEIST_BUCKET(h, bid).count = previous + count;
+        } else {
+            previous = heist_dense_count(h, bid);
+            if (!heist_bucket_set(h, bid, previous + count)) return 0;
+        }
+        if (previous == 0) heist_mark_occupied(h, bid);
+    }
+
+    if (h->total_count == 0) {
+        h->min = value;
+        h->max = value;
+        h->min_bucket_id = bid;
+        h->max_bucket_id = bid;
+    } else {
+        if (h->min > value) h->min = value;
+        if (h->max < value) h->max = value;
+        if(bid < h->min_bucket_id) h->min_bucket_id = bid;
+        if (bid > h->max_bucket_id) h->max_bucket_id = bid;
+    }
+    h->total_count += count;
+    if (h->index_mode) heist_index_update(h, bid, count);
+    return 1;
+}
+
+static void heistogram_add(Heistogram* h, uint64_t value) {
+    if (!h || value < 0) return;
+    heist_add_count(h, value, 1);
+}
+
+// Adds count copies of value in constant time, for pre-aggregated values or values sampled at a
+// 1/count rate. Returns 0 and leaves h unchanged if memory runs out or the total would overflow
+static int heistogram_add_n(Heistogram* h, uint64_t value, uint64_t count) {
+    if (!h) return 0;
+    if (count == 0) return 1;
+    if (HEIST_LOAD(h, h->total_count) > UINT64_MAX - count) return 0;
+    return heist_add_count(h, value, count);
+}
+
+// Adds n values at once, growth and min/max tracking happen once for the whole batch. Returns 0 if
+// memory runs out, h is then unchanged unless it was sparse, in which case values from the start of
+// the batch may already be in
+static int heistogram_add_batch(Heistogram* h, const uint64_t* values, size_t n) {
+    if (!h || (!values && n > 0)) return 0;
+
+    // A sparse histogram takes values one by one while it stays sparse, the rest is a regular batch
+    while (n > 0 && (h->flags & HEIST_FLAG_SPARSE)) {
+        uint64_t total = h->total_count;
+        heistogram_add(h, *values);
+        if (h->total_count == total) return 0;
+        values++;
+        n--;
+    }
+    if (n == 0) return 1;
+
+    const HeistBatchKernels* kernels = heist_batch_kernels();
+
+    // The mapping is monotonic, so the extreme values also give the extreme bucket ids
+    uint64_t batch_min, batch_max;
+    kernels->minmax(values, n, &batch_min, &batch_max);
+    uint16_t min_bid = get_bucket_id(batch_min);
+    uint16_t max_bid = get_bucket_id(batch_max);
+
+    if (h->flags & HEIST_FLAG_SHARED) {
+        heist_atomic_min(&h->min, batch_min);
+        heist_atomic_max(&h->max, batch_max);
+        uint16_t bids[HEIST_BATCH_CHUNK];
+        for (size_t offset = 0; offset < n; offset += HEIST_BATCH_CHUNK) {
+            size_t len = n - offset < HEIST_BATCH_CHUNK ? n - offset : HEIST_BATCH_CHUNK;
+            kernels->bucket_ids(values + offset, len, bids);
+            for (size_t i = 0; i < len; i++) {
+                __atomic_fetch_add(&HEIST_BUCKET(h, heist_shared_bucket(h, bids[i])).count, 1, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_fetch_add(&h->total_count, n, __ATOMIC_RELEASE);
+        return 1;
+    }
+
+    // Expand array if needed
+    if ((!heist_has_bucket(h, min_bid) || !heist_has_bucket(h, max_bid) || h->total_count == 0) && !heist_reserve_slack(h, min_bid, max_bid)) return 0;
+
+    // The whole batch may land in the fullest bucket, compact counters widen up front for that
+    if (h->count_size < 8) {
+        uint64_t largest = 0;
+        for (int32_t i = h->min_bucket_id; h->total_count > 0 && i <= h->max_bucket_id; i++) {
+            uint64_t count = heist_dense_count(h, i);
+            if (count > largest) largest = count;
+        }
+        if (largest + n > heist_count_limit[h->count_size] && !heist_widen(h, largest + n)) return 0;
+    }
+
+    if (h->total_count == 0) {
+        h->min = batch_min;
+        h->max = batch_max;
+        h->min_bucket_id = min_bid;
+        h->max_bucket_id = max_bid;
+    } else {
+        if (h->min > batch_min) h->min = batch_min;
+        if (h->max < batch_max) h->max = batch_max;
+        if (min_bid < h->min_bucket_id) h->min_bucket_id = min_bid;
+        if (max_bid > h->max_bucket_id) h->max_bucket_id = max_bid;
+    }
+
+    uint16_t bids[HEIST_BATCH_CHUNK];
+    for (size_t offset = 0; offset < n; offset += HEIST_BATCH_CHUNK) {
+        size_t len = n - offset < HEIST_BATCH_CHUNK ? n - offset : HEIST_BATCH_CHUNK;
+        kernels->bucket_ids(values + offset, len, bids);
+        if (h->count_size == 8) {
+            for (size_t i = 0; i < len; i++) {
+                HEIST_BUCKET(h, bids[i]).count++;
+                heist_mark_occupied(h, bids[i]);
+            }
+            continue;
+        }
+        for (size_t i = 0; i < len; i++) {
+            size_t k = bids[i] - h->base_bucket_id;
+            heist_counter_store(h->buckets, h->count_size, k, heist_counter_load(h->buckets, h->count_size, k) + 1);
+            heist_mark_occupied(h, bids[i]);
+        }
+    }
+    h->total_count += n;
+    h->index_dirty = 1;
+
+    return 1;
+}
+
+// Adds counts[i] copies of values[i] for every i < n, growth and min/max tracking happen once for
+// the whole batch. Returns 0 if memory runs out or the total would overflow, h is then unchanged
+// unless it was sparse, in which case the pairs before the failing one are in
+static int heistogram_add_n_batch(Heistogram* h, const uint64_t* values, const uint64_t* counts, size_t n) {
+    if (!h || ((!values || !counts) && n > 0)) return 0;
+
+    // Values with a zero count don't take part, not even in min and max
+    uint64_t sum = 0, batch_min = UINT64_MAX, batch_max = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (counts[i] == 0) continue;
+        if (counts[i] > UINT64_MAX - sum) return 0;
+        sum += counts[i];
+        if (values[i] < batch_min) batch_min = values[i];
+        if (values[i] > batch_max) batch_max = values[i];
+    }
+    if (sum == 0) return 1;
+    if (HEIST_LOAD(h, h->total_count) > UINT64_MAX - sum) return 0;
+
+    if (h->flags & (HEIST_FLAG_SHARED | HEIST_FLAG_SPARSE)) {
+        for (size_t i = 0; i < n; i++) {
+            if (counts[i] && !heist_add_count(h, values[i], counts[i])) return 0;
+        }
+        return 1;
+    }
+
+    uint16_t min_bid = get_bucket_id(batch_min);
+    uint16_t max_bid = get_bucket_id(batch_max);
+    if ((!heist_has_bucket(h, min_bid) || !heist_has_bucket(h, max_bid) || h->total_count == 0) && !heist_reserve_slack(h, min_bid, max_bid)) return 0;
+
+    // The whole batch may land in the fullest bucket, compact counters widen up front for that
+    if (h->count_size < 8) {
+        uint64_t largest = 0;
+        for (int32_t i = h->min_bucket_id; h->total_count > 0 && i <= h->max_bucket_id; i++) {
+            uint64_t count = heist_dense_count(h, i);
+            if (count > largest) largest = count;
+        }
+        if (largest + sum > heist_count_limit[h->count_size] && !heist_widen(h, largest + sum)) return 0;
+    }
+
+    if (h->total_count == 0) {
+        h->min = batch_min;
+        h->max = batch_max;
+        h->min_bucket_id = min_bid;
+        h->max_bucket_id = max_bid;
+    } else {
+        if (h->min > batch_min) h->min = batch_min;
+        if (h->max < batch_max) h->max = batch_max;
+        if (min_bid < h->min_bucket_id) h->min_bucket_id = min_bid;
+        if (max_bid > h->max_bucket_id) h->max_bucket_id = max_bid;
+    }
+
+    const HeistBatchKernels* kernels = heist_batch_kernels();
+    uint16_t bids[HEIST_BATCH_CHUNK];
+    for (size_t offset = 0; offset < n; offset += HEIST_BATCH_CHUNK) {
+        size_t len = n - offset < HEIST_BATCH_CHUNK ? n - offset : HEIST_BATCH_CHUNK;
+        const uint64_t* chunk_counts = counts + offset;
+        kernels->bucket_ids(values + offset, len, bids);
+        for (size_t i = 0; i < len; i++) {
+            if (chunk_counts[i] == 0) continue;
+            size_t k = bids[i] - h->base_bucket_id;
+            if (h->count_size == 8) {
+                h->buckets[k].count += chunk_counts[i];
+            } else {
+                heist_counter_store(h->buckets, h->count_size, k, heist_counter_load(h->buckets, h->count_size, k) + chunk_counts[i]);
+            }
+            heist_mark_occupied(h, bids[i]);
+        }
+    }
+    h->total_count += sum;
+    h->index_dirty = 1;
+
+    return 1;
+}
+
+static void heistogram_remove(Heistogram* h, uint64_t value) {
+    if (!h || value < 0) return;
+    if (h->flags & HEIST_FLAG_SHARED) {
+        heist_shared_remove(h, value);
+        return;
+    }
+    if (h->total_count == 0) return;
+    
+    int16_t bid = get_bucket_id(value);
+    uint64_t count;
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        if (!heist_sparse_remove(h, bid, &count)) return;
+    } else {
+        if (!heist_has_bucket(h, bid)) return;
+        count = heist_dense_count(h, bid);
+        if (count == 0) return;
+
+        heist_bucket_set(h, bid, --count);  // Never has to widen
+        if (h->index_mode) heist_index_update(h, bid, (uint64_t)-1);
+        if (count == 0) heist_mark_empty(h, bid);
+    }
+    h->total_count--;
+    
+    // Check if histogram is now empty
+    if (h->total_count == 0) {
+        h->min = 0;
+        h->max = 0;
+        h->min_bucket_id = 0;
+        h->max_bucket_id = 0;
+        return;
+    }
+    
+    // Only update the window and min/max values if the bucket count went to zero
+    if (count == 0) {
+        // Shrink the window to the next non-empty bucket, other buckets are still non-empty
+        if (h->flags & HEIST_FLAG_SPARSE) {
+            heist_set_window(h, HEIST_SPARSE_IDS(h)[0], HEIST_SPARSE_IDS(h)[h->sparse_size - 1]);
+        } else {
+            if (bid == h->max_bucket_id) {
+                int32_t next = heist_prev_occupied(h, bid);
+                if (next >= h->min_bucket_id) h->max_bucket_id = next;
+            }
+            if (bid == h->min_bucket_id) {
+                int32_t next = heist_next_occupied(h, bid);
+                if (next >= 0 && next <= h->max_bucket_id) h->min_bucket_id = next;
+            }
+        }
+
+        // If the bucket held the max or min value, use the bound of the new highest or lowest bucket
+        uint64_t bucket_min = get_bucket_min(bid);
+        uint64_t bucket_max = get_bucket_max(bid);
+        if (h->max <= bucket_max && h->max >= bucket_min) {
+            h->max = get_bucket_max(h->max_bucket_id);
+        }
+        if (h->min >= bucket_min && h->min <= bucket_max) {
+            h->min = get_bucket_min(h->min_bucket_id);
+        }
+    }
+}
+
+static Heistogram* heistogram_merge(const Heistogram* h1, const Heistogram* h2) {
+    if (!h1 || !h2) return NULL;
+    if ((h1->flags | h2->flags) & HEIST_FLAG_SHARED) {
+        Heistogram* s1 = heistogram_shared_snapshot(h1);
+        Heistogram* s2 = heistogram_shared_snapshot(h2);
+        Heistogram* result = s1 && s2 ? heistogram_merge(s1, s2) : NULL;
+        heistogram_free(s1);
+        heistogram_free(s2);
+        return result;
+    }
+    int sparse = (h1->flags | h2->flags) & HEIST_FLAG_SPARSE;
+
+    // The result stays sparse as long as both inputs are
+    Heistogram* result = h1->flags & h2->flags & HEIST_FLAG_SPARSE ? heistogram_create_sparse() : heistogram_create();
+    if (!result) return NULL;
+    
+    // Only the occupied windows are added up
+    int32_t lo1, hi1, lo2, hi2;
+    heist_scan_window(h1, &lo1, &hi1);
+    heist_scan_window(h2, &lo2, &hi2);
+    int32_t lo = lo1, hi = hi1;
+    heist_window_union(&lo, &hi, lo2, hi2);
+    
+    if (sparse) {
+        // A regular result gets its whole window first, it has no counts yet to keep in place
+        if (!(result->flags & HEIST_FLAG_SPARSE) && lo <= hi && !heist_reserve(result, lo, hi)) {
+            heistogram_free(result);
+            return NULL;
+        }
+        if (!heist_sparse_merge(result, h1, 1, lo, hi) || !heist_sparse_merge(result, h2, 1, lo, hi)) {
+            heistogram_free(result);
+            return NULL;
+        }
+    } else {
+        // The result starts with the wider of the two counter sizes
+        result->count_size = h1->count_size > h2->count_size ? h1->count_size : h2->count_size;
+        if (lo <= hi && !heist_reserve(result, lo, hi)) {
+            heistogram_free(result);
+            return NULL;
+        }
+    
+        // Merge buckets by adding counts
+        if (!heist_add_counts_from(result, h1, lo1, hi1, 1) || !heist_add_counts_from(result, h2, lo2, hi2, 1)) {
+            heistogram_free(result);
+            return NULL;
+        }
+    
+        // Bits outside a window are clear, so whole words can be combined
+        if (lo1 <= hi1) heist_occupancy_or(result, h1, lo1, hi1);
+        if (lo2 <= hi2) heist_occupancy_or(result, h2, lo2, hi2);
+    }
+    
+    // Update result metadata, the bounds of an empty histogram don't count
+    result->total_count = h1->total_count + h2->total_count;
+    result->min = h2->total_count && (h2->min < h1->min || !h1->total_count) ? h2->min : h1->min;
+    result->max = h1->max > h2->max ? h1->max : h2->max;
+    heist_set_window(result, lo, hi);
+
+    return result;
+}
+
+// In-place merge of h2 into h1 with every count of h2 multiplied by scale, e.g. by N for values
+// sampled at a 1/N rate. Returns 0 if memory runs out or the scaled total would overflow
+static int heistogram_merge_inplace_scaled(Heistogram* h1, const Heistogram* h2, uint64_t scale) {
+    if (!h1 || !h2) return 0;
+    if (scale == 0) return 1;
+    if (HEIST_LOAD(h2, h2->total_count) > (UINT64_MAX - HEIST_LOAD(h1, h1->total_count)) / scale) return 0;
+    if ((h1->flags | h2->flags) & HEIST_FLAG_SHARED) {
+        Heistogram* from = h2->flags & HEIST_FLAG_SHARED ? heistogram_shared_snapshot(h2) : (Heistogram*)h2;
+        if (!from) return 0;
+        int ok = h1->flags & HEIST_FLAG_SHARED ? (heist_shared_merge(h1, from, scale), 1) : heistogram_merge_inplace_scaled(h1, from, scale);
+        if (from != h2) heistogram_free(from);
+        return ok;
+    }
+    
+    // Expand h1 if needed to accommodate h2's occupied window
+    int32_t lo, hi, lo2, hi2;
+    heist_scan_window(h1, &lo, &hi);
+    heist_scan_window(h2, &lo2, &hi2);
+    int sparse = (h1->flags | h2->flags) & HEIST_FLAG_SPARSE;
+    if (sparse) {
+        int32_t window_lo = lo, window_hi = hi;
+        heist_window_union(&window_lo, &window_hi, lo2, hi2);
+        if (!heist_sparse_merge(h1, h2, scale, window_lo, window_hi)) return 0;
+    } else {
+        if (lo2 <= hi2 && !heist_reserve(h1, lo2, hi2)) return 0;
+    
+        // Merge buckets by adding counts
+        if (!heist_add_counts_from(h1, h2, lo2, hi2, scale)) return 0;
+    }
+    
+    // Update h1 metadata, the bounds of an empty histogram don't count
+    h1->index_dirty = 1;
+    if (h2->total_count == 0) return 1;
+    if (!sparse) heist_occupancy_or(h1, h2, lo2, hi2);
+    if (h1->total_count == 0) {
+        h1->min = h2->min;
+        h1->max = h2->max;
+    }
+    h1->total_count += h2->total_count * scale;
+    if (h2->min < h1->min) h1->min = h2->min;
+    if (h2->max > h1->max) h1->max = h2->max;
+    heist_window_union(&lo, &hi, lo2, hi2);
+    heist_set_window(h1, lo, hi);
+    
+    return 1;
+}
+
+// NEW: In-place merge of h2 into h1
+static int heistogram_merge_inplace(Heistogram* h1, const Heistogram* h2) {
+    return heistogram_merge_inplace_scaled(h1, h2, 1);
+}
+
+// Count of bucket bid, 0 outside the scan window of h
+static inline uint64_t heist_window_count(const Heistogram* h, int32_t bid) {
+    int32_t lo, hi;
+    heist_scan_window(h, &lo, &hi);
+    return bid >= lo && bid <= hi ? heist_bucket_count(h, bid) : 0;
+}
+
+// Whether h holds at least the count of every non-empty bucket of from, which must not be shared.
+// A shared h counts the buckets above its range in its highest one, as its inserts do
+static int heist_holds(const Heistogram* h, const Heistogram* from) {
+    int32_t lo, hi;
+    heist_scan_window(from, &lo, &hi);
+    int32_t target = -1;
+    uint64_t needed = 0;
+    for (int32_t i = lo; i <= hi; i++) {
+        uint64_t count = heist_window_count(from, i);
+        if (count == 0) continue;
+        int32_t bid = h->flags & HEIST_FLAG_SHARED ? heist_shared_bucket(h, i) : i;
+        if (bid != target) {
+            target = bid;
+            needed = 0;
+        }
+        needed += count;
+        if (needed > heist_window_count(h, bid)) return 0;
+    }
+    return 1;
+}
+
+// Takes count out of bucket bid, which holds at least that many. A sparse pair that drops to zero
+// goes away, the bitmap and the window are left to the caller
+static inline void heist_bucket_take(Heistogram* h, int32_t bid, uint64_t count) {
+    if (h->flags & HEIST_FLAG_SHARED) {
+        __atomic_fetch_sub(&HEIST_BUCKET(h, heist_shared_bucket(h, bid)).count, count, __ATOMIC_RELAXED);
+    } else if (h->flags & HEIST_FLAG_SPARSE) {
+        uint64_t* counts = HEIST_SPARSE_COUNTS(h);
+        uint16_t* ids = HEIST_SPARSE_IDS(h);
+        size_t n = h->sparse_size, k = heist_sparse_find(h, bid);
+        counts[k] -= count;
+        if (counts[k] == 0) {
+            memmove(counts + k, counts + k + 1, (n - k - 1) * sizeof(uint64_t));
+            memmove(ids + k, ids + k + 1, (n - k - 1) * sizeof(uint16_t));
+            h->sparse_size--;
+        }
+    } else {
+        heist_bucket_set(h, bid, heist_dense_count(h, bid) - count);  // Never has to widen
+    }
+}
+
+// Subtracts the counts of from, which h must hold, see heist_holds. Updates the total and the
+// window, min and max are left to the caller unless h ends up empty
+static void heist_subtract_counts(Heistogram* h, const Heistogram* from) {
+    if (from->total_count == 0) return;
+    int32_t lo, hi;
+    heist_scan_window(from, &lo, &hi);
+    if (from->flags & HEIST_FLAG_SPARSE) {
+        for (size_t k = 0; k < from->sparse_size; k++) heist_bucket_take(h, HEIST_SPARSE_IDS(from)[k], HEIST_SPARSE_COUNTS(from)[k]);
+    } else if (h->count_size == 8 && from->count_size == 8 && !(h->flags & (HEIST_FLAG_SHARED | HEIST_FLAG_SPARSE))) {
+        Bucket* dst = &HEIST_BUCKET(h, lo);
+        const Bucket* src = &HEIST_BUCKET(from, lo);
+        for (int32_t k = 0; k <= hi - lo; k++) dst[k].count -= src[k].count;
+    } else {
+        for (int32_t i = lo; i <= hi; i++) {
+            uint64_t count = heist_dense_count(from, i);
+            if (count) heist_bucket_take(h, i, count);
+        }
+    }
+    if (h->flags & HEIST_FLAG_SHARED) {
+        // min and max stay as they are, they still bound every remaining value
+        __atomic_fetch_sub(&h->total_count, from->total_count, __ATOMIC_RELEASE);
+        return;
+    }
+
+    h->total_count -= from->total_count;
+    h->index_dirty = 1;
+    if (!(h->flags & HEIST_FLAG_SPARSE)) heist_occupancy_rebuild(h, lo, hi);
+    if (h->total_count == 0) {
+        h->min = h->max = 0;
+        heist_set_window(h, 0, -1);
+        return;
+    }
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        heist_set_window(h, HEIST_SPARSE_IDS(h)[0], HEIST_SPARSE_IDS(h)[h->sparse_size - 1]);
+        return;
+    }
+    // The window can only shrink from the ends that from's buckets reach
+    int32_t first = h->min_bucket_id >= lo ? heist_next_occupied(h, h->min_bucket_id) : h->min_bucket_id;
+    int32_t last = h->max_bucket_id <= hi ? heist_prev_occupied(h, h->max_bucket_id) : h->max_bucket_id;
+    heist_set_window(h, first, last);
+}
+
+// In-place subtraction of h2 from h1 bucket by bucket, e.g. of the previous snapshot of a
+// cumulative histogram to get the delta of an interval. h1 must hold at least the count of every
+// bucket of h2, otherwise, as after a counter reset, it returns 0 and leaves h1 unchanged. A
+// bound whose bucket emptied becomes the edge of the new end bucket, as with heistogram_remove
+static int heistogram_subtract_inplace(Heistogram* h1, const Heistogram* h2) {
+    if (!h1 || !h2) return 0;
+    if (h1 == h2 && !(h1->flags & HEIST_FLAG_SHARED)) {
+        heistogram_reset(h1);
+        return 1;
+    }
+    if (h2->flags & HEIST_FLAG_SHARED) {
+        Heistogram* from = heistogram_shared_snapshot(h2);
+        int ok = from && heistogram_subtract_inplace(h1, from);
+        heistogram_free(from);
+        return ok;
+    }
+    if (h2->total_count > HEIST_LOAD(h1, h1->total_count) || !heist_holds(h1, h2)) return 0;
+    heist_subtract_counts(h1, h2);
+    if ((h1->flags & HEIST_FLAG_SHARED) || h1->total_count == 0) return 1;
+    if (get_bucket_id(h1->min) < h1->min_bucket_id) h1->min = get_bucket_min(h1->min_bucket_id);
+    if (get_bucket_id(h1->max) > h1->max_bucket_id) h1->max = get_bucket_max(h1->max_bucket_id);
+    return 1;
+}
+
+// Merges n histograms into dst, for reducing many histograms at once. dst grows once to the union
+// of their windows, then each source is added with vector adds and the bitmap and window are
+// updated once at the end. NULL sources are skipped. Sparse, compact or shared destinations, shared
+// sources and dst itself as a source are merged one by one instead. Returns 0 if dst can't grow. On
+// the vector path dst is unchanged then, one by one the sources before the failure stay merged
+static int heistogram_merge_many(Heistogram* dst, const Heistogram* const* srcs, size_t n) {
+    if (!dst || (!srcs && n > 0)) return 0;
+    int one_by_one = dst->count_size != 8 || (dst->flags & (HEIST_FLAG_SHARED | HEIST_FLAG_SPARSE));
+    int32_t lo, hi;
+    heist_scan_window(dst, &lo, &hi);
+    uint64_t total = 0, min = UINT64_MAX, max = 0;
+    for (size_t i = 0; i < n && !one_by_one; i++) {
+        const Heistogram* src = srcs[i];
+        if (!src) continue;
+        if (src == dst || (src->flags & HEIST_FLAG_SHARED)) one_by_one = 1;
+        if (src->total_count == 0) continue;
+        heist_window_union(&lo, &hi, src->min_bucket_id, src->max_bucket_id);
+        total += src->total_count;
+        if (src->min < min) min = src->min;
+        if (src->max > max) max = src->max;
+    }
+    if (one_by_one) {
+        for (size_t i = 0; i < n; i++) {
+            if (srcs[i] && !heistogram_merge_inplace(dst, srcs[i])) return 0;
+        }
+        return 1;
+    }
+    if (total == 0) return 1;
+    if (!heist_reserve(dst, lo, hi)) return 0;
+
+    heist_add_counts_kernel add_counts = heist_batch_kernels()->add_counts;
+    uint64_t counts[HEIST_COUNTS_CHUNK];
+    for (size_t i = 0; i < n; i++) {
+        const Heistogram* src = srcs[i];
+        if (!src || src->total_count == 0) continue;
+        if (src->flags & HEIST_FLAG_SPARSE) {
+            for (size_t k = 0; k < src->sparse_size; k++) {
+                HEIST_BUCKET(dst, HEIST_SPARSE_IDS(src)[k]).count += HEIST_SPARSE_COUNTS(src)[k];
+            }
+        } else if (src->count_size == 8) {
+            add_counts(&HEIST_BUCKET(dst, src->min_bucket_id).count, &HEIST_BUCKET(src, src->min_bucket_id).count, src->max_bucket_id - src->min_bucket_id + 1);
+        } else {
+            for (int32_t b = src->min_bucket_id; b <= src->max_bucket_id; b += HEIST_COUNTS_CHUNK) {
+                size_t m = src->max_bucket_id - b + 1 < HEIST_COUNTS_CHUNK ? src->max_bucket_id - b + 1 : HEIST_COUNTS_CHUNK;
+                heist_counts_get(src, b, m, counts);
+                add_counts(&HEIST_BUCKET(dst, b).count, counts, m);
+            }
+        }
+    }
+
+    // Update dst metadata, the bounds of an empty histogram don't count
+    heist_occupancy_rebuild(dst, lo, hi);
+    if (dst->total_count == 0 || min < dst->min) dst->min = min;
+    if (dst->total_count == 0 || max > dst->max) dst->max = max;
+    dst->total_count += total;
+    heist_set_window(dst, lo, hi);
+    dst->index_dirty = 1;
+    return 1;
+}
+
+// Makes dst a copy of src within dst's own storage, so it only allocates if dst's bucket array
+// doesn't cover src. dst keeps its kind (compact, sparse, indexed, allocator) and src's counts,
+// bounds and window. Returns 0 if dst can't grow, dst is left empty then
+static int heistogram_clone_into(Heistogram* dst, const Heistogram* src) {
+    if (!dst || !src || (dst->flags & HEIST_FLAG_SHARED)) return 0;
+    if (dst == src) return 1;
+    heistogram_reset(dst);
+    return heistogram_merge_inplace(dst, src);
+}
+
+static double heistogram_percentile(const Heistogram* h, double p) {
+    if (!h || p < 0 || p > 100) return 0;
+
+    uint64_t total = HEIST_LOAD(h, h->total_count);
+    uint64_t min = HEIST_LOAD(h, h->min);
+    uint64_t max = HEIST_LOAD(h, h->max);
+    if (total == 0) return 0;
+
+    double target = ((100.0 - p) / 100.0) * total;
+    if (heist_index_ready(h)) {
+        uint64_t below;
+        int16_t i = heist_index_search(h, target, &below);
+        if (i < 0) return min;
+        uint64_t count = heist_dense_count(h, i);
+        uint64_t cumsum = total - below - count;
+        return heist_bucket_interpolate(i, ((double)(target - cumsum)) / (double)count, min, max);
+    }
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        const uint64_t* counts = HEIST_SPARSE_COUNTS(h);
+        uint64_t cumsum = 0;
+        for (size_t k = h->sparse_size; k-- > 0; ) {
+            if (cumsum + counts[k] >= target) {
+                return heist_bucket_interpolate(HEIST_SPARSE_IDS(h)[k], ((double)(target - cumsum)) / (double)counts[k], min, max);
+            }
+            cumsum += counts[k];
+        }
+        return min;
+    }
+
+    int32_t lo, hi, base = h->base_bucket_id;
+    heist_scan_window(h, &lo, &hi);
+    uint64_t cumsum = 0, copy[64];
+    double pos;
+    for (int32_t word = (hi - base) >> 6; lo <= hi && word >= (lo - base) >> 6; word--) {
+        int32_t first = lo, last = hi;
+        if (!heist_word_span(h, word, &first, &last)) continue;
+        const uint64_t* counts = heist_counts_span(h, first, last - first + 1, copy);
+        for (int32_t i = last; i >= first; i--) {
+            uint64_t count = counts[i - first];
+            if (count > 0) {
+                if (cumsum + count >= target) {
+                    pos = ((double)(target - cumsum)) / (double)count;
+                    return heist_bucket_interpolate(i, pos, min, max);
+                }
+                cumsum += count;
+            }
+        }
+    }
+    
+    return min;
+}
+
+// Answers several percentiles with a single walk over the buckets
+static void heistogram_percentiles(const Heistogram* h, const double* percentiles, size_t num_percentiles, double* results) {
+    if (!h || !percentiles || !results || num_percentiles == 0) return;
+
+    size_t stack_order[HEIST_PERCENTILES_STACK];
+    size_t* order = NULL;
+    // An index answers each percentile in logarithmic time, no need for the shared walk
+    if (!heist_index_ready(h)) {
+        order = num_percentiles <= HEIST_PERCENTILES_STACK ? stack_order : (size_t*)malloc(num_percentiles * sizeof(size_t));
+    }
+    if (!order) {
+        for (size_t k = 0; k < num_percentiles; k++) {
+            results[k] = heistogram_percentile(h, percentiles[k]);
+        }
+        return;
+    }
+    heist_percentile_order(percentiles, num_percentiles, order);
+
+    // Out of range requests sit at both ends of the order
+    size_t next = num_percentiles;
+    while (next > 0 && percentiles[order[next - 1]] > 100) {
+        results[order[--next]] = 0;
+    }
+    size_t first = 0;
+    while (first < next && percentiles[order[first]] < 0) {
+        results[order[first++]] = 0;
+    }
+
+    uint64_t total = HEIST_LOAD(h, h->total_count);
+    uint64_t min = total ? HEIST_LOAD(h, h->min) : 0;
+    uint64_t max = HEIST_LOAD(h, h->max);
+    int32_t lo, hi, base = h->base_bucket_id;
+    heist_scan_window(h, &lo, &hi);
+    uint64_t cumsum = 0, copy[64];
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        for (size_t k = h->sparse_size; k-- > 0 && next > first; ) {
+            uint64_t count = HEIST_SPARSE_COUNTS(h)[k];
+            while (next > first) {
+                double target = ((100.0 - percentiles[order[next - 1]]) / 100.0) * total;
+                if (cumsum + count < target) break;
+                double pos = ((double)(target - cumsum)) / (double)count;
+                results[order[--next]] = heist_bucket_interpolate(HEIST_SPARSE_IDS(h)[k], pos, min, max);
+            }
+            cumsum += count;
+        }
+    } else {
+        for (int32_t word = (hi - base) >> 6; lo <= hi && word >= (lo - base) >> 6 && next > first && total > 0; word--) {
+            int32_t low = lo, high = hi;
+            if (!heist_word_span(h, word, &low, &high)) continue;
+            const uint64_t* counts = heist_counts_span(h, low, high - low + 1, copy);
+            for (int32_t i = high; i >= low && next > first; i--) {
+                uint64_t count = counts[i - low];
+                if (count == 0) continue;
+                while (next > first) {
+                    double target = ((100.0 - percentiles[order[next - 1]]) / 100.0) * total;
+                    if (cumsum + count < target) break;
+                    double pos = ((double)(target - cumsum)) / (double)count;
+                    results[order[--next]] = heist_bucket_interpolate(i, pos, min, max);
+                }
+                cumsum += count;
+            }
+        }
+    }
+    while (next > first) {
+        results[order[--next]] = min;
+    }
+
+    if (order != stack_order) free(order);
+}
+
+// Fixed heistogram_prank function
+static double heistogram_prank(const Heistogram* h, double value) {
+    if (!h) return 0;
+    uint64_t total = HEIST_LOAD(h, h->total_count);
+    uint64_t min = HEIST_LOAD(h, h->min);
+    uint64_t max = HEIST_LOAD(h, h->max);
+    if (total == 0) return 0;
+    if (value < min) return 0;
+    if (value >= max) return 100.0;  // Fixed: was returning h->max
+    
+    int16_t bid = get_bucket_id((uint64_t)value);
+    int sparse = h->flags & HEIST_FLAG_SPARSE;
+    if (!sparse && bid >= h->base_bucket_id + h->capacity) return 100.0;
+    if (!sparse && bid < h->base_bucket_id) return 0;
+    
+    uint64_t cumsum = 0;
+    
+    // Count all buckets below the target bucket
+    if (heist_index_ready(h)) {
+        cumsum = heist_index_prefix(h, bid);
+    } else if (sparse) {
+        cumsum = heist_sparse_rank(h, bid);
+    } else {
+        int32_t lo, hi;
+        heist_scan_window(h, &lo, &hi);
+        for (int32_t i = lo; i < bid && i <= hi; i++) {
+            cumsum += heist_dense_count(h, i);
+        }
+    }
+    
+    // Calculate position within the target bucket
+    uint64_t min_val = get_bucket_min(bid);
+    uint64_t max_val = get_bucket_max(bid);
+    
+    // Clamp bucket bounds to actual histogram bounds
+    if (max_val > max) max_val = max;
+    if (min_val < min) min_val = min;
+    
+    double pos;
+    if (max_val == min_val) {
+        pos = 1.0;  // All values in bucket are <= value
+    } else {
+        pos = ((double)(value - min_val)) / ((double)(max_val - min_val));
+        if (pos > 1.0) pos = 1.0;  // Clamp to bucket bounds
+    }
+    
+    // Add the fraction of the target bucket
+    cumsum += (uint64_t)(pos * heist_bucket_count(h, bid));
+    if (cumsum > total) cumsum = total;  // Writers may have counted more since total was read
+    
+    return 100.0 * cumsum / total;
+}
+
+// New function: count elements <= value
+static uint64_t heistogram_count_upto(const Heistogram* h, uint64_t value) {
+    if (!h) return 0;
+    uint64_t total = HEIST_LOAD(h, h->total_count);
+    uint64_t min = HEIST_LOAD(h, h->min);
+    uint64_t max = HEIST_LOAD(h, h->max);
+    if (total == 0) return 0;
+    if (value < min) return 0;
+    if (value >= max) return total;
+    
+    int16_t bid = get_bucket_id(value);
+    int sparse = h->flags & HEIST_FLAG_SPARSE;
+    if (!sparse && bid >= h->base_bucket_id + h->capacity) return total;
+    if (!sparse && bid < h->base_bucket_id) return 0;
+    
+    uint64_t cumsum = 0;
+    
+    // Count all buckets below the target bucket
+    if (heist_index_ready(h)) {
+        cumsum = heist_index_prefix(h, bid);
+    } else if (sparse) {
+        cumsum = heist_sparse_rank(h, bid);
+    } else {
+        int32_t lo, hi;
+        heist_scan_window(h, &lo, &hi);
+        for (int32_t i = lo; i < bid && i <= hi; i++) {
+            cumsum += heist_dense_count(h, i);
+        }
+    }
+    
+    // Calculate position within the target bucket
+    uint64_t min_val = get_bucket_min(bid);
+    uint64_t max_val = get_bucket_max(bid);
+    
+    // Clamp bucket bounds to actual histogram bounds
+    if (max_val > max) max_val = max;
+    if (min_val < min) min_val = min;
+    
+    double pos;
+    if (max_val == min_val) {
+        pos = 1.0;  // All values in bucket are <= value
+    } else {
+        pos = ((double)(value - min_val)) / ((double)(max_val - min_val));
+        if (pos > 1.0) pos = 1.0;  // Clamp to bucket bounds
+    }
+    
+    // Add the fraction of the target bucket
+    cumsum += (uint64_t)(pos * heist_bucket_count(h, bid));
+    if (cumsum > total) cumsum = total;  // Writers may have counted more since total was read
+    
+    return cumsum;
+}
+
+// Regular copy of a shared or sparse histogram, for code that walks bucket arrays
+static Heistogram* heist_dense_copy(const Heistogram* h) {
+    if (h->flags & HEIST_FLAG_SHARED) return heistogram_shared_snapshot(h);
+    Heistogram* copy = heistogram_create();
+    if (copy && !heistogram_merge_inplace(copy, h)) {
+        heistogram_free(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+// Highest non-empty bucket, -1 for an empty histogram
+static inline int16_t heist_max_used_bucket(const Heistogram* h) {
+    return h->total_count ? h->max_bucket_id : -1;
+}
+
+// Writes the preamble of the format and the header, returns the bytes written
+static size_t heist_write_header(uint8_t* buffer, uint8_t version, uint64_t bucket_count, uint64_t total_count,
+                                 uint64_t min, uint64_t max, uint16_t min_bucket_id) {
+    uint8_t* ptr = buffer;
+    if (version == HEIST_FORMAT_V2) {
+        *ptr++ = HEIST_FORMAT_MAGIC;
+        *ptr++ = HEIST_FORMAT_V2;
+        *ptr++ = HEIST_FORMAT_MAPPING;
+    }
+    ptr += encode_varint(bucket_count, ptr); // Number of buckets to store
+    ptr += encode_varint(total_count, ptr);
+    ptr += encode_varint(min, ptr);
+    ptr += encode_varint(max - min, ptr);
+    ptr += encode_varint(min_bucket_id, ptr);
+    return ptr - buffer;
+}
+
+// Writes the serialized form into buffer, returns bytes written or 0 if capacity is too small
+static size_t heist_serialize_to(const Heistogram* h, int16_t max_bucket_id, uint8_t* buffer, size_t capacity, uint8_t version) {
+    uint8_t header[HEIST_V2_PREAMBLE + HEIST_HEADER_SIZE_BOUND];
+    size_t header_size = heist_write_header(header, version, max_bucket_id - h->min_bucket_id + 1, h->total_count, h->min, h->max, h->min_bucket_id);
+    if (capacity < header_size) return 0;
+    memcpy(buffer, header, header_size);
+    uint8_t* ptr = buffer + header_size;
+    uint8_t* end = buffer + capacity;
+
+    // Write buckets in reverse order (higher ids first), only checking for space when the
+    // worst case might not fit
+    size_t bucket_count = max_bucket_id - h->min_bucket_id + 1;
+    int fits = (size_t)(end - ptr) >= HEIST_COUNTS_SIZE_BOUND(bucket_count);
+    if (version == HEIST_FORMAT_V2) {
+        // Control bytes first, the count bytes follow them
+        if ((size_t)(end - ptr) < HEIST_GROUPS(bucket_count)) return 0;
+        uint8_t* control = ptr;
+        ptr += HEIST_GROUPS(bucket_count);
+        uint8_t scratch[HEIST_MAX_GROUP_SIZE + HEIST_GROUP_SLACK];
+        uint64_t counts[4];
+        for (int32_t i = max_bucket_id; i >= h->min_bucket_id; ) {
+            // Whole groups inside a zero bitmap word are a zero control byte and four zero bytes each
+            int32_t k = i - h->base_bucket_id;
+            size_t zero_groups = ((k & 63) + 1) / 4;
+            if (fits && zero_groups && i - (int32_t)(4 * zero_groups) + 1 >= h->min_bucket_id && h->occupied[k >> 6] == 0) {
+                memset(control, 0, zero_groups);
+                memset(ptr, 0, 4 * zero_groups);
+                control += zero_groups;
+                ptr += 4 * zero_groups;
+                i -= 4 * zero_groups;
+                continue;
+            }
+            size_t n = 0;
+            for (; n < 4 && i >= h->min_bucket_id; n++, i--) {
+                counts[n] = heist_dense_count(h, i);
+            }
+            if (fits) {
+                *control++ = heist_encode_group(counts, n, &ptr);
+                continue;
+            }
+            uint8_t* data = scratch;
+            *control++ = heist_encode_group(counts, n, &data);
+            if ((size_t)(end - ptr) < (size_t)(data - scratch)) return 0;
+            memcpy(ptr, scratch, data - scratch);
+            ptr += data - scratch;
+        }
+        return ptr - buffer;
+    }
+
+    if (fits) {
+        for (int32_t i = max_bucket_id; i >= h->min_bucket_id; ) {
+            // A zero bitmap word is 64 empty buckets in a row
+            int32_t k = i - h->base_bucket_id;
+            if ((k & 63) == 63 && i - 63 >= h->min_bucket_id && h->occupied[k >> 6] == 0) {
+                ptr += encode_empty_buckets(64, ptr);
+                i -= 64;
+                continue;
+            }
+            ptr += encode_bucket(heist_dense_count(h, i), ptr);
+            i--;
+        }
+        return ptr - buffer;
+    }
+
+    uint8_t scratch[HEIST_MAX_VARINT_SIZE];
+    for (int16_t i = max_bucket_id; i >= h->min_bucket_id; i--) {
+        size_t len = encode_bucket(heist_dense_count(h, i), scratch);
+        if ((size_t)(end - ptr) < len) return 0;
+        memcpy(ptr, scratch, len);
+        ptr += len;
+    }
+    return ptr - buffer;
+}
+
+// Upper bound of the serialized size in either format, enough for heistogram_serialize_into to always succeed
+static size_t heistogram_serialized_size_bound(const Heistogram* h) {
+    if (!h) return 0;
+    if (h->flags & HEIST_FLAG_SHARED) return HEIST_V2_PREAMBLE + HEIST_HEADER_SIZE_BOUND + HEIST_COUNTS_SIZE_BOUND(h->capacity);
+    int16_t max_bucket_id = heist_max_used_bucket(h);
+    return HEIST_V2_PREAMBLE + HEIST_HEADER_SIZE_BOUND + HEIST_COUNTS_SIZE_BOUND(max_bucket_id - h->min_bucket_id + 1);
+}
+
+// Serializes in the given format (HEIST_FORMAT_V1 or HEIST_FORMAT_V2) into a caller provided
+// buffer, returns the bytes written or 0 if it doesn't fit
+static size_t heistogram_serialize_into_version(const Heistogram* h, void* buffer, size_t capacity, uint8_t version) {
+    if (!h || !buffer || !heist_format_supported(version)) return 0;
+    if (h->flags & (HEIST_FLAG_SHARED | HEIST_FLAG_SPARSE)) {
+        Heistogram* snapshot = heist_dense_copy(h);
+        size_t size = snapshot ? heistogram_serialize_into_version(snapshot, buffer, capacity, version) : 0;
+        heistogram_free(snapshot);
+        return size;
+    }
+    return heist_serialize_to(h, heist_max_used_bucket(h), (uint8_t*)buffer, capacity, version);
+}
+
+// Serializes into a caller provided buffer, returns the bytes written or 0 if it doesn't fit
+static size_t heistogram_serialize_into(const Heistogram* h, void* buffer, size_t capacity) {
+    return heistogram_serialize_into_version(h, buffer, capacity, HEIST_SERIALIZE_VERSION);
+}
+
+// Serializes in the given format (HEIST_FORMAT_V1 or HEIST_FORMAT_V2) into a new buffer
+static inline void* heistogram_serialize_version(const Heistogram* h, size_t* size, uint8_t version) {
+    if (!h || !size || !heist_format_supported(version)) return NULL;
+    if (h->flags & (HEIST_FLAG_SHARED | HEIST_FLAG_SPARSE)) {
+        Heistogram* snapshot = heist_dense_copy(h);
+        void* buffer = snapshot ? heistogram_serialize_version(snapshot, size, version) : NULL;
+        heistogram_free(snapshot);
+        return buffer;
+    }
+    
+    // Find the highest used bucket ID
+    int16_t max_bucket_id = heist_max_used_bucket(h);
+    size_t max_total_size = HEIST_V2_PREAMBLE + HEIST_HEADER_SIZE_BOUND + HEIST_COUNTS_SIZE_BOUND(max_bucket_id - h->min_bucket_id + 1);
+    
+    uint8_t* buffer = (uint8_t*)malloc(max_total_size);
+    if (!buffer) return NULL;
+    *size = heist_serialize_to(h, max_bucket_id, buffer, max_total_size, version);
+    
+    // Reallocate to actual size
+    buffer = (uint8_t*)realloc(buffer, *size);
+    return buffer;
+}
+
+static inline void* heistogram_serialize(const Heistogram* h, size_t* size) {
+    return heistogram_serialize_version(h, size, HEIST_SERIALIZE_VERSION);
+}
+
+// Decodes a serialized histogram of either format into an existing one, reusing its bucket array.
+// Returns 1 on success, 0 if the buffer is invalid or the buckets can't grow (h is then left empty)
+static int heistogram_deserialize_into(Heistogram* h, const void* buffer, size_t size) {
+    if (!h || !buffer || (h->flags & HEIST_FLAG_SHARED)) return 0;
+    
+    // Start out empty so failures never leave a half decoded histogram behind
+    heistogram_reset(h);
+
+    // Read header
+    int32_t lo, hi;
+    HeistHeader hdr;
+    size_t offset = heist_read_header(buffer, size, &hdr);
+    if (offset == 0 || hdr.total_count == 0) return offset != 0;
+    lo = hdr.min_bucket_id;
+    hi = lo + (int32_t)hdr.bucket_count - 1;
+    if (hdr.bucket_count == 0) return 0;
+
+    // A sparse histogram stays sparse if the non-empty buckets fit in pairs
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        int loaded = heist_sparse_read(h, &hdr, (const uint8_t*)buffer + offset, (const uint8_t*)buffer + size);
+        if (loaded == 1) {
+            h->total_count = hdr.total_count;
+            h->min = hdr.min;
+            h->max = hdr.max;
+        }
+        if (loaded >= 0) return loaded;
+        if (!heist_densify(h, lo, hi)) return 0;
+    }
+    if (!heist_reserve(h, lo, hi)) return 0;
+    
+    HeistCountDecoder d;
+    if (!heist_count_decoder_init(&d, &hdr, (const uint8_t*)buffer + offset, (const uint8_t*)buffer + size) || !heist_read_counts(&hdr, &d, h, 1)) {
+        memset((uint8_t*)h->buckets + (size_t)(lo - h->base_bucket_id) * h->count_size, 0, (size_t)(hi - lo + 1) * h->count_size);
+        return 0;
+    }
+
+    h->total_count = hdr.total_count;
+    h->min = hdr.min;
+    h->max = hdr.max;
+    heist_trim_window(h, lo, hi);  // Older writers may have stored empty buckets at the low end
+    return 1;
+}
+
+static inline Heistogram* heistogram_deserialize(const void* buffer, size_t size) {
+    if (!buffer) return NULL;
+
+    Heistogram* h = heistogram_create();
+    if (!h) return NULL;
+    if (!heistogram_deserialize_into(h, buffer, size)) {
+        heistogram_free(h);
+        return NULL;
+    }
+    return h;
+}
+
+/*********************************************
+    FUNCTIONS OPERATING ON SERIALIZED DATA
+**********************************************/
+
+// Updated heistogram_percentile_serialized function
+static double heistogram_percentile_serialized(const void* buffer, size_t size, double p) {
+    if (!buffer || size < 3) return 0;  // Minimum size check for header
+
+    HeistHeader hdr;
+    size_t offset = heist_read_header(buffer, size, &hdr);
+    if (offset == 0) return 0;
+
+    HeistCountDecoder d;
+    if (!heist_count_decoder_init(&d, &hdr, (const uint8_t*)buffer + offset, (const uint8_t*)buffer + size)) return 0;
+    
+    double target = ((100.0 - p) / 100.0) * hdr.total_count;
+    uint64_t cumsum = 0;
+    uint64_t counts[HEIST_DECODE_CHUNK];
+
+    // Process buckets in reverse order (higher IDs first), a chunk at a time
+    int32_t i = (int32_t)hdr.min_bucket_id + hdr.bucket_count - 1;
+    while (i >= hdr.min_bucket_id) {
+        size_t n = i - hdr.min_bucket_id + 1;
+        if (n > HEIST_DECODE_CHUNK) n = HEIST_DECODE_CHUNK;
+        if (!heist_decode_counts(&d, counts, n)) return 0;
+        for (size_t k = 0; k < n; k++, i--) {
+            uint64_t count = counts[k];
+            if (count > 0 && cumsum + count >= target) {
+                double pos = ((double)(target - cumsum)) / (double)count;
+                return heist_bucket_interpolate(i, pos, hdr.min, hdr.max);
+            }
+            cumsum += count;
+        }
+    }
+
+    return hdr.min;
+}
+
+
+
+// Answers several percentiles with a single decode pass over the serialized buckets
+static void heistogram_percentiles_serialized(const void* buffer, size_t size, const double* percentiles, size_t num_percentiles, double* results) {
+    if (!percentiles || !results || num_percentiles == 0) return;
+    memset(results, 0, num_percentiles * sizeof(double));
+    if (!buffer || size < 3) return;  // Minimum size check for header
+
+    HeistHeader hdr;
+    size_t offset = heist_read_header(buffer, size, &hdr);
+    HeistCountDecoder d;
+    if (offset == 0 || !heist_count_decoder_init(&d, &hdr, (const uint8_t*)buffer + offset, (const uint8_t*)buffer + size)) return;
+
+    size_t stack_order[HEIST_PERCENTILES_STACK];
+    size_t* order = num_percentiles <= HEIST_PERCENTILES_STACK ? stack_order : (size_t*)malloc(num_percentiles * sizeof(size_t));
+    if (!order) {
+        for (size_t k = 0; k < num_percentiles; k++) {
+            results[k] = heistogram_percentile_serialized(buffer, size, percentiles[k]);
+        }
+        return;
+    }
+    heist_percentile_order(percentiles, num_percentiles, order);
+
+    // Out of range requests sit at both ends of the order and keep their zero result
+    size_t next = num_percentiles;
+    while (next > 0 && percentiles[order[next - 1]] > 100) next--;
+    size_t first = 0;
+    while (first < next && percentiles[order[first]] < 0) first++;
+
+    uint64_t cumsum = 0;
+    uint64_t counts[HEIST_DECODE_CHUNK];
+    int32_t i = (int32_t)hdr.min_bucket_id + hdr.bucket_count - 1;
+    while (i >= hdr.min_bucket_id && next > first) {
+        size_t n = i - hdr.min_bucket_id + 1;
+        if (n > HEIST_DECODE_CHUNK) n = HEIST_DECODE_CHUNK;
+        if (!heist_decode_counts(&d, counts, n)) break;
+        for (size_t k = 0; k < n && next > first; k++, i--) {
+            uint64_t count = counts[k];
+            if (count == 0) continue;
+            while (next > first) {
+                double target = ((100.0 - percentiles[order[next - 1]]) / 100.0) * hdr.total_count;
+                if (cumsum + count < target) break;
+                double pos = ((double)(target - cumsum)) / (double)count;
+                results[order[--next]] = heist_bucket_interpolate(i, pos, hdr.min, hdr.max);
+            }
+            cumsum += count;
+        }
+    }
+    while (next > first) {
+        results[order[--next]] = hdr.min;
+    }
+
+    if (order != stack_order) free(order);
+}
+
+
+
+// Fixed function to merge in-memory Heistogram with serialized Heistogram
+static Heistogram* heistogram_merge_serialized(Heistogram* h, const void* buffer, size_t size) {
+    if (!h || !buffer || size < 3) return NULL;
+    
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        Heistogram* result = heistogram_create_sparse();
+        if (result && (!heistogram_deserialize_into(result, buffer, size) || !heistogram_merge_inplace(result, h))) {
+            heistogram_free(result);
+            return NULL;
+        }
+        return result;
+    }
+
+    HeistHeader hdr;
+    size_t offset = heist_read_header(buffer, size, &hdr);
+    if (offset == 0) return NULL;
+    
+    // Create a new Heistogram for the result
+    Heistogram* result = heistogram_create();
+    if (!result) return NULL;
+    
+    // Resize result to accommodate the occupied window of h and the serialized buckets, with the
+    // counter size of h
+    result->count_size = h->count_size;
+    int32_t lo, hi, hlo, hhi;
+    heist_scan_window(h, &hlo, &hhi);
+    lo = hlo;
+    hi = hhi;
+    heist_window_union(&lo, &hi, hdr.min_bucket_id, (int32_t)hdr.min_bucket_id + hdr.bucket_count - 1);
+    if (lo <= hi && !heist_reserve(result, lo, hi)) {
+        heistogram_free(result);
+        return NULL;
+    }
+    
+    // Copy counts from h
+    if (!heist_add_counts_from(result, h, hlo, hhi, 1)) {
+        heistogram_free(result);
+        return NULL;
+    }
+    
+    // Add counts from serialized data
+    HeistCountDecoder d;
+    if (!heist_count_decoder_init(&d, &hdr, (const uint8_t*)buffer + offset, (const uint8_t*)buffer + size) || !heist_read_counts(&hdr, &d, result, 1)) {
+        heistogram_free(result);
+        return NULL;
+    }
+    
+    // Update result metadata
+    result->total_count = h->total_count + hdr.total_count;
+    result->min = hdr.total_count && (hdr.min < h->min || !h->total_count) ? hdr.min : h->min;
+    result->max = h->max > hdr.max ? h->max : hdr.max;
+    heist_trim_window(result, lo, hi);
+    
+    return result;
+
+}
+
+// Fixed function to merge two serialized Heistograms
+static Heistogram* heistogram_merge_two_serialized(const void* buffer1, size_t size1, const void* buffer2, size_t size2) {
+    if (!buffer1 || size1 < 3 || !buffer2 || size2 < 3) return NULL;
+    
+    // Decode headers
+    HeistHeader hdr1, hdr2;
+    size_t offset1 = heist_read_header(buffer1, size1, &hdr1);
+    if (offset1 == 0) return NULL;
+    size_t offset2 = heist_read_header(buffer2, size2, &hdr2);
+    if (offset2 == 0) return NULL;
+    
+    // Create a new Heistogram for the result
+    Heistogram* result = heistogram_create();
+    if (!result) return NULL;
+    
+    // Resize result to accommodate all buckets
+    int32_t lo = hdr1.min_bucket_id, hi = (int32_t)hdr1.min_bucket_id + hdr1.bucket_count - 1;
+    heist_window_union(&lo, &hi, hdr2.min_bucket_id, (int32_t)hdr2.min_bucket_id + hdr2.bucket_count - 1);
+    if (lo <= hi && !heist_reserve(result, lo, hi)) {
+        heistogram_free(result);
+        return NULL;
+    }
+    
+    // Read counts from both serialized Heistograms
+    HeistCountDecoder d1, d2;
+    if (!heist_count_decoder_init(&d1, &hdr1, (const uint8_t*)buffer1 + offset1, (const uint8_t*)buffer1 + size1) ||
+        !heist_count_decoder_init(&d2, &hdr2, (const uint8_t*)buffer2 + offset2, (const uint8_t*)buffer2 + size2) ||
+        !heist_read_counts(&hdr1, &d1, result, 1) || !heist_read_counts(&hdr2, &d2, result, 1)) {
+        heistogram_free(result);
+        return NULL;
+    }
+    
+    // Update result metadata
+    result->total_count = hdr1.total_count + hdr2.total_count;
+    result->min = hdr2.total_count && (hdr2.min < hdr1.min || !hdr1.total_count) ? hdr2.min : hdr1.min;
+    result->max = hdr1.max > hdr2.max ? hdr1.max : hdr2.max;
+    heist_trim_window(result, lo, hi);
+    
+    return result;
+}
+
+// Merges a serialized histogram into h with every count multiplied by scale, see
+// heistogram_merge_inplace_scaled
+static int heistogram_merge_inplace_serialized_scaled(Heistogram* h, const void* buffer, size_t size, uint64_t scale) {
+    if (!h || !buffer || size < 3) return 0;
+    if (h->flags & HEIST_FLAG_SHARED) {
+        Heistogram* from = heistogram_deserialize(buffer, size);
+        int ok = from && heistogram_merge_inplace_scaled(h, from, scale);
+        heistogram_free(from);
+        return ok;
+    }
+    if (h->flags & HEIST_FLAG_SPARSE) {
+        // Decoding into pairs of its own first leaves h untouched by a bad buffer
+        Heistogram* from = heistogram_create_sparse();
+        int ok = from && heistogram_deserialize_into(from, buffer, size) && heistogram_merge_inplace_scaled(h, from, scale);
+        heistogram_free(from);
+        return ok;
+    }
+    
+    HeistHeader hdr;
+    size_t offset = heist_read_header(buffer, size, &hdr);
+    if (offset == 0) return 0;
+
+    if(hdr.total_count == 0 || scale == 0) return 1; // we are merging with an empty heistgram
+    if (hdr.total_count > (UINT64_MAX - h->total_count) / scale) return 0;
+
+    // Expand h if needed to accommodate serialized Heistogram's buckets
+    if (hdr.bucket_count && !heist_reserve(h, hdr.min_bucket_id, (int32_t)hdr.min_bucket_id + hdr.bucket_count - 1)) return 0;
+    
+    // Add counts from serialized data
+    HeistCountDecoder d;
+    if (!heist_count_decoder_init(&d, &hdr, (const uint8_t*)buffer + offset, (const uint8_t*)buffer + size)) return 0;
+    int32_t lo, hi;
+    heist_scan_window(h, &lo, &hi);
+    heist_window_union(&lo, &hi, hdr.min_bucket_id, (int32_t)hdr.min_bucket_id + hdr.bucket_count - 1);
+    h->index_dirty = 1;
+    int ok = heist_read_counts(&hdr, &d, h, scale);
+    heist_trim_window(h, lo, hi);  // Also covers whatever a truncated buffer added
+    if (!ok) return 0;
+    
+    // Update h metadata, the bounds of an empty histogram don't count
+    if (h->total_count == 0) {
+        h->min = hdr.min;
+        h->max = hdr.max;
+    }
+    h->total_count += hdr.total_count * scale;
+    if (hdr.min < h->min) h->min = hdr.min;
+    if (hdr.max > h->max) h->max = hdr.max;
+    
+    return 1;
+}
+
+// New function to merge serialized Heistogram into an existing in-memory Heistogram
+static int heistogram_merge_inplace_serialized(Heistogram* h, const void* buffer, size_t size) {
+    return heistogram_merge_inplace_serialized_scaled(h, buffer, size, 1);
+}
+
+// Subtracts a serialized histogram from h, see heistogram_subtract_inplace
+static int heistogram_subtract_inplace_serialized(Heistogram* h, const void* buffer, size_t size) {
+    if (!h || !buffer || size < 3) return 0;
+    // Decoding into pairs of its own first leaves h untouched by a bad buffer
+    Heistogram* from = heistogram_create_sparse();
+    int ok = from && heistogram_deserialize_into(from, buffer, size) && heistogram_subtract_inplace(h, from);
+    heistogram_free(from);
+    return ok;
+}
+
+// Merges n serialized histograms into dst. All headers are read first, so dst grows once to the
+// union of their bucket ranges and a bad header leaves dst unchanged. A buffer that turns out to
+// be truncated stops the merge: dst then holds the buffers before it and returns 0, as a loop of
+// heistogram_merge_inplace_serialized would
+static int heistogram_merge_many_serialized(Heistogram* dst, const HeistBuffer* buffers, size_t n) {
+    if (!dst || (!buffers && n > 0)) return 0;
+    if (dst->flags & (HEIST_FLAG_SHARED | HEIST_FLAG_SPARSE)) {
+        for (size_t i = 0; i < n; i++) {
+            if (!heistogram_merge_inplace_serialized(dst, buffers[i].data, buffers[i].size)) return 0;
+        }
+        return 1;
+    }
+
+    HeistHeader hdr;
+    int32_t lo, hi;
+    heist_scan_window(dst, &lo, &hi);
+    for (size_t i = 0; i < n; i++) {
+        if (!buffers[i].data || buffers[i].size < 3 || heist_read_header(buffers[i].data, buffers[i].size, &hdr) == 0) return 0;
+        if (hdr.total_count && hdr.bucket_count) heist_window_union(&lo, &hi, hdr.min_bucket_id, (int32_t)hdr.min_bucket_id + hdr.bucket_count - 1);
+    }
+    if (lo > hi) return 1;
+    if (!heist_reserve(dst, lo, hi)) return 0;
+
+    int ok = 1;
+    dst->index_dirty = 1;
+    for (size_t i = 0; i < n && ok; i++) {
+        size_t offset = heist_read_header(buffers[i].data, buffers[i].size, &hdr);
+        if (hdr.total_count == 0) continue;
+        HeistCountDecoder d;
+        const uint8_t* start = (const uint8_t*)buffers[i].data;
+        ok = heist_count_decoder_init(&d, &hdr, start + offset, start + buffers[i].size) && heist_read_counts(&hdr, &d, dst, 1);
+        if (!ok) break;
+
+        // Update dst metadata, the bounds of an empty histogram don't count
+        if (dst->total_count == 0) {
+            dst->min = hdr.min;
+            dst->max = hdr.max;
+        }
+        dst->total_count += hdr.total_count;
+        if (hdr.min < dst->min) dst->min = hdr.min;
+        if (hdr.max > dst->max) dst->max = hdr.max;
+    }
+    heist_trim_window(dst, lo, hi);  // Also covers whatever a truncated buffer added
+    return ok;
+}
+
+/*
+ * Streaming merge of serialized histograms into a serialized result. Every buffer stores its
+ * counts from the highest bucket down, so one pass over the union of the bucket ranges decodes a
+ * chunk from each input, adds them and encodes the sums right away. The state is a cursor of one
+ * decoded chunk per input: no Heistogram is created and no bucket array is allocated.
+ */
+
+// Cursors up to this many inputs live on the stack, more are allocated
+#define HEIST_MERGE_STACK_INPUTS 8
+
+typedef struct {
+    HeistCountDecoder d;
+    int32_t lo;        // Lowest stored bucket id
+    int32_t next;      // Bucket id of counts[used], or of the next count to decode once used reaches available
+    size_t used, available;
+    int subtract;      // Chunks are decoded negated so adding them subtracts, for serialized deltas
+    uint64_t counts[HEIST_DECODE_CHUNK];
+} HeistMergeCursor;
+
+// Decodes the next chunk once the current one is used up, returns 0 if the buffer is truncated
+static inline int heist_merge_cursor_fill(HeistMergeCursor* c) {
+    if (c->used < c->available) return 1;
+    size_t n = c->next - c->lo + 1;
+    if (n > HEIST_DECODE_CHUNK) n = HEIST_DECODE_CHUNK;
+    if (!heist_decode_counts(&c->d, c->counts, n)) return 0;
+    if (c->subtract) {
+        for (size_t k = 0; k < n; k++) c->counts[k] = 0 - c->counts[k];  // Adding wraps around to subtracting
+    }
+    c->used = 0;
+    c->available = n;
+    return 1;
+}
+
+// Adds the counts of buckets hi down to lo to sums, sums[k] belongs to bucket hi - k. The cursor
+// must not be past hi. Returns 0 if the buffer is truncated
+static int heist_merge_cursor_add(HeistMergeCursor* c, int32_t hi, int32_t lo, uint64_t* sums) {
+    int32_t stop = c->lo > lo ? c->lo : lo;
+    while (c->next >= stop) {
+        if (!heist_merge_cursor_fill(c)) return 0;
+        size_t take = c->available - c->used;
+        if (take > (size_t)(c->next - stop + 1)) take = c->next - stop + 1;
+        uint64_t* out = sums + (hi - c->next);
+        for (size_t k = 0; k < take; k++) out[k] += c->counts[c->used + k];
+        c->used += take;
+        c->next -= (int32_t)take;
+    }
+    return 1;
+}
+
+// Moves the cursor past the buckets above hi, returns 0 if the buffer is truncated
+static int heist_merge_cursor_skip(HeistMergeCursor* c, int32_t hi) {
+    while (c->next > hi && c->next >= c->lo) {
+        if (!heist_merge_cursor_fill(c)) return 0;
+        size_t take = c->available - c->used;
+        if (take > (size_t)(c->next - hi)) take = c->next - hi;
+        c->used += take;
+        c->next -= (int32_t)take;
+    }
+    return 1;
+}
+
+// Points a cursor at the counts of a serialized histogram whose header was read, returns 0 if the
+// buffer is truncated
+static int heist_merge_cursor_init(HeistMergeCursor* c, const HeistBuffer* input, const HeistHeader* hdr, size_t offset, int subtract) {
+    c->lo = hdr->min_bucket_id;
+    c->next = (int32_t)hdr->min_bucket_id + hdr->bucket_count - 1;
+    c->used = c->available = 0;
+    c->subtract = subtract;
+    return heist_count_decoder_init(&c->d, hdr, (const uint8_t*)input->data + offset, (const uint8_t*)input->data + input->size);
+}
+
+// Reads the headers of n serialized histograms: the bucket range, count and bounds of their merge.
+// Returns 0 if a header is invalid. Sets *streamable to 0 for an empty merge or an input without
+// buckets, which the streaming merge leaves to the decoding path
+static int heist_serialized_merge_header(const HeistBuffer* inputs, size_t n, HeistHeader* out, int* streamable) {
+    HeistHeader hdr;
+    int32_t lo = INT32_MAX, hi = INT32_MIN;
+    memset(out, 0, sizeof(*out));
+    *streamable = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (!inputs[i].data || inputs[i].size < 3 || heist_read_header(inputs[i].data, inputs[i].size, &hdr) == 0) return 0;
+        if (hdr.total_count == 0) continue;
+        if (hdr.bucket_count == 0) *streamable = 0;
+        else heist_window_union(&lo, &hi, hdr.min_bucket_id, (int32_t)hdr.min_bucket_id + hdr.bucket_count - 1);
+        if (out->total_count == 0 || hdr.min < out->min) out->min = hdr.min;
+        if (out->total_count == 0 || hdr.max > out->max) out->max = hdr.max;
+        out->total_count += hdr.total_count;
+    }
+    if (out->total_count == 0 || lo > hi) {
+        *streamable = 0;
+        return 1;
+    }
+    out->min_bucket_id = (uint16_t)lo;
+    out->bucket_count = (uint16_t)(hi - lo + 1);
+    return 1;
+}
+
+// Upper bound of the size heistogram_serialized_merge_into writes for these inputs, 0 if a header is invalid
+static size_t heistogram_serialized_merge_size_bound(const HeistBuffer* inputs, size_t n) {
+    HeistHeader hdr;
+    int streamable;
+    if ((!inputs && n > 0) || !heist_serialized_merge_header(inputs, n, &hdr, &streamable)) return 0;
+    return HEIST_V2_PREAMBLE + HEIST_HEADER_SIZE_BOUND + HEIST_COUNTS_SIZE_BOUND(hdr.bucket_count);
+}
+
+// Serializes the merge of the inputs the slow way, decoding them into a histogram first
+static size_t heist_serialized_merge_decoded(const HeistBuffer* inputs, size_t n, uint8_t* buffer, size_t capacity, uint8_t version) {
+    Heistogram* merged = heistogram_create();
+    size_t size = 0;
+    if (merged && heistogram_merge_many_serialized(merged, inputs, n)) {
+        size = heistogram_serialize_into_version(merged, buffer, capacity, version);
+    }
+    heistogram_free(merged);
+    return size;
+}
+
+// Streams the merged counts of the cursors into buffer after the header, returns the bytes written
+// or 0 if an input is truncated or the result doesn't fit. Sets *trimmed if an end bucket of the
+// merge is empty
+static size_t heist_serialized_merge_stream(HeistMergeCursor* cursors, size_t active, const HeistHeader* merged,
+                                            uint8_t* buffer, size_t capacity, uint8_t version, int* trimmed) {
+    uint8_t header[HEIST_V2_PREAMBLE + HEIST_HEADER_SIZE_BOUND];
+    size_t header_size = heist_write_header(header, version, merged->bucket_count, merged->total_count, merged->min, merged->max, merged->min_bucket_id);
+    size_t groups = version == HEIST_FORMAT_V2 ? HEIST_GROUPS(merged->bucket_count) : 0;
+    if (capacity < header_size + groups) return 0;
+    memcpy(buffer, header, header_size);
+    uint8_t* control = buffer + header_size;  // Format 2 control bytes come first, the count bytes follow them
+    uint8_t* ptr = control + groups;
+    uint8_t* end = buffer + capacity;
+
+    // Same as heist_serialize_to: only check for space when the worst case might not fit
+    int fits = (size_t)(end - ptr) >= HEIST_COUNTS_SIZE_BOUND(merged->bucket_count);
+    uint8_t scratch[HEIST_MAX_GROUP_SIZE + HEIST_GROUP_SLACK];
+    uint64_t sums[HEIST_DECODE_CHUNK];
+    int32_t lo = merged->min_bucket_id, hi = lo + merged->bucket_count - 1;
+    for (int32_t i = hi; i >= lo; i -= HEIST_DECODE_CHUNK) {
+        int32_t chunk_lo = i - HEIST_DECODE_CHUNK + 1 > lo ? i - HEIST_DECODE_CHUNK + 1 : lo;
+        size_t len = i - chunk_lo + 1;
+        memset(sums, 0, sizeof(sums));
+        for (size_t k = 0; k < active; k++) {
+            if (cursors[k].next >= chunk_lo && !heist_merge_cursor_add(&cursors[k], i, chunk_lo, sums)) return 0;
+        }
+        if ((i == hi && sums[0] == 0) || (chunk_lo == lo && sums[len - 1] == 0)) *trimmed = 1;
+
+        for (size_t k = 0; k < len; k += (version == HEIST_FORMAT_V2 ? 4 : 1)) {
+            uint8_t* data = fits ? ptr : scratch;
+            if (version == HEIST_FORMAT_V2) *control++ = heist_encode_group(sums + k, len - k < 4 ? len - k : 4, &data);
+            else data += encode_bucket(sums[k], data);
+            if (fits) {
+                ptr = data;
+                continue;
+            }
+            if ((size_t)(end - ptr) < (size_t)(data - scratch)) return 0;
+            memcpy(ptr, scratch, data - scratch);
+            ptr += data - scratch;
+        }
+    }
+    return ptr - buffer;
+}
+
+// Merges n serialized histograms straight into the serialized form of their merge, byte for byte
+// what serializing heistogram_merge_many_serialized's result would give. Returns the bytes
+// written, or 0 if an input is invalid or truncated or the result doesn't fit
+static size_t heistogram_serialized_merge_into_version(const HeistBuffer* inputs, size_t n, void* buffer, size_t capacity, uint8_t version) {
+    if ((!inputs && n > 0) || !buffer || !heist_format_supported(version)) return 0;
+    HeistHeader merged;
+    int streamable;
+    if (!heist_serialized_merge_header(inputs, n, &merged, &streamable)) return 0;
+    if (!streamable) return heist_serialized_merge_decoded(inputs, n, (uint8_t*)buffer, capacity, version);
+
+    HeistMergeCursor stack_cursors[HEIST_MERGE_STACK_INPUTS];
+    HeistMergeCursor* cursors = n <= HEIST_MERGE_STACK_INPUTS ? stack_cursors : (HeistMergeCursor*)malloc(n * sizeof(HeistMergeCursor));
+    if (!cursors) return 0;
+    size_t active = 0;
+    int ok = 1;
+    for (size_t i = 0; i < n && ok; i++) {
+        HeistHeader hdr;
+        size_t offset = heist_read_header(inputs[i].data, inputs[i].size, &hdr);
+        if (hdr.total_count == 0) continue;
+        ok = heist_merge_cursor_init(&cursors[active++], &inputs[i], &hdr, offset, 0);
+    }
+    int trimmed = 0;
+    size_t size = ok ? heist_serialized_merge_stream(cursors, active, &merged, (uint8_t*)buffer, capacity, version, &trimmed) : 0;
+    if (cursors != stack_cursors) free(cursors);
+
+    // Serialized histograms have non-empty end buckets, so the merge normally does too. Other
+    // writers may pad the range, the result then needs the trimmed window of a real histogram
+    if (size && trimmed) return heist_serialized_merge_decoded(inputs, n, (uint8_t*)buffer, capacity, version);
+    return size;
+}
+
+// Merges n serialized histograms into a caller provided buffer in the default format, see
+// heistogram_serialized_merge_into_version
+static size_t heistogram_serialized_merge_into(const HeistBuffer* inputs, size_t n, void* buffer, size_t capacity) {
+    return heistogram_serialized_merge_into_version(inputs, n, buffer, capacity, HEIST_SERIALIZE_VERSION);
+}
+
+// Merges n serialized histograms into a new buffer in the given format, NULL if an input is invalid
+static void* heistogram_serialized_merge_version(const HeistBuffer* inputs, size_t n, size_t* size, uint8_t version) {
+    if (!size) return NULL;
+    size_t bound = heistogram_serialized_merge_size_bound(inputs, n);
+    uint8_t* buffer = bound ? (uint8_t*)malloc(bound) : NULL;
+    if (!buffer) return NULL;
+    *size = heistogram_serialized_merge_into_version(inputs, n, buffer, bound, version);
+    if (*size == 0) {
+        free(buffer);
+        return NULL;
+    }
+    return realloc(buffer, *size);
+}
+
+static void* heistogram_serialized_merge(const HeistBuffer* inputs, size_t n, size_t* size) {
+    return heistogram_serialized_merge_version(inputs, n, size, HEIST_SERIALIZE_VERSION);
+}
+
+/*
+ * Serialized deltas of cumulative histograms, streamed with the cursors of the merge above. A
+ * first pass over both buffers checks that the later one holds the earlier one bucket by bucket
+ * and finds the non-empty range of the delta, which the header needs. The second pass encodes the
+ * differences of that range.
+ */
+
+// Serializes buffer1 minus buffer2 the slow way, decoding buffer1 into a histogram first
+static size_t heist_serialized_subtract_decoded(const HeistBuffer* inputs, uint8_t* buffer, size_t capacity, uint8_t version) {
+    Heistogram* delta = heistogram_deserialize(inputs[0].data, inputs[0].size);
+    size_t size = 0;
+    if (delta && heistogram_subtract_inplace_serialized(delta, inputs[1].data, inputs[1].size)) {
+        size = heistogram_serialize_into_version(delta, buffer, capacity, version);
+    }
+    heistogram_free(delta);
+    return size;
+}
+
+// Serializes the delta of two serialized snapshots of a cumulative histogram, buffer1 the later
+// one, without creating a Heistogram. Byte for byte what serializing buffer1 after
+// heistogram_subtract_inplace_serialized with buffer2 would give. Returns the bytes written, or 0
+// if an input is invalid or truncated, buffer1 doesn't hold buffer2 or the result doesn't fit
+static size_t heistogram_serialized_subtract_into_version(const void* buffer1, size_t size1, const void* buffer2, size_t size2,
+                                                          void* buffer, size_t capacity, uint8_t version) {
+    if (!buffer1 || !buffer2 || size1 < 3 || size2 < 3 || !buffer || !heist_format_supported(version)) return 0;
+    HeistBuffer inputs[2] = {{buffer1, size1}, {buffer2, size2}};
+    HeistHeader hdrs[2];
+    size_t offsets[2];
+    for (int k = 0; k < 2; k++) {
+        if ((offsets[k] = heist_read_header(inputs[k].data, inputs[k].size, &hdrs[k])) == 0) return 0;
+        if (hdrs[k].total_count && hdrs[k].bucket_count == 0) return heist_serialized_subtract_decoded(inputs, (uint8_t*)buffer, capacity, version);
+    }
+    if (hdrs[1].total_count > hdrs[0].total_count) return 0;
+
+    // The first pass checks every bucket and finds the range of the delta. hdrs[1] has a cursor
+    // only if hdrs[0] has one
+    HeistMergeCursor cursors[2];
+    int32_t lo = INT32_MAX, hi = INT32_MIN, top = -1, bottom = -1;
+    size_t active = 0;
+    for (int k = 0; k < 2; k++) {
+        if (hdrs[k].total_count == 0) continue;
+        if (!heist_merge_cursor_init(&cursors[active++], &inputs[k], &hdrs[k], offsets[k], 0)) return 0;
+        heist_window_union(&lo, &hi, hdrs[k].min_bucket_id, (int32_t)hdrs[k].min_bucket_id + hdrs[k].bucket_count - 1);
+    }
+    uint64_t held[HEIST_DECODE_CHUNK], taken[HEIST_DECODE_CHUNK];
+    for (int32_t i = hi; i >= lo; i -= HEIST_DECODE_CHUNK) {
+        int32_t chunk_lo = i - HEIST_DECODE_CHUNK + 1 > lo ? i - HEIST_DECODE_CHUNK + 1 : lo;
+        memset(held, 0, sizeof(held));
+        memset(taken, 0, sizeof(taken));
+        if (hdrs[0].total_count && cursors[0].next >= chunk_lo && !heist_merge_cursor_add(&cursors[0], i, chunk_lo, held)) return 0;
+        if (hdrs[1].total_count && cursors[1].next >= chunk_lo && !heist_merge_cursor_add(&cursors[1], i, chunk_lo, taken)) return 0;
+        for (int32_t k = 0; k <= i - chunk_lo; k++) {
+            if (taken[k] > held[k]) return 0;
+            if (taken[k] == held[k]) continue;
+            if (top < 0) top = i - k;
+            bottom = i - k;
+        }
+    }
+
+    // The bounds follow heistogram_subtract_inplace
+    HeistHeader delta;
+    memset(&delta, 0, sizeof(delta));
+    delta.total_count = hdrs[0].total_count - hdrs[1].total_count;
+    if ((top >= 0) != (delta.total_count > 0)) return 0;  // The counts don't add up to the totals
+    if (top >= 0) {
+        delta.min_bucket_id = (uint16_t)bottom;
+        delta.bucket_count = (uint16_t)(top - bottom + 1);
+        delta.min = get_bucket_id(hdrs[0].min) < bottom ? get_bucket_min(bottom) : hdrs[0].min;
+        delta.max = get_bucket_id(hdrs[0].max) > top ? get_bucket_max(top) : hdrs[0].max;
+    }
+
+    // The second pass encodes hdrs[0] minus hdrs[1] over [bottom, top]
+    active = 0;
+    for (int k = 0; k < 2 && delta.bucket_count; k++) {
+        if (hdrs[k].total_count == 0) continue;
+        HeistMergeCursor* c = &cursors[active++];
+        if (!heist_merge_cursor_init(c, &inputs[k], &hdrs[k], offsets[k], k == 1) || !heist_merge_cursor_skip(c, top)) return 0;
+    }
+    int trimmed = 0;
+    return heist_serialized_merge_stream(cursors, active, &delta, (uint8_t*)buffer, capacity, version, &trimmed);
+}
+
+// Serializes the delta of two serialized histograms into a caller provided buffer in the default
+// format, see heistogram_serialized_subtract_into_version
+static size_t heistogram_serialized_subtract_into(const void* buffer1, size_t size1, const void* buffer2, size_t size2, void* buffer, size_t capacity) {
+    return heistogram_serialized_subtract_into_version(buffer1, size1, buffer2, size2, buffer, capacity, HEIST_SERIALIZE_VERSION);
+}
+
+// Serializes the delta of two serialized histograms into a new buffer, NULL if the inputs are
+// invalid or buffer1 doesn't hold buffer2
+static void* heistogram_serialized_subtract(const void* buffer1, size_t size1, const void* buffer2, size_t size2, size_t* size) {
+    if (!size) return NULL;
+    HeistBuffer later = {buffer1, size1};
+    size_t bound = heistogram_serialized_merge_size_bound(&later, 1);
+    uint8_t* buffer = bound ? (uint8_t*)malloc(bound) : NULL;
+    if (!buffer) return NULL;
+    *size = heistogram_serialized_subtract_into(buffer1, size1, buffer2, size2, buffer, bound);
+    if (*size == 0) {
+        free(buffer);
+        return NULL;
+    }
+    return realloc(buffer, *size);
+}
+
+/*****************************/
+/* SERIALIZED HISTOGRAM VIEW */
+/*****************************/
+
+/*
+ * A HeistogramView answers repeated queries on a serialized buffer without copying or decoding
+ * it into a Heistogram. The header is decoded once. The first query that needs bucket positions
+ * builds a small index with the byte offset and the count above every HEIST_VIEW_BLOCK-th bucket,
+ * after which a query binary searches the blocks and decodes at most one block. Building the index
+ * writes to the view: call heistogram_view_build_index up front before sharing a view across threads.
+ */
+
+#define HEIST_VIEW_BLOCK 16  // A multiple of the format 2 group size
+
+typedef struct {
+    uint64_t above;          // Sum of the counts stored before the block, the higher bucket ids
+    uint32_t offset;         // Byte offset of the block's first count from the first count
+} HeistViewBlock;
+
+typedef struct {
+    HeistCountDecoder decoder;  // Positioned at the first count (the highest id), points into the buffer
+    uint16_t bucket_count;   // Number of encoded buckets
+    uint16_t min_bucket_id;  // Id of the last encoded bucket
+    uint64_t total_count;
+    uint64_t min;
+    uint64_t max;
+    HeistViewBlock* blocks;  // Built on demand, NULL until then
+    uint64_t stored_count;   // Sum of all encoded counts, valid once blocks are built
+} HeistogramView;
+
+// Decodes the block that starts at stored position first, returns the number of counts in it.
+// Blocks are a whole number of format 2 groups, so each one can be decoded on its own
+static inline size_t heist_view_decode_block(const HeistogramView* v, size_t first, uint64_t* counts) {
+    size_t n = v->bucket_count - first;
+    if (n > HEIST_VIEW_BLOCK) n = HEIST_VIEW_BLOCK;
+    HeistCountDecoder d = v->decoder;
+    heist_count_decoder_seek(&d, first, v->blocks[first / HEIST_VIEW_BLOCK].offset);
+    heist_decode_counts(&d, counts, n);  // Can't fail once the index is built
+    return n;
+}
+
+// Reads the header, no allocation happens until a query needs the index. Returns 1 on success
+static int heistogram_view_init(HeistogramView* v, const void* buffer, size_t size) {
+    if (!v || !buffer || size < 3) return 0;
+
+    HeistHeader hdr;
+    size_t offset = heist_read_header(buffer, size, &hdr);
+    if (offset == 0) return 0;
+    if (!heist_count_decoder_init(&v->decoder, &hdr, (const uint8_t*)buffer + offset, (const uint8_t*)buffer + size)) return 0;
+
+    v->bucket_count = hdr.bucket_count;
+    v->min_bucket_id = hdr.min_bucket_id;
+    v->total_count = hdr.total_count;
+    v->min = hdr.min;
+    v->max = hdr.max;
+    v->blocks = NULL;
+    v->stored_count = 0;
+    return 1;
+}
+
+// Frees the index, the buffer is not owned by the view
+static void heistogram_view_release(HeistogramView* v) {
+    if (!v) return;
+    free(v->blocks);
+    v->blocks = NULL;
+}
+
+// Builds the block index, returns 0 if the buffer is truncated or the index can't be allocated
+static int heistogram_view_build_index(HeistogramView* v) {
+    if (!v) return 0;
+    if (v->blocks || v->bucket_count == 0) return 1;
+
+    size_t num_blocks = (v->bucket_count + HEIST_VIEW_BLOCK - 1) / HEIST_VIEW_BLOCK;
+    HeistViewBlock* blocks = (HeistViewBlock*)malloc(num_blocks * sizeof(HeistViewBlock));
+    if (!blocks) return 0;
+
+    HeistCountDecoder d = v->decoder;
+    uint64_t sum = 0, counts[HEIST_VIEW_BLOCK];
+    for (size_t b = 0; b < num_blocks; b++) {
+        blocks[b].above = sum;
+        blocks[b].offset = d.ptr - d.data;
+        size_t n = v->bucket_count - b * HEIST_VIEW_BLOCK;
+        if (n > HEIST_VIEW_BLOCK) n = HEIST_VIEW_BLOCK;
+        if (!heist_decode_counts(&d, counts, n)) {
+            free(blocks);
+            return 0;
+        }
+        for (size_t k = 0; k < n; k++) sum += counts[k];
+    }
+
+    v->blocks = blocks;
+    v->stored_count = sum;
+    return 1;
+}
+
+static uint64_t heistogram_view_count(const HeistogramView* v) {
+    return v ? v->total_count : 0;
+}
+
+static uint64_t heistogram_view_min(const HeistogramView* v) {
+    return v ? v->min : 0;
+}
+
+static uint64_t heistogram_view_max(const HeistogramView* v) {
+    return v ? v->max : 0;
+}
+
+// Same result as heistogram_percentile on the deserialized histogram
+static double heistogram_view_percentile(HeistogramView* v, double p) {
+    if (!v || p < 0 || p > 100) return 0;
+    if (!heistogram_view_build_index(v)) return 0;
+
+    double target = ((100.0 - p) / 100.0) * v->total_count;
+
+    // Last block whose preceding buckets don't reach the target yet
+    size_t lo = 0;
+    if (v->blocks) {
+        size_t hi = (v->bucket_count + HEIST_VIEW_BLOCK - 1) / HEIST_VIEW_BLOCK;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            uint64_t above = v->blocks[mid].above;
+            if (above > 0 && above >= target) hi = mid;
+            else lo = mid;
+        }
+    }
+
+    if (!v->blocks) return v->min;
+    uint64_t cumsum = v->blocks[lo].above;
+    uint64_t counts[HEIST_VIEW_BLOCK];
+    size_t n = heist_view_decode_block(v, lo * HEIST_VIEW_BLOCK, counts);
+    int32_t i = (int32_t)v->min_bucket_id + v->bucket_count - 1 - (int32_t)(lo * HEIST_VIEW_BLOCK);
+    for (size_t k = 0; k < n; k++, i--) {
+        uint64_t count = counts[k];
+        if (count > 0 && cumsum + count >= target) {
+            double pos = ((double)(target - cumsum)) / (double)count;
+            return heist_bucket_interpolate(i, pos, v->min, v->max);
+        }
+        cumsum += count;
+    }
+
+    return v->min;
+}
+
+static void heistogram_view_percentiles(HeistogramView* v, const double* percentiles, size_t num_percentiles, double* results) {
+    if (!v || !percentiles || !results) return;
+    for (size_t k = 0; k < num_percentiles; k++) {
+        results[k] = heistogram_view_percentile(v, percentiles[k]);
+    }
+}
+
+// Finds the sum of the counts below bucket bid and the count of bid itself
+static void heist_view_bucket_rank(const HeistogramView* v, int16_t bid, uint64_t* below, uint64_t* count) {
+    int32_t max_bucket_id = v->min_bucket_id + v->bucket_count - 1;
+    *count = 0;
+    if (bid > max_bucket_id) {
+        *below = v->stored_count;
+        return;
+    }
+    if (bid < v->min_bucket_id) {
+        *below = 0;
+        return;
+    }
+
+    uint32_t stored = max_bucket_id - bid;
+    uint64_t counts[HEIST_VIEW_BLOCK];
+    heist_view_decode_block(v, stored - stored % HEIST_VIEW_BLOCK, counts);
+    uint64_t upto = v->blocks[stored / HEIST_VIEW_BLOCK].above;
+    for (uint32_t k = 0; k <= stored % HEIST_VIEW_BLOCK; k++) {
+        upto += counts[k];
+    }
+    *count = counts[stored % HEIST_VIEW_BLOCK];
+    *below = v->stored_count - upto;
+}
+
+// Same result as heistogram_prank on the deserialized histogram
+static double heistogram_view_prank(HeistogramView* v, double value) {
+    if (!v || v->total_count == 0) return 0;
+    if (value < v->min) return 0;
+    if (value >= v->max) return 100.0;
+    if (!heistogram_view_build_index(v)) return 0;
+
+    int16_t bid = get_bucket_id((uint64_t)value);
+    uint64_t cumsum, count;
+    heist_view_bucket_rank(v, bid, &cumsum, &count);
+
+    // Calculate position within the target bucket, clamped to the histogram bounds
+    uint64_t min_val = get_bucket_min(bid);
+    uint64_t max_val = get_bucket_max(bid);
+    if (max_val > v->max) max_val = v->max;
+    if (min_val < v->min) min_val = v->min;
+
+    double pos;
+    if (max_val == min_val) {
+        pos = 1.0;
+    } else {
+        pos = ((double)(value - min_val)) / ((double)(max_val - min_val));
+        if (pos > 1.0) pos = 1.0;
+    }
+    cumsum += (uint64_t)(pos * count);
+
+    return 100.0 * cumsum / v->total_count;
+}
+
+// Same result as heistogram_count_upto on the deserialized histogram
+static uint64_t heistogram_view_count_upto(HeistogramView* v, uint64_t value) {
+    if (!v || v->total_count == 0) return 0;
+    if (value < v->min) return 0;
+    if (value >= v->max) return v->total_count;
+    if (!heistogram_view_build_index(v)) return 0;
+
+    int16_t bid = get_bucket_id(value);
+    uint64_t cumsum, count;
+    heist_view_bucket_rank(v, bid, &cumsum, &count);
+
+    // Calculate position within the target bucket, clamped to the histogram bounds
+    uint64_t min_val = get_bucket_min(bid);
+    uint64_t max_val = get_bucket_max(bid);
+    if (max_val > v->max) max_val = v->max;
+    if (min_val < v->min) min_val = v->min;
+
+    double pos;
+    if (max_val == min_val) {
+        pos = 1.0;
+    } else {
+        pos = ((double)(value - min_val)) / ((double)(max_val - min_val));
+        if (pos > 1.0) pos = 1.0;
+    }
+    cumsum += (uint64_t)(pos * count);
+
+    return cumsum;
+}
+
+/*****************************/
+/* SHARDED CONCURRENT INSERTS */
+/*****************************/
+
+/*
+ * A sharded histogram gives every writer thread its own Heistogram, so concurrent inserts never
+ * touch the same cache lines. Threads are assigned to shards round robin on their first insert;
+ * with more threads than shards some threads share a shard and briefly wait on its lock. Readers
+ * take a snapshot, which locks the shards and merges them into a regular Heistogram.
+ */
+
+#define HEIST_CACHE_LINE 64
+#define HEIST_LINE_BUCKETS (HEIST_CACHE_LINE / sizeof(Bucket))
+
+#if defined(_MSC_VER)
+#define HEIST_THREAD_LOCAL __declspec(thread)
+#else
+#define HEIST_THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+    uint32_t lock;           // Taken by inserts into this shard and by snapshots
+    Heistogram hist;         // Kept inline so the shard's counters share its cache lines
+    char padding[HEIST_CACHE_LINE - (sizeof(uint64_t) + sizeof(Heistogram)) % HEIST_CACHE_LINE];
+} HeistShard;
+
+typedef struct {
+    uint32_t num_shards;
+    HeistShard* shards;      // Cache line aligned array of num_shards shards
+    void* allocation;        // Unaligned block the shards were carved from
+} HeistogramSharded;
+
+static uint32_t heist_thread_counter = 0;
+static HEIST_THREAD_LOCAL uint32_t heist_thread_slot = 0;  // 0 until the thread first inserts
+
+static inline uint32_t heist_current_thread_slot(void) {
+    if (heist_thread_slot == 0) {
+        heist_thread_slot = __atomic_add_fetch(&heist_thread_counter, 1, __ATOMIC_RELAXED);
+    }
+    return heist_thread_slot - 1;
+}
+
+static inline void heist_shard_lock(HeistShard* shard) {
+    while (__atomic_exchange_n(&shard->lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&shard->lock, __ATOMIC_RELAXED)) {
+#ifdef HEIST_X86_SIMD
+            _mm_pause();
+#endif
+        }
+    }
+}
+
+static inline void heist_shard_unlock(HeistShard* shard) {
+    __atomic_store_n(&shard->lock, 0, __ATOMIC_RELEASE);
+}
+
+// Keeps at least a cache line of never written buckets above bid, so the used part of a
+// shard's bucket array never shares a cache line with memory another thread writes. Shards stay
+// based at bucket 0, so only the top end needs the guard
+static inline int heist_shard_reserve(HeistShard* shard, uint16_t bid) {
+    if (shard->hist.base_bucket_id == 0 && bid + HEIST_LINE_BUCKETS < shard->hist.capacity) return 1;
+    size_t capacity = (bid + 16 + 2 * HEIST_LINE_BUCKETS) & ~(HEIST_LINE_BUCKETS - 1);
+    return heist_reserve(&shard->hist, 0, capacity - 1);
+}
+
+static HeistogramSharded* heistogram_sharded_create(uint32_t num_shards) {
+    if (num_shards == 0) return NULL;
+
+    HeistogramSharded* hs = (HeistogramSharded*)malloc(sizeof(HeistogramSharded));
+    if (!hs) return NULL;
+    hs->allocation = malloc(num_shards * sizeof(HeistShard) + HEIST_CACHE_LINE - 1);
+    if (!hs->allocation) {
+        free(hs);
+        return NULL;
+    }
+    hs->shards = (HeistShard*)(((uintptr_t)hs->allocation + HEIST_CACHE_LINE - 1) & ~(uintptr_t)(HEIST_CACHE_LINE - 1));
+    hs->num_shards = num_shards;
+
+    for (uint32_t i = 0; i < num_shards; i++) {
+        HeistShard* shard = &hs->shards[i];
+        shard->lock = 0;
+        if (!heist_init(&shard->hist, NULL) || !heist_shard_reserve(shard, 0)) {
+            for (uint32_t j = 0; j <= i; j++) heist_release(&hs->shards[j].hist);
+            free(hs->allocation);
+            free(hs);
+            return NULL;
+        }
+    }
+
+    return hs;
+}
+
+static void heistogram_sharded_free(HeistogramSharded* hs) {
+    if (!hs) return;
+    for (uint32_t i = 0; i < hs->num_shards; i++) {
+        heist_release(&hs->shards[i].hist);
+    }
+    free(hs->allocation);
+    free(hs);
+}
+
+// Safe to call from any number of threads at once
+static void heistogram_sharded_add(HeistogramSharded* hs, uint64_t value) {
+    if (!hs) return;
+    HeistShard* shard = &hs->shards[heist_current_thread_slot() % hs->num_shards];
+
+    heist_shard_lock(shard);
+    if (heist_shard_reserve(shard, get_bucket_id(value))) {
+        heistogram_add(&shard->hist, value);
+    }
+    heist_shard_unlock(shard);
+}
+
+// Safe to call from any number of threads at once, returns 0 if the shard can't grow
+static int heistogram_sharded_add_batch(HeistogramSharded* hs, const uint64_t* values, size_t n) {
+    if (!hs) return 0;
+    HeistShard* shard = &hs->shards[heist_current_thread_slot() % hs->num_shards];
+
+    heist_shard_lock(shard);
+    int ok = heistogram_add_batch(&shard->hist, values, n);
+    if (ok && shard->hist.total_count > 0) ok = heist_shard_reserve(shard, get_bucket_id(shard->hist.max));
+    heist_shard_unlock(shard);
+    return ok;
+}
+
+// Merges all shards into a new Heistogram. The shards are locked together, so the snapshot holds
+// exactly the inserts that completed before it was taken
+static Heistogram* heistogram_sharded_snapshot(HeistogramSharded* hs) {
+    if (!hs) return NULL;
+    Heistogram* h = heistogram_create();
+    if (!h) return NULL;
+
+    for (uint32_t i = 0; i < hs->num_shards; i++) {
+        heist_shard_lock(&hs->shards[i]);
+    }
+    int ok = 1;
+    for (uint32_t i = 0; i < hs->num_shards && ok; i++) {
+        ok = heistogram_merge_inplace(h, &hs->shards[i].hist);
+    }
+    for (uint32_t i = 0; i < hs->num_shards; i++) {
+        heist_shard_unlock(&hs->shards[i]);
+    }
+
+    if (!ok) {
+        heistogram_free(h);
+        return NULL;
+    }
+    return h;
+}
+
+/*****************************/
+/* HISTOGRAM POOLS           */
+/*****************************/
+
+/*
+ * A pool keeps emptied histograms for reuse, so code that drops and recreates histograms every
+ * reporting interval stops allocating once the pool has seen as many histograms in use at once
+ * as it will ever need. New histograms get a bucket array covering the pool's value range up
+ * front, returned ones are reset and keep whatever they grew to. A pool is not thread safe.
+ */
+
+typedef struct {
+    Heistogram** free_list;  // Reset histograms ready to hand out
+    size_t size;             // Histograms in free_list
+    size_t capacity;         // Slots in free_list
+    int32_t lo, hi;          // Bucket window new histograms are sized for
+} HeistogramPool;
+
+static Heistogram* heist_pool_new(const HeistogramPool* pool) {
+    Heistogram* h = heistogram_create();
+    if (h && !heist_reserve(h, pool->lo, pool->hi)) {
+        heistogram_free(h);
+        return NULL;
+    }
+    return h;
+}
+
+// Creates a pool holding count histograms sized for values in [min_value, max_value]
+static HeistogramPool* heistogram_pool_create(size_t count, uint64_t min_value, uint64_t max_value) {
+    if (min_value > max_value) return NULL;
+    heist_tables_init();
+    HeistogramPool* pool = (HeistogramPool*)malloc(sizeof(HeistogramPool));
+    if (!pool) return NULL;
+    pool->capacity = count ? count : 1;
+    pool->size = 0;
+    pool->lo = get_bucket_id(min_value);
+    pool->hi = get_bucket_id(max_value);
+    pool->free_list = (Heistogram**)malloc(pool->capacity * sizeof(Heistogram*));
+    if (!pool->free_list) {
+        free(pool);
+        return NULL;
+    }
+    for (; pool->size < count; pool->size++) {
+        Heistogram* h = heist_pool_new(pool);
+        if (!h) {
+            while (pool->size > 0) heistogram_free(pool->free_list[--pool->size]);
+            free(pool->free_list);
+            free(pool);
+            return NULL;
+        }
+        pool->free_list[pool->size] = h;
+    }
+    return pool;
+}
+
+// Hands out an empty histogram, a new one if the pool has none left. NULL if memory runs out
+static Heistogram* heistogram_pool_acquire(HeistogramPool* pool) {
+    if (!pool) return NULL;
+    if (pool->size > 0) return pool->free_list[--pool->size];
+    return heist_pool_new(pool);
+}
+
+// Resets h and keeps it for the next acquire. h may come from anywhere, it is freed if the pool
+// can't grow to hold it
+static void heistogram_pool_release(HeistogramPool* pool, Heistogram* h) {
+    if (!pool || !h) return;
+    if (pool->size == pool->capacity) {
+        Heistogram** free_list = (Heistogram**)realloc(pool->free_list, pool->capacity * 2 * sizeof(Heistogram*));
+        if (!free_list) {
+            heistogram_free(h);
+            return;
+        }
+        pool->free_list = free_list;
+        pool->capacity *= 2;
+    }
+    heistogram_reset(h);
+    pool->free_list[pool->size++] = h;
+}
+
+// Frees the pool and the histograms it holds, histograms handed out stay with their owners
+static void heistogram_pool_free(HeistogramPool* pool) {
+    if (!pool) return;
+    while (pool->size > 0) heistogram_free(pool->free_list[--pool->size]);
+    free(pool->free_list);
+    free(pool);
+}
+
+/*****************************/
+/* SLIDING WINDOWS           */
+/*****************************/
+
+/*
+ * A HeistogramWindow covers the last num_slots slots of slot_duration time units each, for
+ * queries like "p99 over the last 60 seconds" with a 1 second slot. Values go into the current
+ * slot and into a running aggregate of all slots, and queries read the aggregate, so they cost
+ * the same as on a plain histogram. Rotating to a new slot subtracts the expired slot from the
+ * aggregate in place and resets it, instead of merging every slot again. Time is whatever unit
+ * the caller passes in, slot i covering [i * slot_duration, (i + 1) * slot_duration). A window
+ * is not thread safe.
+ */
+
+typedef struct {
+    Heistogram** slots;      // Ring of per-slot histograms
+    Heistogram* aggregate;   // Sum of all slots
+    uint32_t num_slots;
+    uint32_t current;        // Slot taking new values
+    uint64_t slot_duration;
+    uint64_t slot_index;     // Time / slot_duration of the current slot
+} HeistogramWindow;
+
+// Creates a window of num_slots slots of slot_duration time units each
+static HeistogramWindow* heistogram_window_create(uint32_t num_slots, uint64_t slot_duration) {
+    if (num_slots == 0 || slot_duration == 0) return NULL;
+    HeistogramWindow* w = (HeistogramWindow*)calloc(1, sizeof(HeistogramWindow));
+    if (!w) return NULL;
+    w->num_slots = num_slots;
+    w->slot_duration = slot_duration;
+    w->slots = (Heistogram**)calloc(num_slots, sizeof(Heistogram*));
+    w->aggregate = heistogram_create();
+    int ok = w->slots && w->aggregate;
+    for (uint32_t i = 0; ok && i < num_slots; i++) {
+        ok = (w->slots[i] = heistogram_create()) != NULL;
+    }
+    if (!ok) {
+        for (uint32_t i = 0; w->slots && i < num_slots; i++) heistogram_free(w->slots[i]);
+        free(w->slots);
+        heistogram_free(w->aggregate);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static void heistogram_window_free(HeistogramWindow* w) {
+    if (!w) return;
+    for (uint32_t i = 0; i < w->num_slots; i++) heistogram_free(w->slots[i]);
+    free(w->slots);
+    heistogram_free(w->aggregate);
+    free(w);
+}
+
+// Moves to the next slot: the oldest slot leaves the aggregate and is reset to take new values.
+// The cost depends on the expired slot's buckets, not on the number of slots
+static void heistogram_window_rotate(HeistogramWindow* w) {
+    if (!w) return;
+    w->current = w->current + 1 == w->num_slots ? 0 : w->current + 1;
+    w->slot_index++;
+    Heistogram* expired = w->slots[w->current];
+    if (expired->total_count == 0) return;
+    heist_subtract_counts(w->aggregate, expired);
+    heistogram_reset(expired);
+
+    // The exact bounds are those of the slots still in the window
+    Heistogram* agg = w->aggregate;
+    if (agg->total_count == 0) return;
+    agg->min = UINT64_MAX;
+    agg->max = 0;
+    for (uint32_t i = 0; i < w->num_slots; i++) {
+        const Heistogram* slot = w->slots[i];
+        if (slot->total_count == 0) continue;
+        if (slot->min < agg->min) agg->min = slot->min;
+        if (slot->max > agg->max) agg->max = slot->max;
+    }
+}
+
+// Rotates as many slots as have started since the current one, up to clearing the whole window.
+// A time before the current slot's start changes nothing
+static void heistogram_window_advance(HeistogramWindow* w, uint64_t now) {
+    if (!w) return;
+    uint64_t index = now / w->slot_duration;
+    if (index <= w->slot_index) return;
+    if (index - w->slot_index >= w->num_slots) {
+        for (uint32_t i = 0; i < w->num_slots; i++) heistogram_reset(w->slots[i]);
+        heistogram_reset(w->aggregate);
+        w->slot_index = index;
+        return;
+    }
+    while (w->slot_index < index) heistogram_window_rotate(w);
+}
+
+// Adds a value observed at time now. Returns 0 if memory runs out, the value is then in neither
+// the slot nor the aggregate, so the aggregate always holds every slot that rotation subtracts
+static int heistogram_window_add(HeistogramWindow* w, uint64_t value, uint64_t now) {
+    if (!w) return 0;
+    heistogram_window_advance(w, now);
+
+    // Growing the slot first changes none of its counts, once the aggregate took the value the
+    // slot can't fail, its total is at most the aggregate's
+    Heistogram* slot = w->slots[w->current];
+    int32_t bid = get_bucket_id(value);
+    if (!heist_reserve(slot, bid, bid) || !heistogram_add_n(w->aggregate, value, 1)) return 0;
+    return heistogram_add_n(slot, value, 1);
+}
+
+// The aggregate of the window for any read only query. Call heistogram_window_advance first for
+// a window that ends now rather than at the last insert
+static const Heistogram* heistogram_window_histogram(const HeistogramWindow* w) {
+    return w ? w->aggregate : NULL;
+}
+
+static double heistogram_window_percentile(const HeistogramWindow* w, double p) {
+    return w ? heistogram_percentile(w->aggregate, p) : 0;
+}
+
+/*****************************/
+/* DECAYING HISTOGRAMS       */
+/*****************************/
+
+/*
+ * A HeistogramDecaying weighs every value by its age with forward decay: a value added at time t
+ * gets weight 2^((t - landmark) / half_life) in fixed point, HEIST_DECAY_ONE at the landmark.
+ * Relative to each other, the weights are what halving every count once per half life would
+ * give, but old buckets are never touched: newer values simply weigh more. The weights live in
+ * the buckets of a plain histogram, so percentiles and pranks on it are recency weighted.
+ *
+ * Weights grow with time. Once a new value would weigh 2^HEIST_DECAY_RENORMALIZE times more than
+ * at the landmark, or the total nears overflow, the landmark moves forward by whole half lives and
+ * every bucket is shifted right to match. Buckets that decay to zero leave the histogram. Values
+ * added at the same time as the previous one reuse its weight, so an insert is a compare and a
+ * bucket add.
+ */
+
+#define HEIST_DECAY_SHIFT 16                             // Fraction bits of a weight
+#define HEIST_DECAY_ONE (1ULL << HEIST_DECAY_SHIFT)      // Weight of a value added at the landmark
+#define HEIST_DECAY_RENORMALIZE 24                       // Half lives past the landmark before renormalizing
+#define HEIST_DECAY_MAX_TOTAL (1ULL << 62)               // Renormalize before the total can overflow
+
+typedef struct {
+    Heistogram* h;          // Buckets hold the sum of the weights of their values
+    uint64_t half_life;     // Time for a value's weight to halve relative to new ones
+    double rate;            // 1 / half_life
+    uint64_t landmark;      // Time at which a new value weighs HEIST_DECAY_ONE
+    uint64_t last_time;     // Time of the previous insert
+    uint64_t last_weight;   // Its weight, 0 if it has to be recomputed
+} HeistogramDecaying;
+
+// Adds weight to value's bucket of a dense histogram with 8-byte counters
+static inline void heist_add_weight(Heistogram* h, uint64_t value, uint64_t weight) {
+    int16_t bid = get_bucket_id(value);
+    if ((!heist_has_bucket(h, bid) || h->total_count == 0) && !heist_reserve_slack(h, bid, bid)) return;
+    if (HEIST_BUCKET(h, bid).count == 0) heist_mark_occupied(h, bid);
+    HEIST_BUCKET(h, bid).count += weight;
+    if (h->total_count == 0) {
+        h->min = h->max = value;
+        heist_set_window(h, bid, bid);
+    } else {
+        if (value < h->min) h->min = value;
+        if (value > h->max) h->max = value;
+        if (bid < h->min_bucket_id) h->min_bucket_id = bid;
+        if (bid > h->max_bucket_id) h->max_bucket_id = bid;
+    }
+    h->total_count += weight;
+    h->index_dirty = 1;
+}
+
+// Creates a decaying histogram whose weights halve every half_life time units
+static HeistogramDecaying* heistogram_decaying_create(uint64_t half_life) {
+    if (half_life == 0) return NULL;
+    HeistogramDecaying* d = (HeistogramDecaying*)calloc(1, sizeof(HeistogramDecaying));
+    if (!d) return NULL;
+    d->h = heistogram_create();
+    if (!d->h) {
+        free(d);
+        return NULL;
+    }
+    d->half_life = half_life;
+    d->rate = 1.0 / (double)half_life;
+    return d;
+}
+
+static void heistogram_decaying_free(HeistogramDecaying* d) {
+    if (!d) return;
+    heistogram_free(d->h);
+    free(d);
+}
+
+// Moves the landmark forward by shift half lives, dividing every weight by 2^shift
+static void heist_decay_renormalize(HeistogramDecaying* d, uint32_t shift) {
+    Heistogram* h = d->h;
+    d->last_weight = 0;
+    if (shift >= 64 || h->total_count == 0) {
+        heistogram_reset(h);  // The next insert sets a new landmark
+        return;
+    }
+    d->landmark += shift * d->half_life;
+    int32_t lo = h->min_bucket_id, hi = h->max_bucket_id;
+    uint64_t total = 0;
+    for (int32_t i = lo; i <= hi; i++) {
+        uint64_t count = HEIST_BUCKET(h, i).count >> shift;
+        HEIST_BUCKET(h, i).count = count;
+        total += count;
+    }
+    h->total_count = total;
+    h->index_dirty = 1;
+    heist_trim_window(h, lo, hi);
+    if (total == 0) {
+        h->min = h->max = 0;
+        return;
+    }
+    // Values of the buckets that decayed away no longer bound the histogram
+    if (h->min_bucket_id != lo) h->min = get_bucket_min(h->min_bucket_id);
+    if (h->max_bucket_id != hi) h->max = get_bucket_max(h->max_bucket_id);
+}
+
+// 2^x within 1e-8 relative for x in [-1000, 1000], without calling exp2: libm's transcendental
+// functions can be many times slower when called from code built with AVX
+static inline double heist_exp2(double x) {
+    if (x < -1000) x = -1000;
+    int64_t whole = (int64_t)x;
+    if ((double)whole > x) whole--;
+    // 2^f = (e^(f ln2 / 8))^8, the series converges quickly for f ln2 / 8 < 0.087
+    double y = (x - (double)whole) * 0.69314718055994530942 / 8;
+    double r = 1 + y * (1 + y / 2 * (1 + y / 3 * (1 + y / 4 * (1 + y / 5))));
+    r *= r;
+    r *= r;
+    r *= r;
+    union { uint64_t bits; double value; } scale = { (uint64_t)(whole + 1023) << 52 };
+    return r * scale.value;
+}
+
+// Half lives from the landmark to now, negative before it
+static inline double heist_decay_age(const HeistogramDecaying* d, uint64_t now) {
+    return (double)(int64_t)(now - d->landmark) * d->rate;
+}
+
+// Weight of a value added at now, renormalizing first if it would be too large
+static uint64_t heist_decay_weight(HeistogramDecaying* d, uint64_t now) {
+    if (d->h->total_count == 0) {
+        d->landmark = now;  // Nothing left to stay consistent with
+        d->last_weight = 0;
+    }
+    double age = heist_decay_age(d, now);
+    if (age >= HEIST_DECAY_RENORMALIZE) {
+        heist_decay_renormalize(d, age >= 64 ? 64 : (uint32_t)age);
+        if (d->h->total_count == 0) d->landmark = now;
+        age = heist_decay_age(d, now);
+    }
+    uint64_t weight = (uint64_t)(heist_exp2(age + HEIST_DECAY_SHIFT) + 0.5);
+    return weight ? weight : 1;  // Values from before the landmark still count
+}
+
+// Adds a value observed at time now
+static void heistogram_decaying_add(HeistogramDecaying* d, uint64_t value, uint64_t now) {
+    if (!d) return;
+    if (now != d->last_time || d->last_weight == 0) {
+        d->last_weight = heist_decay_weight(d, now);
+        d->last_time = now;
+    }
+    if (d->h->total_count >= HEIST_DECAY_MAX_TOTAL - d->last_weight) {
+        heist_decay_renormalize(d, 8);
+        d->last_weight = heist_decay_weight(d, now);
+    }
+    heist_add_weight(d->h, value, d->last_weight);
+}
+
+// Recency weighted percentile, the weights' common scale doesn't matter so no time is needed
+static double heistogram_decaying_percentile(const HeistogramDecaying* d, double p) {
+    return d ? heistogram_percentile(d->h, p) : 0;
+}
+
+static void heistogram_decaying_percentiles(const HeistogramDecaying* d, const double* percentiles, size_t num_percentiles, double* results) {
+    if (d) heistogram_percentiles(d->h, percentiles, num_percentiles, results);
+}
+
+// Recency weighted share of values at or below value, as a percentage
+static double heistogram_decaying_prank(const HeistogramDecaying* d, double value) {
+    return d ? heistogram_prank(d->h, value) : 0;
+}
+
+// Decayed number of values at time now: each value counts 2^-(age / half_life)
+static double heistogram_decaying_count(const HeistogramDecaying* d, uint64_t now) {
+    if (!d || d->h->total_count == 0) return 0;
+    double age = heist_decay_age(d, now);
+    return (double)d->h->total_count / heist_exp2(age + HEIST_DECAY_SHIFT);
+}
+
+// The weighted histogram, for other read only queries. Its counts are weights in fixed point
+static const Heistogram* heistogram_decaying_histogram(const HeistogramDecaying* d) {
+    return d ? d->h : NULL;
+}
+
 #endif /* HEISTOGRAM_H */
\ No newline at end of file
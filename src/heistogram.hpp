@@ -0,0 +1,409 @@
+#ifndef HEISTOGRAM_HPP
+#define HEISTOGRAM_HPP
+
+/*
+ * C++20 wrapper of heistogram.h. heist::histogram owns its Heistogram and frees it, is move-only,
+ * and is a plain pointer plus the allocator hooks, no virtual calls and no extra allocation. The
+ * precision tier is a template parameter: the C header is compiled once per tier, each copy in its
+ * own namespace with its own mapping code and tables, and the wrapper binds to the copy of its
+ * tier at compile time. Include this header instead of heistogram.h, it also leaves the C API of
+ * the default tier in namespace heist::c.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// The headers heistogram.h includes come first, so its copies below don't pull them into the
+// tier namespaces
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#if !defined(HEIST_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
+#if defined(HEIST_SERIALIZE_VERSION) && HEIST_SERIALIZE_VERSION == 1
+#error "heistogram.hpp compiles every precision tier and only the 2% tier can write format 1, pass the format to serialize() instead"
+#endif
+
+// Each tier's copy of the C API is static and most of it goes unused in a given file
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+
+#undef HEISTOGRAM_H
+#undef HEIST_PRECISION
+#undef HEIST_MANTISSA_BITS
+#undef HEIST_MAX_BUCKET_ID
+#define HEIST_PRECISION HEIST_PRECISION_0_5
+namespace heist::detail::p0_5 {
+#include "heistogram.h"
+inline constexpr int max_bucket_id = HEIST_MAX_BUCKET_ID;
+}
+
+#undef HEISTOGRAM_H
+#undef HEIST_PRECISION
+#undef HEIST_MANTISSA_BITS
+#undef HEIST_MAX_BUCKET_ID
+#define HEIST_PRECISION HEIST_PRECISION_1
+namespace heist::detail::p1 {
+#include "heistogram.h"
+inline constexpr int max_bucket_id = HEIST_MAX_BUCKET_ID;
+}
+
+#undef HEISTOGRAM_H
+#undef HEIST_PRECISION
+#undef HEIST_MANTISSA_BITS
+#undef HEIST_MAX_BUCKET_ID
+#define HEIST_PRECISION HEIST_PRECISION_5
+namespace heist::detail::p5 {
+#include "heistogram.h"
+inline constexpr int max_bucket_id = HEIST_MAX_BUCKET_ID;
+}
+
+// The default tier goes last, so the macros left behind describe it
+#undef HEISTOGRAM_H
+#undef HEIST_PRECISION
+#undef HEIST_MANTISSA_BITS
+#undef HEIST_MAX_BUCKET_ID
+#define HEIST_PRECISION HEIST_PRECISION_2
+namespace heist::detail::p2 {
+#include "heistogram.h"
+inline constexpr int max_bucket_id = HEIST_MAX_BUCKET_ID;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace heist {
+
+namespace c = detail::p2;
+
+// Precision tiers, the values are the HEIST_PRECISION_* ids recorded in serialized histograms
+enum class precision : uint8_t {
+    p2 = HEIST_PRECISION_2,
+    p0_5 = HEIST_PRECISION_0_5,
+    p1 = HEIST_PRECISION_1,
+    p5 = HEIST_PRECISION_5,
+};
+
+/*
+ * Compile-time description of a tier and the C API copy that implements it. Members of the
+ * wrapper call the C functions unqualified, argument dependent lookup finds them in the namespace
+ * of the tier's Heistogram type. Functions that only take a buffer are bound here.
+ */
+template <precision P>
+struct tier;
+
+#define HEIST_HPP_TIER(P, NS)                                                                     \
+    template <>                                                                                   \
+    struct tier<P> {                                                                              \
+        using histogram_type = NS::Heistogram;                                                    \
+        using view_type = NS::HeistogramView;                                                     \
+        using allocator_type = NS::HeistAllocator;                                                \
+        static constexpr double growth_factor = NS::HEIST_GROWTH_FACTOR;                          \
+        static constexpr int max_unmapped_bucket = NS::HEIST_MAX_UNMAPPED_BUCKET;                 \
+        static constexpr int max_bucket_id = NS::max_bucket_id;                                   \
+        static constexpr auto percentile_serialized = &NS::heistogram_percentile_serialized;      \
+        static constexpr auto percentiles_serialized = &NS::heistogram_percentiles_serialized;    \
+    }
+
+HEIST_HPP_TIER(precision::p0_5, detail::p0_5);
+HEIST_HPP_TIER(precision::p1, detail::p1);
+HEIST_HPP_TIER(precision::p2, detail::p2);
+HEIST_HPP_TIER(precision::p5, detail::p5);
+
+#undef HEIST_HPP_TIER
+
+// Tier a serialized histogram was written with, empty if the buffer isn't a histogram
+inline std::optional<precision> serialized_precision(std::span<const std::byte> buffer) noexcept {
+    int id = c::heistogram_serialized_precision(buffer.data(), buffer.size());
+    if (id < 0) return std::nullopt;
+    return static_cast<precision>(id);
+}
+
+namespace detail {
+
+// memory_resource wants the size back on deallocate and the C hooks don't pass it, so every
+// block carries its size in front of it
+inline constexpr size_t resource_header = alignof(std::max_align_t);
+
+inline void* resource_alloc(void* ctx, size_t size) {
+    try {
+        auto* block = static_cast<std::byte*>(static_cast<std::pmr::memory_resource*>(ctx)->allocate(size + resource_header, alignof(std::max_align_t)));
+        std::memcpy(block, &size, sizeof(size));
+        return block + resource_header;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+inline void resource_free(void* ctx, void* ptr) {
+    std::byte* block = static_cast<std::byte*>(ptr) - resource_header;
+    size_t size;
+    std::memcpy(&size, block, sizeof(size));
+    static_cast<std::pmr::memory_resource*>(ctx)->deallocate(block, size + resource_header, alignof(std::max_align_t));
+}
+
+inline void check_spans(std::span<const double> percentiles, std::span<double> results) {
+    if (results.size() < percentiles.size()) throw std::length_error("heist: results shorter than percentiles");
+}
+
+}  // namespace detail
+
+/*
+ * A histogram that owns its memory. It comes from malloc, or from a std::pmr::memory_resource that
+ * must outlive the histogram. Queries and inserts are the C functions of the tier, inlined.
+ * Allocation failures throw std::bad_alloc, except in add and remove which, like the C API,
+ * leave the histogram unchanged.
+ */
+template <precision P = precision::p2>
+class basic_histogram {
+public:
+    using tier_type = tier<P>;
+    using native_type = typename tier_type::histogram_type;
+
+    // The C default: format 1 at 2%, format 2 for the tiers format 1 can't record
+    static constexpr uint8_t default_format = P == precision::p2 ? HEIST_FORMAT_V1 : HEIST_FORMAT_V2;
+
+    basic_histogram() : basic_histogram(nullptr, 0) {}
+
+    // With inline_buckets > 0 the histogram and a bucket array for that many buckets are one block
+    explicit basic_histogram(std::pmr::memory_resource* resource, uint16_t inline_buckets = 0) {
+        allocator_ = {detail::resource_alloc, nullptr, detail::resource_free, resource};
+        h_ = heistogram_create_with_allocator(resource ? &allocator_ : static_cast<const typename tier_type::allocator_type*>(nullptr), inline_buckets);
+        if (!h_) throw std::bad_alloc();
+    }
+
+    basic_histogram(const basic_histogram&) = delete;
+    basic_histogram& operator=(const basic_histogram&) = delete;
+
+    basic_histogram(basic_histogram&& other) noexcept : h_(std::exchange(other.h_, nullptr)), allocator_(other.allocator_) {
+        adopt(other);
+    }
+
+    basic_histogram& operator=(basic_histogram&& other) noexcept {
+        if (this != &other) {
+            heistogram_free(h_);
+            h_ = std::exchange(other.h_, nullptr);
+            allocator_ = other.allocator_;
+            adopt(other);
+        }
+        return *this;
+    }
+
+    ~basic_histogram() { heistogram_free(h_); }
+
+    void swap(basic_histogram& other) noexcept {
+        basic_histogram tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    void add(uint64_t value) noexcept { heistogram_add(h_, value); }
+
+    void add(std::span<const uint64_t> values) {
+        if (!heistogram_add_batch(h_, values.data(), values.size())) throw std::bad_alloc();
+    }
+
+    // Adds count copies of value, false if memory runs out or the count would overflow
+    [[nodiscard]] bool add(uint64_t value, uint64_t count) noexcept { return heistogram_add_n(h_, value, count) == 1; }
+
+    // Adds counts[i] copies of values[i], std::overflow_error if the count would overflow
+    void add(std::span<const uint64_t> values, std::span<const uint64_t> counts) {
+        if (values.size() != counts.size()) throw std::length_error("heist: values and counts differ in size");
+        if (!heistogram_add_n_batch(h_, values.data(), counts.data(), values.size())) throw_add_failure(counts);
+    }
+
+    void remove(uint64_t value) noexcept { heistogram_remove(h_, value); }
+
+    // Adds other's counts multiplied by scale, std::overflow_error if the count would overflow
+    void merge(const basic_histogram& other, uint64_t scale = 1) {
+        if (!heistogram_merge_inplace_scaled(h_, other.h_, scale)) {
+            if (scale && other.count() > (UINT64_MAX - count()) / scale) throw std::overflow_error("heist: count overflows");
+            throw std::bad_alloc();
+        }
+    }
+
+    // Adds the counts of a serialized histogram of this tier multiplied by scale, false if the
+    // buffer is invalid, memory runs out or the count would overflow
+    [[nodiscard]] bool merge(std::span<const std::byte> serialized, uint64_t scale = 1) {
+        return heistogram_merge_inplace_serialized_scaled(h_, serialized.data(), serialized.size(), scale) == 1;
+    }
+
+    // Subtracts other's counts bucket by bucket, false and unchanged unless this histogram holds them
+    [[nodiscard]] bool subtract(const basic_histogram& other) noexcept { return heistogram_subtract_inplace(h_, other.h_) == 1; }
+
+    // Subtracts the counts of a serialized histogram of this tier, false and unchanged if the buffer
+    // is invalid or this histogram doesn't hold its counts
+    [[nodiscard]] bool subtract(std::span<const std::byte> serialized) noexcept {
+        return heistogram_subtract_inplace_serialized(h_, serialized.data(), serialized.size()) == 1;
+    }
+
+    // Empties the histogram and keeps its bucket array
+    void reset() noexcept { heistogram_reset(h_); }
+
+    uint64_t count() const noexcept { return heistogram_count(h_); }
+    uint64_t min() const noexcept { return heistogram_min(h_); }
+    uint64_t max() const noexcept { return heistogram_max(h_); }
+    uint32_t memory_size() const noexcept { return heistogram_memory_size(h_); }
+
+    double percentile(double p) const noexcept { return heistogram_percentile(h_, p); }
+
+    // results[i] gets percentiles[i], results must be at least as long
+    void percentiles(std::span<const double> percentiles, std::span<double> results) const {
+        detail::check_spans(percentiles, results);
+        heistogram_percentiles(h_, percentiles.data(), percentiles.size(), results.data());
+    }
+
+    double prank(double value) const noexcept { return heistogram_prank(h_, value); }
+    uint64_t count_upto(uint64_t value) const noexcept { return heistogram_count_upto(h_, value); }
+
+    size_t serialized_size_bound() const noexcept { return heistogram_serialized_size_bound(h_); }
+
+    // Writes into out, returns the bytes written or 0 if it doesn't fit
+    size_t serialize_into(std::span<std::byte> out, uint8_t format = default_format) const noexcept {
+        return heistogram_serialize_into_version(h_, out.data(), out.size(), format);
+    }
+
+    // Serializes into a vector from alloc, std::pmr::polymorphic_allocator<std::byte> included
+    template <class Allocator = std::allocator<std::byte>>
+    std::vector<std::byte, Allocator> serialize(uint8_t format = default_format, const Allocator& alloc = Allocator()) const {
+        std::vector<std::byte, Allocator> out(serialized_size_bound(), alloc);
+        size_t size = serialize_into(out, format);
+        if (size == 0) throw std::invalid_argument("heist: unsupported format");
+        out.resize(size);
+        return out;
+    }
+
+    // Replaces the contents with a serialized histogram of this tier, keeping the memory source.
+    // False, and the histogram left empty, if the buffer is invalid
+    [[nodiscard]] bool deserialize(std::span<const std::byte> serialized) {
+        return heistogram_deserialize_into(h_, serialized.data(), serialized.size()) == 1;
+    }
+
+    // Replaces the contents with a copy of src's counts
+    void assign(const basic_histogram& src) {
+        if (!heistogram_clone_into(h_, src.h_)) throw std::bad_alloc();
+    }
+
+    // The C histogram, for functions the wrapper doesn't cover. Still owned by the wrapper
+    native_type* native_handle() noexcept { return h_; }
+    const native_type* native_handle() const noexcept { return h_; }
+
+private:
+    // A histogram from a memory resource points at the hooks of its wrapper, which moved
+    void adopt(basic_histogram& from) noexcept {
+        if (h_ && h_->allocator == &from.allocator_) h_->allocator = &allocator_;
+    }
+
+    // heistogram_add_n_batch fails on overflow or out of memory, the counts tell which
+    [[noreturn]] void throw_add_failure(std::span<const uint64_t> counts) const {
+        uint64_t total = count();
+        for (uint64_t c : counts) {
+            if (total > UINT64_MAX - c) throw std::overflow_error("heist: count overflows");
+            total += c;
+        }
+        throw std::bad_alloc();
+    }
+
+    native_type* h_;
+    typename tier_type::allocator_type allocator_;
+};
+
+template <precision P>
+void swap(basic_histogram<P>& a, basic_histogram<P>& b) noexcept {
+    a.swap(b);
+}
+
+using histogram = basic_histogram<>;
+
+/*
+ * Non-owning queries on a serialized histogram of the tier, see HeistogramView. The buffer must
+ * outlive the view. The first query that needs bucket positions builds a small index, which
+ * writes to the view: call build_index before sharing a view across threads.
+ */
+template <precision P = precision::p2>
+class basic_serialized_view {
+public:
+    // Throws std::invalid_argument if the buffer isn't a serialized histogram of this tier
+    explicit basic_serialized_view(std::span<const std::byte> buffer) : buffer_(buffer) {
+        if (!heistogram_view_init(&view_, buffer.data(), buffer.size())) throw std::invalid_argument("heist: invalid serialized histogram");
+    }
+
+    basic_serialized_view(const basic_serialized_view&) = delete;
+    basic_serialized_view& operator=(const basic_serialized_view&) = delete;
+
+    basic_serialized_view(basic_serialized_view&& other) noexcept : buffer_(other.buffer_), view_(other.view_) {
+        other.view_.blocks = nullptr;
+    }
+
+    basic_serialized_view& operator=(basic_serialized_view&& other) noexcept {
+        if (this != &other) {
+            heistogram_view_release(&view_);
+            buffer_ = other.buffer_;
+            view_ = other.view_;
+            other.view_.blocks = nullptr;
+        }
+        return *this;
+    }
+
+    ~basic_serialized_view() { heistogram_view_release(&view_); }
+
+    // Builds the index up front, throws std::bad_alloc if it can't be allocated
+    void build_index() {
+        if (!heistogram_view_build_index(&view_)) throw std::bad_alloc();
+    }
+
+    uint64_t count() const noexcept { return heistogram_view_count(&view_); }
+    uint64_t min() const noexcept { return heistogram_view_min(&view_); }
+    uint64_t max() const noexcept { return heistogram_view_max(&view_); }
+
+    double percentile(double p) noexcept { return heistogram_view_percentile(&view_, p); }
+
+    // results[i] gets percentiles[i], results must be at least as long
+    void percentiles(std::span<const double> percentiles, std::span<double> results) {
+        detail::check_spans(percentiles, results);
+        heistogram_view_percentiles(&view_, percentiles.data(), percentiles.size(), results.data());
+    }
+
+    double prank(double value) noexcept { return heistogram_view_prank(&view_, value); }
+    uint64_t count_upto(uint64_t value) noexcept { return heistogram_view_count_upto(&view_, value); }
+
+    std::span<const std::byte> data() const noexcept { return buffer_; }
+
+private:
+    std::span<const std::byte> buffer_;
+    typename tier<P>::view_type view_;
+};
+
+using serialized_view = basic_serialized_view<>;
+
+// One-off queries on a serialized histogram that decode once and keep no state, 0 if the buffer
+// is invalid or of another tier
+template <precision P = precision::p2>
+double percentile_serialized(std::span<const std::byte> buffer, double p) noexcept {
+    return tier<P>::percentile_serialized(buffer.data(), buffer.size(), p);
+}
+
+template <precision P = precision::p2>
+void percentiles_serialized(std::span<const std::byte> buffer, std::span<const double> percentiles, std::span<double> results) {
+    detail::check_spans(percentiles, results);
+    tier<P>::percentiles_serialized(buffer.data(), buffer.size(), percentiles.data(), percentiles.size(), results.data());
+}
+
+}  // namespace heist
+
+#endif /* HEISTOGRAM_HPP */
@@ -3,10 +3,18 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
 
 // Include the Heistogram library
 #include "../src/heistogram.h"
 
+// Format 1 only exists at 2%, the other precision tiers run the same tests in format 2
+#if HEIST_PRECISION == HEIST_PRECISION_2
+#define TEST_FORMAT_V1 HEIST_FORMAT_V1
+#else
+#define TEST_FORMAT_V1 HEIST_FORMAT_V2
+#endif
+
 // Test helper function to verify that two double values are approximately equal
 static int double_equals(double a, double b, double epsilon) {
     return fabs(a - b) < epsilon;
@@ -160,6 +168,46 @@ static void test_serialization() {
     printf("Serialization test passed!\n");
 }
 
+// Varints of every width and counts above 32 bits survive encoding, values from 2^48 up take
+// the 7 and 8 byte codes
+static void test_large_value_encoding() {
+    printf("\n=== Testing Large Value Encoding ===\n");
+
+    uint8_t buf[16];
+    for (int shift = 0; shift < 64; shift++) {
+        uint64_t values[] = {1ULL << shift, (1ULL << shift) - 1, (1ULL << shift) | 1};
+        for (int i = 0; i < 3; i++) {
+            uint64_t decoded;
+            size_t len = encode_varint(values[i], buf);
+            assert(decode_varint(buf, &decoded) == len && decoded == values[i]);
+        }
+    }
+    assert(encode_varint(1ULL << 48, buf) == 8 && buf[0] == 250);
+    assert(encode_varint(UINT64_MAX, buf) == 9 && buf[0] == 251);
+    uint64_t count;
+    size_t len = encode_bucket(1ULL << 40, buf);
+    assert(decode_varint(buf, &count) == len && count == 1ULL << 40);
+
+    // Histograms with values from 2^48 up round trip
+    Heistogram* h = heistogram_create();
+    uint64_t large[] = {1000, 1ULL << 48, (1ULL << 56) + 12345, 1ULL << 62};
+    for (int i = 0; i < 4; i++) heistogram_add(h, large[i]);
+    size_t size;
+    void* serialized = heistogram_serialize(h, &size);
+    Heistogram* copy = heistogram_deserialize(serialized, size);
+    assert(copy && heistogram_count(copy) == 4);
+    assert(heistogram_min(copy) == 1000 && heistogram_max(copy) == 1ULL << 62);
+    for (double p = 0; p <= 100; p += 12.5) {
+        assert(heistogram_percentile(copy, p) == heistogram_percentile(h, p));
+        assert(heistogram_percentile_serialized(serialized, size, p) == heistogram_percentile(h, p));
+    }
+
+    free(serialized);
+    heistogram_free(h);
+    heistogram_free(copy);
+    printf("Large value encoding test passed!\n");
+}
+
 // Test merging two histograms
 static void test_merge() {
     printf("\n=== Testing Heistogram Merging ===\n");
@@ -621,12 +669,1975 @@ static void test_skewed_distributions() {
     printf("Skewed distribution test passed!\n");
 }
 
+// Test batch insertion against one-at-a-time insertion
+static void test_batch_insert() {
+    printf("\n=== Testing Batch Insert ===\n");
+
+    Heistogram* h1 = heistogram_create();
+    Heistogram* h2 = heistogram_create();
+    assert(h1 != NULL && h2 != NULL);
+
+    // Mix small values (linear buckets) with values spread over the whole range
+    const size_t count = 10007;
+    uint64_t* values = malloc(count * sizeof(uint64_t));
+    assert(values != NULL);
+    for (size_t i = 0; i < count; i++) {
+        switch (i % 3) {
+            case 0: values[i] = rand() % 64; break;
+            case 1: values[i] = rand() % 1000000; break;
+            default: values[i] = ((uint64_t)rand() << 31 | rand()) >> (rand() % 40); break;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        heistogram_add(h1, values[i]);
+    }
+
+    // Feed the batch API uneven slices to exercise the vector tails
+    size_t offset = 0, slice = 1;
+    while (offset < count) {
+        size_t len = count - offset < slice ? count - offset : slice;
+        assert(heistogram_add_batch(h2, values + offset, len) == 1);
+        offset += len;
+        slice = slice * 3 + 1;
+    }
+    assert(heistogram_add_batch(h2, values, 0) == 1);
+
+    print_heistogram_stats(h2, "Batch Inserted Heistogram");
+
+    assert(heistogram_count(h1) == heistogram_count(h2));
+    assert(heistogram_min(h1) == heistogram_min(h2));
+    assert(heistogram_max(h1) == heistogram_max(h2));
+    for (double p = 0; p <= 100.0; p += 0.5) {
+        assert(heistogram_percentile(h1, p) == heistogram_percentile(h2, p));
+    }
+
+    free(values);
+    heistogram_free(h1);
+    heistogram_free(h2);
+
+    printf("Batch insert test passed!\n");
+}
+
+// Test the integer bucket mapping against the log2 formula it replaces
+static void test_bucket_mapping() {
+    printf("\n=== Testing Integer Bucket Mapping ===\n");
+
+    heist_tables_init();
+
+    // Every value in the dense low range
+    for (uint64_t v = 0; v < 1000000; v++) {
+        assert(get_bucket_id(v) == get_bucket_id_log2(v));
+    }
+
+    // Both sides of every bucket boundary
+    for (uint16_t b = 0; b < HEIST_MAX_BUCKET_ID; b++) {
+        uint64_t last = heist_bucket_last[b];
+        for (uint64_t v = last > 2 ? last - 2 : 0; v <= last + 2; v++) {
+            assert(get_bucket_id(v) == get_bucket_id_log2(v));
+        }
+    }
+    assert(get_bucket_id(UINT64_MAX) == HEIST_MAX_BUCKET_ID);
+    assert(get_bucket_id_log2(UINT64_MAX) == HEIST_MAX_BUCKET_ID);
+
+    // Random values spread over all magnitudes
+    for (int i = 0; i < 1000000; i++) {
+        uint64_t v = ((uint64_t)rand() << 33 ^ (uint64_t)rand() << 11 ^ rand()) >> (rand() % 64);
+        assert(get_bucket_id(v) == get_bucket_id_log2(v));
+    }
+
+    printf("Integer bucket mapping test passed!\n");
+}
+
+// Test the precomputed bucket bound tables
+static void test_bucket_bounds() {
+    printf("\n=== Testing Bucket Bound Tables ===\n");
+
+    heist_tables_init();
+
+    for (uint16_t b = 0; b <= HEIST_MAX_BUCKET_ID; b++) {
+#if HEIST_PRECISION == HEIST_PRECISION_2
+        assert(get_bucket_min(b) == get_bucket_min_pow(b));
+        assert(get_bucket_max(b) == get_bucket_max_of(get_bucket_min(b)));
+#else
+        assert(get_bucket_id(get_bucket_min(b)) == b && get_bucket_id(get_bucket_max(b)) == b);
+#endif
+        assert(get_bucket_max(b) >= get_bucket_min(b));
+        if (b > 0) {
+            assert(get_bucket_min(b) >= get_bucket_min(b - 1));
+            assert(get_bucket_max(b) >= get_bucket_max(b - 1));
+        }
+    }
+
+    // Bounds above 2^32 must not wrap around
+    uint16_t high = get_bucket_id(1ULL << 40);
+    assert(get_bucket_max(high) > (1ULL << 39));
+    assert(get_bucket_max(HEIST_MAX_BUCKET_ID) == UINT64_MAX);
+
+    printf("Bucket bound tables test passed!\n");
+}
+
+// Test single-pass multi-percentile queries against individual queries
+static void test_multi_percentiles() {
+    printf("\n=== Testing Multi-Percentile Queries ===\n");
+
+    Heistogram* h = heistogram_create();
+    assert(h != NULL);
+    for (int i = 0; i < 20000; i++) {
+        heistogram_add(h, rand() % 10 == 0 ? rand() % 1000000 : 100 + rand() % 900);
+    }
+
+    size_t size;
+    void* serialized = heistogram_serialize(h, &size);
+    assert(serialized != NULL);
+
+    // Unsorted, duplicated and extreme percentiles
+    double percentiles[] = {99.99, 50, 0, 75, 99.9, 100, 90, 50, 95, 99, 0.1, 25};
+    size_t n = sizeof(percentiles) / sizeof(percentiles[0]);
+    double results[12], results_serialized[12];
+
+    heistogram_percentiles(h, percentiles, n, results);
+    heistogram_percentiles_serialized(serialized, size, percentiles, n, results_serialized);
+    for (size_t i = 0; i < n; i++) {
+        printf("  P%.2f: %.2f (serialized %.2f)\n", percentiles[i], results[i], results_serialized[i]);
+        assert(results[i] == heistogram_percentile(h, percentiles[i]));
+        assert(results_serialized[i] == heistogram_percentile_serialized(serialized, size, percentiles[i]));
+    }
+
+    // Out of range percentiles give 0, like heistogram_percentile
+    double invalid[] = {-1, 50, 101};
+    heistogram_percentiles(h, invalid, 3, results);
+    assert(results[0] == 0 && results[2] == 0);
+    assert(results[1] == heistogram_percentile(h, 50));
+
+    // More percentiles than fit on the stack
+    double many[500], many_results[500], many_serialized[500];
+    for (int i = 0; i < 500; i++) {
+        many[i] = (rand() % 100001) / 1000.0;
+    }
+    heistogram_percentiles(h, many, 500, many_results);
+    heistogram_percentiles_serialized(serialized, size, many, 500, many_serialized);
+    for (int i = 0; i < 500; i++) {
+        assert(many_results[i] == heistogram_percentile(h, many[i]));
+        assert(many_serialized[i] == heistogram_percentile_serialized(serialized, size, many[i]));
+    }
+
+    free(serialized);
+    heistogram_free(h);
+
+    printf("Multi-percentile test passed!\n");
+}
+
 // Main test function
+static void assert_same_queries(Heistogram* plain, Heistogram* indexed) {
+    double percentiles[] = {0, 0.1, 1, 25, 50, 75, 90, 99, 99.9, 99.99, 100};
+    double results[11];
+    heistogram_percentiles(indexed, percentiles, 11, results);
+    for (int i = 0; i < 11; i++) {
+        assert(heistogram_percentile(indexed, percentiles[i]) == heistogram_percentile(plain, percentiles[i]));
+        assert(results[i] == heistogram_percentile(plain, percentiles[i]));
+    }
+    for (int i = 0; i < 200; i++) {
+        uint64_t value = rand() % 2000000;
+        assert(heistogram_prank(indexed, value) == heistogram_prank(plain, value));
+        assert(heistogram_count_upto(indexed, value) == heistogram_count_upto(plain, value));
+    }
+}
+
+static void test_cumulative_index() {
+    printf("\n=== Testing Cumulative Count Index ===\n");
+
+    HeistIndexMode modes[] = {HEIST_INDEX_LAZY, HEIST_INDEX_FENWICK};
+    for (int m = 0; m < 2; m++) {
+        Heistogram* plain = heistogram_create();
+        Heistogram* indexed = heistogram_create_indexed(modes[m]);
+        assert(indexed != NULL);
+
+        // Queries interleaved with inserts that grow the bucket array
+        for (int i = 0; i < 20000; i++) {
+            uint64_t value = rand() % 10 == 0 ? rand() % 1000000 : 100 + rand() % 900;
+            heistogram_add(plain, value);
+            heistogram_add(indexed, value);
+            if (i % 2500 == 0) assert_same_queries(plain, indexed);
+        }
+        assert_same_queries(plain, indexed);
+
+        for (int i = 0; i < 1000; i++) {
+            uint64_t value = 100 + rand() % 900;
+            heistogram_remove(plain, value);
+            heistogram_remove(indexed, value);
+        }
+        assert_same_queries(plain, indexed);
+
+        // Bulk writes invalidate the index
+        uint64_t batch[1000];
+        for (int i = 0; i < 1000; i++) batch[i] = rand() % 5000000;
+        heistogram_add_batch(plain, batch, 1000);
+        heistogram_add_batch(indexed, batch, 1000);
+        assert_same_queries(plain, indexed);
+
+        Heistogram* other = heistogram_create();
+        heistogram_add(other, 20000000);
+        heistogram_merge_inplace(plain, other);
+        heistogram_merge_inplace(indexed, other);
+        assert_same_queries(plain, indexed);
+
+        size_t size;
+        void* serialized = heistogram_serialize(other, &size);
+        heistogram_merge_inplace_serialized(plain, serialized, size);
+        heistogram_merge_inplace_serialized(indexed, serialized, size);
+        assert_same_queries(plain, indexed);
+        assert(heistogram_memory_size(indexed) > heistogram_memory_size(plain));
+
+        printf("  %s index matches the bucket scan\n", modes[m] == HEIST_INDEX_LAZY ? "Lazy" : "Fenwick");
+        free(serialized);
+        heistogram_free(other);
+        heistogram_free(indexed);
+        heistogram_free(plain);
+    }
+
+    printf("Cumulative index test passed!\n");
+}
+
+#define SHARDED_THREADS 8
+#define SHARDED_VALUES 20000
+
+typedef struct {
+    HeistogramSharded* hs;
+    int seed;
+} ShardedWriter;
+
+static uint64_t sharded_value(int seed, int i) {
+    uint64_t x = (uint64_t)seed * 2654435761u + (uint64_t)i * 40503u;
+    return (x ^ (x >> 7)) % (i % 2 ? 1000 : 10000000);
+}
+
+static void* sharded_writer(void* arg) {
+    ShardedWriter* w = arg;
+    uint64_t batch[100];
+    for (int i = 0; i < SHARDED_VALUES; i++) {
+        if (i % 4 == 0 && i + 100 <= SHARDED_VALUES) {
+            for (int j = 0; j < 100; j++) batch[j] = sharded_value(w->seed, i + j);
+            assert(heistogram_sharded_add_batch(w->hs, batch, 100) == 1);
+            i += 99;
+        } else {
+            heistogram_sharded_add(w->hs, sharded_value(w->seed, i));
+        }
+    }
+    return NULL;
+}
+
+static void test_sharded_histogram() {
+    printf("\n=== Testing Sharded Concurrent Histogram ===\n");
+
+    assert(sizeof(HeistShard) % HEIST_CACHE_LINE == 0);
+    assert(heistogram_sharded_create(0) == NULL);
+
+    // Fewer shards than threads, so some threads share a shard
+    HeistogramSharded* hs = heistogram_sharded_create(5);
+    assert(hs != NULL);
+    for (uint32_t i = 0; i < hs->num_shards; i++) {
+        assert((uintptr_t)&hs->shards[i] % HEIST_CACHE_LINE == 0);
+    }
+
+    Heistogram* empty = heistogram_sharded_snapshot(hs);
+    assert(empty != NULL && heistogram_count(empty) == 0);
+    heistogram_free(empty);
+
+    pthread_t threads[SHARDED_THREADS];
+    ShardedWriter writers[SHARDED_THREADS];
+    for (int t = 0; t < SHARDED_THREADS; t++) {
+        writers[t].hs = hs;
+        writers[t].seed = t + 1;
+        assert(pthread_create(&threads[t], NULL, sharded_writer, &writers[t]) == 0);
+    }
+
+    // Snapshots taken during the inserts never lose counts
+    uint64_t last = 0;
+    for (int i = 0; i < 20; i++) {
+        Heistogram* snapshot = heistogram_sharded_snapshot(hs);
+        assert(snapshot != NULL);
+        assert(heistogram_count(snapshot) >= last);
+        last = heistogram_count(snapshot);
+        heistogram_free(snapshot);
+    }
+    for (int t = 0; t < SHARDED_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    Heistogram* expected = heistogram_create();
+    for (int t = 0; t < SHARDED_THREADS; t++) {
+        for (int i = 0; i < SHARDED_VALUES; i++) {
+            heistogram_add(expected, sharded_value(t + 1, i));
+        }
+    }
+
+    Heistogram* snapshot = heistogram_sharded_snapshot(hs);
+    assert(snapshot != NULL);
+    printf("  %llu values from %d threads, P50 %.2f, P99 %.2f\n",
+           (unsigned long long)heistogram_count(snapshot), SHARDED_THREADS,
+           heistogram_percentile(snapshot, 50), heistogram_percentile(snapshot, 99));
+    assert(heistogram_count(snapshot) == heistogram_count(expected));
+    assert(heistogram_min(snapshot) == heistogram_min(expected));
+    assert(heistogram_max(snapshot) == heistogram_max(expected));
+    assert(snapshot->min_bucket_id == expected->min_bucket_id && snapshot->max_bucket_id == expected->max_bucket_id);
+    for (uint16_t i = expected->min_bucket_id; i <= expected->max_bucket_id; i++) {
+        assert(HEIST_BUCKET(snapshot, i).count == HEIST_BUCKET(expected, i).count);
+    }
+    for (double p = 0; p <= 100; p += 0.5) {
+        assert(heistogram_percentile(snapshot, p) == heistogram_percentile(expected, p));
+    }
+
+    heistogram_free(snapshot);
+    heistogram_free(expected);
+    heistogram_sharded_free(hs);
+
+    printf("Sharded histogram test passed!\n");
+}
+
+typedef struct {
+    Heistogram* h;
+    int seed;
+    int* done;
+} SharedWorker;
+
+static void* shared_writer(void* arg) {
+    SharedWorker* w = arg;
+    uint64_t batch[64];
+    for (int i = 0; i < SHARDED_VALUES; i += 64) {
+        int n = SHARDED_VALUES - i < 64 ? SHARDED_VALUES - i : 64;
+        for (int j = 0; j < n; j++) batch[j] = sharded_value(w->seed, i + j);
+        if (i % 128 == 0) {
+            assert(heistogram_add_batch(w->h, batch, n) == 1);
+        } else {
+            for (int j = 0; j < n; j++) heistogram_add(w->h, batch[j]);
+        }
+    }
+    return NULL;
+}
+
+static void* shared_reader(void* arg) {
+    SharedWorker* w = arg;
+    uint64_t last = 0;
+    while (!__atomic_load_n(w->done, __ATOMIC_ACQUIRE)) {
+        uint64_t count = heistogram_count(w->h);
+        assert(count >= last);
+        last = count;
+        if (count == 0) continue;
+        double p50 = heistogram_percentile(w->h, 50);
+        assert(p50 >= 0 && p50 <= 10000000);
+        double rank = heistogram_prank(w->h, 1000);
+        assert(rank >= 0 && rank <= 100);
+        assert(heistogram_count_upto(w->h, 500) <= heistogram_count(w->h));
+    }
+    return NULL;
+}
+
+static void test_shared_histogram() {
+    printf("\n=== Testing Shared Atomic Histogram ===\n");
+
+    Heistogram* h = heistogram_create_shared(10000000);
+    assert(h != NULL);
+    uint16_t capacity = h->capacity;
+    assert(heistogram_count(h) == 0 && heistogram_min(h) == 0 && heistogram_percentile(h, 50) == 0);
+
+    int done = 0;
+    pthread_t writers[SHARDED_THREADS], reader;
+    SharedWorker args[SHARDED_THREADS + 1];
+    args[SHARDED_THREADS] = (SharedWorker){h, 0, &done};
+    assert(pthread_create(&reader, NULL, shared_reader, &args[SHARDED_THREADS]) == 0);
+    for (int t = 0; t < SHARDED_THREADS; t++) {
+        args[t] = (SharedWorker){h, t + 1, &done};
+        assert(pthread_create(&writers[t], NULL, shared_writer, &args[t]) == 0);
+    }
+    for (int t = 0; t < SHARDED_THREADS; t++) {
+        pthread_join(writers[t], NULL);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    pthread_join(reader, NULL);
+
+    // The buckets were never reallocated
+    assert(h->capacity == capacity);
+
+    Heistogram* expected = heistogram_create();
+    for (int t = 0; t < SHARDED_THREADS; t++) {
+        for (int i = 0; i < SHARDED_VALUES; i++) {
+            heistogram_add(expected, sharded_value(t + 1, i));
+        }
+    }
+    assert(heistogram_count(h) == heistogram_count(expected));
+    assert(heistogram_min(h) == heistogram_min(expected));
+    assert(heistogram_max(h) == heistogram_max(expected));
+    for (double p = 0; p <= 100; p += 0.5) {
+        assert(heistogram_percentile(h, p) == heistogram_percentile(expected, p));
+    }
+
+    // Shared histograms serialize and merge through a snapshot
+    size_t size, expected_size;
+    void* serialized = heistogram_serialize(h, &size);
+    void* expected_serialized = heistogram_serialize(expected, &expected_size);
+    assert(size == expected_size && memcmp(serialized, expected_serialized, size) == 0);
+    Heistogram* merged = heistogram_merge(h, expected);
+    assert(heistogram_count(merged) == 2 * heistogram_count(expected));
+
+    heistogram_merge_inplace_serialized(h, expected_serialized, expected_size);
+    heistogram_merge_inplace(h, expected);
+    assert(heistogram_count(h) == 3 * heistogram_count(expected));
+    assert(heistogram_percentile(h, 50) == heistogram_percentile(expected, 50));
+
+    // Values above the declared range land in the top bucket
+    heistogram_add(h, 1ULL << 40);
+    assert(h->capacity == capacity);
+    assert(HEIST_BUCKET(h, capacity - 1).count > 0);
+    assert(heistogram_max(h) == 1ULL << 40);
+    heistogram_remove(h, 1ULL << 40);
+    assert(heistogram_count(h) == 3 * heistogram_count(expected));
+
+    printf("  %llu values, P50 %.2f, P99 %.2f\n", (unsigned long long)heistogram_count(h),
+           heistogram_percentile(h, 50), heistogram_percentile(h, 99));
+
+    free(serialized);
+    free(expected_serialized);
+    heistogram_free(merged);
+    heistogram_free(expected);
+    heistogram_free(h);
+
+    printf("Shared histogram test passed!\n");
+}
+
+static void test_serialize_into() {
+    printf("\n=== Testing Serialization Into Caller Buffers ===\n");
+
+    Heistogram* h = heistogram_create();
+    for (int i = 0; i < 50000; i++) {
+        heistogram_add(h, rand() % 4 == 0 ? (uint64_t)rand() * rand() : (uint64_t)(rand() % 5000));
+    }
+
+    size_t size;
+    void* expected = heistogram_serialize(h, &size);
+    size_t bound = heistogram_serialized_size_bound(h);
+    assert(bound >= size);
+
+    // Several histograms packed back to back into one buffer
+    uint8_t* buffer = malloc(3 * bound);
+    size_t offset = 0;
+    for (int i = 0; i < 3; i++) {
+        size_t written = heistogram_serialize_into(h, buffer + offset, 3 * bound - offset);
+        assert(written == size);
+        assert(memcmp(buffer + offset, expected, size) == 0);
+        offset += written;
+    }
+    printf("  3 histograms in %zu bytes, bound %zu bytes each\n", offset, bound);
+
+    // Exact fit works, one byte less fails
+    assert(heistogram_serialize_into(h, buffer, size) == size);
+    assert(heistogram_serialize_into(h, buffer, size - 1) == 0);
+    assert(heistogram_serialize_into(h, buffer, 3) == 0);
+
+    // Deserializing reuses the target, whatever it held before
+    Heistogram* target = heistogram_create();
+    heistogram_add(target, 1ULL << 60);
+    heistogram_add(target, 7);
+    assert(heistogram_deserialize_into(target, buffer + size, size) == 1);
+    assert(heistogram_count(target) == heistogram_count(h));
+    assert(heistogram_min(target) == heistogram_min(h));
+    assert(heistogram_max(target) == heistogram_max(h));
+    for (double p = 0; p <= 100; p += 2.5) {
+        assert(heistogram_percentile(target, p) == heistogram_percentile(h, p));
+    }
+    size_t round_trip_size;
+    void* round_trip = heistogram_serialize(target, &round_trip_size);
+    assert(round_trip_size == size && memcmp(round_trip, expected, size) == 0);
+
+    // Empty histograms round trip too
+    Heistogram* empty = heistogram_create();
+    size_t empty_size = heistogram_serialize_into(empty, buffer, bound);
+    assert(empty_size > 0);
+    assert(heistogram_deserialize_into(target, buffer, empty_size) == 1);
+    assert(heistogram_count(target) == 0 && heistogram_percentile(target, 50) == 0);
+
+    free(round_trip);
+    free(expected);
+    free(buffer);
+    heistogram_free(empty);
+    heistogram_free(target);
+    heistogram_free(h);
+
+    printf("Serialization into caller buffers test passed!\n");
+}
+
+static void test_serialized_view() {
+    printf("\n=== Testing Serialized Histogram View ===\n");
+
+    Heistogram* h = heistogram_create();
+    for (int i = 0; i < 50000; i++) {
+        heistogram_add(h, rand() % 3 == 0 ? (uint64_t)rand() * (rand() % 1000) : (uint64_t)(rand() % 2000));
+    }
+    size_t size;
+    void* serialized = heistogram_serialize(h, &size);
+    Heistogram* deserialized = heistogram_deserialize(serialized, size);
+
+    HeistogramView view;
+    assert(heistogram_view_init(&view, serialized, size) == 1);
+    assert(view.blocks == NULL);  // Nothing decoded until a query needs it
+    assert(heistogram_view_count(&view) == heistogram_count(h));
+    assert(heistogram_view_min(&view) == heistogram_min(h));
+    assert(heistogram_view_max(&view) == heistogram_max(h));
+
+    for (double p = 0; p <= 100; p += 0.25) {
+        assert(heistogram_view_percentile(&view, p) == heistogram_percentile(deserialized, p));
+        assert(heistogram_view_percentile(&view, p) == heistogram_percentile_serialized(serialized, size, p));
+    }
+    assert(view.blocks != NULL);
+    assert(heistogram_view_percentile(&view, -1) == 0 && heistogram_view_percentile(&view, 101) == 0);
+
+    double percentiles[] = {99.9, 50, 90, 0, 100};
+    double results[5];
+    heistogram_view_percentiles(&view, percentiles, 5, results);
+    for (int i = 0; i < 5; i++) {
+        assert(results[i] == heistogram_percentile(deserialized, percentiles[i]));
+    }
+
+    for (int i = 0; i < 5000; i++) {
+        uint64_t value = i % 2 ? (uint64_t)(rand() % 3000) : (uint64_t)rand() * (rand() % 1000);
+        assert(heistogram_view_prank(&view, value) == heistogram_prank(deserialized, value));
+        assert(heistogram_view_count_upto(&view, value) == heistogram_count_upto(deserialized, value));
+    }
+    printf("  %u buckets in %zu bytes, P50 %.2f, P99 %.2f\n", view.bucket_count, size,
+           heistogram_view_percentile(&view, 50), heistogram_view_percentile(&view, 99));
+    heistogram_view_release(&view);
+
+    // Empty and truncated buffers
+    Heistogram* empty = heistogram_create();
+    size_t empty_size;
+    void* empty_serialized = heistogram_serialize(empty, &empty_size);
+    assert(heistogram_view_init(&view, empty_serialized, empty_size) == 1);
+    assert(heistogram_view_percentile(&view, 50) == 0);
+    assert(heistogram_view_prank(&view, 10) == 0);
+    heistogram_view_release(&view);
+
+    assert(heistogram_view_init(&view, serialized, size / 2) == 1);
+    assert(heistogram_view_build_index(&view) == 0);
+    heistogram_view_release(&view);
+
+    free(empty_serialized);
+    heistogram_free(empty);
+    free(serialized);
+    heistogram_free(deserialized);
+    heistogram_free(h);
+
+    printf("Serialized view test passed!\n");
+}
+
+static void test_serialization_formats() {
+    printf("\n=== Testing Serialization Formats ===\n");
+
+    Heistogram* h = heistogram_create();
+    for (int i = 0; i < 50000; i++) {
+        heistogram_add(h, rand() % 4 == 0 ? (uint64_t)rand() * rand() : (uint64_t)(rand() % 5000));
+    }
+    // Counts of every width, including one that needs all 8 bytes
+    HEIST_BUCKET(h, 3).count += 1ULL << 40;
+    h->total_count += 1ULL << 40;
+
+    size_t size1, size2;
+#if HEIST_PRECISION != HEIST_PRECISION_2
+    // Only the 2% tier has format 1
+    assert(heistogram_serialize_version(h, &size1, HEIST_FORMAT_V1) == NULL);
+    heistogram_free(h);
+    printf("Serialization formats test skipped, format 1 needs HEIST_PRECISION_2\n");
+    return;
+#endif
+    uint8_t* v1 = heistogram_serialize_version(h, &size1, HEIST_FORMAT_V1);
+    uint8_t* v2 = heistogram_serialize_version(h, &size2, HEIST_FORMAT_V2);
+    assert(v1[0] != HEIST_FORMAT_MAGIC);
+    assert(v2[0] == HEIST_FORMAT_MAGIC && v2[1] == HEIST_FORMAT_V2);
+    assert(heistogram_serialize_version(h, &size1, 3) == NULL);
+    printf("  v1 %zu bytes, v2 %zu bytes\n", size1, size2);
+
+    // heistogram_serialize writes format 1 unless the build opts in to format 2
+    size_t default_size;
+    uint8_t* default_format = heistogram_serialize(h, &default_size);
+    assert(default_size == (HEIST_SERIALIZE_VERSION == HEIST_FORMAT_V1 ? size1 : size2));
+    assert(memcmp(default_format, HEIST_SERIALIZE_VERSION == HEIST_FORMAT_V1 ? v1 : v2, default_size) == 0);
+    free(default_format);
+
+    // Both formats answer every query the same way
+    for (double p = 0; p <= 100; p += 0.5) {
+        assert(heistogram_percentile_serialized(v2, size2, p) == heistogram_percentile_serialized(v1, size1, p));
+        assert(heistogram_percentile_serialized(v2, size2, p) == heistogram_percentile(h, p));
+    }
+    double percentiles[] = {99.9, 50, 90, 0, 100};
+    double results1[5], results2[5];
+    heistogram_percentiles_serialized(v1, size1, percentiles, 5, results1);
+    heistogram_percentiles_serialized(v2, size2, percentiles, 5, results2);
+    assert(memcmp(results1, results2, sizeof(results1)) == 0);
+
+    // Either format deserializes back to the same histogram
+    Heistogram* from1 = heistogram_deserialize(v1, size1);
+    Heistogram* from2 = heistogram_deserialize(v2, size2);
+    size_t round_trip_size;
+    uint8_t* round_trip = heistogram_serialize_version(from2, &round_trip_size, HEIST_FORMAT_V1);
+    assert(round_trip_size == size1 && memcmp(round_trip, v1, size1) == 0);
+    free(round_trip);
+    round_trip = heistogram_serialize_version(from1, &round_trip_size, HEIST_FORMAT_V2);
+    assert(round_trip_size == size2 && memcmp(round_trip, v2, size2) == 0);
+    free(round_trip);
+
+    // Merges accept both formats, also mixed
+    Heistogram* merged = heistogram_merge_two_serialized(v1, size1, v2, size2);
+    Heistogram* doubled = heistogram_merge(h, h);
+    assert(heistogram_merge_inplace_serialized(from1, v2, size2) == 1);
+    for (double p = 0; p <= 100; p += 2.5) {
+        assert(heistogram_percentile(merged, p) == heistogram_percentile(doubled, p));
+        assert(heistogram_percentile(from1, p) == heistogram_percentile(doubled, p));
+    }
+
+    HeistogramView view;
+    assert(heistogram_view_init(&view, v2, size2) == 1);
+    for (double p = 0; p <= 100; p += 0.5) {
+        assert(heistogram_view_percentile(&view, p) == heistogram_percentile(h, p));
+    }
+    heistogram_view_release(&view);
+
+    // Truncated and unknown buffers are rejected
+    for (size_t cut = 1; cut < size2; cut += 7) {
+        assert(heistogram_deserialize_into(from2, v2, size2 - cut) == 0);
+    }
+    v2[1] = 3;
+    assert(heistogram_deserialize(v2, size2) == NULL);
+    assert(heistogram_percentile_serialized(v2, size2, 50) == 0);
+
+    free(v1);
+    free(v2);
+    heistogram_free(merged);
+    heistogram_free(doubled);
+    heistogram_free(from1);
+    heistogram_free(from2);
+    heistogram_free(h);
+
+    printf("Serialization formats test passed!\n");
+}
+
+static void assert_exact_window(const Heistogram* h) {
+    if (h->total_count == 0) {
+        assert(h->min_bucket_id == 0 && h->max_bucket_id == 0);
+    } else {
+        assert(heist_bucket_count(h, h->min_bucket_id) > 0 && heist_bucket_count(h, h->max_bucket_id) > 0);
+    }
+    for (uint16_t k = 0; k < h->capacity; k++) {
+        uint16_t i = h->base_bucket_id + k;
+        if (h->total_count == 0 || i < h->min_bucket_id || i > h->max_bucket_id) assert(heist_bucket_count(h, i) == 0);
+        assert(((h->occupied[k >> 6] >> (k & 63)) & 1) == (heist_bucket_count(h, i) > 0));
+    }
+}
+
+static void test_bucket_window() {
+    printf("\n=== Testing Occupied Bucket Window ===\n");
+
+    // Narrow latency range far from zero
+    Heistogram* h = heistogram_create();
+    uint64_t values[1000];
+    for (int i = 0; i < 1000; i++) {
+        values[i] = 1000000 + rand() % 50000;
+        heistogram_add(h, values[i]);
+    }
+    assert_exact_window(h);
+    assert(h->min_bucket_id == get_bucket_id(heistogram_min(h)));
+    assert(h->max_bucket_id == get_bucket_id(heistogram_max(h)));
+    printf("  Window [%u, %u] of %u buckets\n", h->min_bucket_id, h->max_bucket_id, h->capacity);
+
+    // Removing values shrinks the window from both ends
+    Heistogram* copy = heistogram_merge(h, h);
+    for (int i = 0; i < 1000; i++) {
+        heistogram_remove(h, values[i]);
+        assert_exact_window(h);
+    }
+    assert(heistogram_count(h) == 0);
+
+    // Merges and serialization only cover the window
+    heistogram_add(h, 5);
+    assert(heistogram_merge_inplace(h, copy) == 1);
+    assert_exact_window(h);
+    assert(h->min_bucket_id == get_bucket_id(5) && h->max_bucket_id == copy->max_bucket_id);
+    Heistogram* empty = heistogram_create();
+    Heistogram* merged = heistogram_merge(copy, empty);
+    assert_exact_window(merged);
+    assert(merged->min_bucket_id == copy->min_bucket_id && merged->max_bucket_id == copy->max_bucket_id);
+
+    size_t size;
+    void* serialized = heistogram_serialize(h, &size);
+    Heistogram* deserialized = heistogram_deserialize(serialized, size);
+    assert_exact_window(deserialized);
+    assert(heistogram_merge_inplace_serialized(empty, serialized, size) == 1);
+    assert_exact_window(empty);
+    for (double p = 0; p <= 100; p += 5) {
+        assert(heistogram_percentile(deserialized, p) == heistogram_percentile(h, p));
+    }
+    free(serialized);
+
+    // Buffers with empty buckets below the data, as older versions wrote after merges, get trimmed
+    assert(heist_reserve(copy, 0, copy->max_bucket_id) == 1);
+    copy->min_bucket_id = 0;
+    serialized = heistogram_serialize_version(copy, &size, TEST_FORMAT_V1);
+    assert(heistogram_deserialize_into(deserialized, serialized, size) == 1);
+    assert_exact_window(deserialized);
+    free(serialized);
+
+    heistogram_free(deserialized);
+    heistogram_free(merged);
+    heistogram_free(empty);
+    heistogram_free(copy);
+    heistogram_free(h);
+
+    printf("Occupied bucket window test passed!\n");
+}
+
+static void test_occupancy_bitmap() {
+    printf("\n=== Testing Occupancy Bitmap ===\n");
+
+    // A few values per power of two, most buckets in the window stay empty
+    Heistogram* h = heistogram_create();
+    Heistogram* indexed = heistogram_create_indexed(HEIST_INDEX_LAZY);
+    uint64_t values[200];
+    for (int i = 0; i < 200; i++) {
+        values[i] = (1ULL << (i % 60)) + rand() % 7;
+        heistogram_add(h, values[i]);
+        heistogram_add(indexed, values[i]);
+    }
+    assert_exact_window(h);
+
+    // Scans that skip empty runs agree with the index and the serialized scan
+    size_t size;
+    void* serialized = heistogram_serialize_version(h, &size, TEST_FORMAT_V1);
+    for (double p = 0; p <= 100; p += 0.5) {
+        assert(heistogram_percentile(h, p) == heistogram_percentile(indexed, p));
+        assert(heistogram_percentile(h, p) == heistogram_percentile_serialized(serialized, size, p));
+    }
+    free(serialized);
+
+    // Removing values moves the max to the next non-empty bucket
+    for (int i = 0; i < 200; i++) {
+        heistogram_remove(h, values[i]);
+        assert_exact_window(h);
+        if (heistogram_count(h) > 0) {
+            assert(get_bucket_id(heistogram_max(h)) == h->max_bucket_id);
+        }
+    }
+    assert(heistogram_count(h) == 0);
+
+    heistogram_free(indexed);
+    heistogram_free(h);
+
+    printf("Occupancy bitmap test passed!\n");
+}
+
+static void test_based_buckets() {
+    printf("\n=== Testing Based Bucket Array ===\n");
+
+    // Values between 10^6 and 10^7 don't pay for the buckets below them
+    Heistogram* narrow = heistogram_create();
+    Heistogram* from_zero = heistogram_create();
+    heistogram_add(from_zero, 1);
+    for (int i = 0; i < 1000; i++) {
+        uint64_t value = 1000000 + (uint64_t)rand() % 9000000;
+        heistogram_add(narrow, value);
+        heistogram_add(from_zero, value);
+    }
+    assert_exact_window(narrow);
+    assert(narrow->base_bucket_id > 0 && narrow->base_bucket_id <= narrow->min_bucket_id);
+    assert(narrow->capacity <= narrow->max_bucket_id - narrow->min_bucket_id + 1 + 32);
+    printf("  Memory %u bytes, %u when based at bucket 0\n", heistogram_memory_size(narrow), heistogram_memory_size(from_zero));
+    assert(heistogram_memory_size(narrow) * 2 < heistogram_memory_size(from_zero));
+
+    // Growing downward keeps counts, bits and index in place
+    Heistogram* ascending = heistogram_create();
+    Heistogram* descending = heistogram_create();
+    Heistogram* lazy = heistogram_create_indexed(HEIST_INDEX_LAZY);
+    Heistogram* fenwick = heistogram_create_indexed(HEIST_INDEX_FENWICK);
+    for (uint64_t value = 10; value <= 10000000; value = value * 5 / 4) {
+        heistogram_add(ascending, value);
+    }
+    for (uint64_t value = 10000000; value >= 10; value = value * 4 / 5) {
+        heistogram_add(descending, value);
+        heistogram_add(lazy, value);
+        heistogram_add(fenwick, value);
+        assert_exact_window(descending);
+        assert(heistogram_percentile(fenwick, 50) == heistogram_percentile(descending, 50));
+    }
+    heistogram_merge_inplace(descending, ascending);
+    heistogram_merge_inplace(lazy, ascending);
+    heistogram_merge_inplace(fenwick, ascending);
+    assert_exact_window(descending);
+    for (double p = 0; p <= 100; p += 2.5) {
+        double expected = heistogram_percentile(descending, p);
+        assert(heistogram_percentile(lazy, p) == expected && heistogram_percentile(fenwick, p) == expected);
+    }
+    for (uint64_t value = 1; value < 20000000; value = value * 3 / 2 + 1) {
+        assert(heistogram_prank(lazy, value) == heistogram_prank(descending, value));
+        assert(heistogram_count_upto(fenwick, value) == heistogram_count_upto(descending, value));
+    }
+
+    // Merges between arrays with different bases, in either direction
+    Heistogram* low = heistogram_create();
+    Heistogram* all = heistogram_create();
+    for (int i = 0; i < 1000; i++) {
+        uint64_t value = 1000 + (uint64_t)rand() % 9000;
+        heistogram_add(low, value);
+        heistogram_add(all, value);
+    }
+    heistogram_merge_inplace(all, narrow);
+    Heistogram* merged = heistogram_merge(narrow, low);
+    Heistogram* into_low = heistogram_create();
+    Heistogram* into_narrow = heistogram_create();
+    assert(heistogram_merge_inplace(into_low, low) == 1 && heistogram_merge_inplace(into_low, narrow) == 1);
+    assert(heistogram_merge_inplace(into_narrow, narrow) == 1 && heistogram_merge_inplace(into_narrow, low) == 1);
+    assert_exact_window(merged);
+    assert_exact_window(into_low);
+    assert_exact_window(into_narrow);
+    for (double p = 0; p <= 100; p += 2.5) {
+        double expected = heistogram_percentile(all, p);
+        assert(heistogram_percentile(merged, p) == expected);
+        assert(heistogram_percentile(into_low, p) == expected && heistogram_percentile(into_narrow, p) == expected);
+    }
+
+    // Deserializing into a histogram rebases it to the buffer's buckets
+    size_t size;
+    void* serialized = heistogram_serialize(narrow, &size);
+    assert(heistogram_deserialize_into(low, serialized, size) == 1);
+    assert_exact_window(low);
+    assert(low->base_bucket_id > 0);
+    for (double p = 0; p <= 100; p += 2.5) {
+        assert(heistogram_percentile(low, p) == heistogram_percentile(narrow, p));
+    }
+    free(serialized);
+
+    Heistogram* histograms[] = {narrow, from_zero, ascending, descending, lazy, fenwick, low, all, merged, into_low, into_narrow};
+    for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]); i++) {
+        heistogram_free(histograms[i]);
+    }
+
+    printf("Based bucket array test passed!\n");
+}
+
+// Same counts, percentiles and serialized bytes, whatever the counter sizes
+static void assert_same_histogram(const Heistogram* a, const Heistogram* b) {
+    assert(heistogram_count(a) == heistogram_count(b));
+    assert(a->min_bucket_id == b->min_bucket_id && a->max_bucket_id == b->max_bucket_id);
+    for (int32_t i = a->min_bucket_id; a->total_count > 0 && i <= a->max_bucket_id; i++) {
+        assert(heist_bucket_count(a, i) == heist_bucket_count(b, i));
+    }
+    for (double p = 0; p <= 100; p += 2.5) {
+        assert(heistogram_percentile(a, p) == heistogram_percentile(b, p));
+    }
+    size_t size_a, size_b;
+    void* serialized_a = heistogram_serialize(a, &size_a);
+    void* serialized_b = heistogram_serialize(b, &size_b);
+    assert(size_a == size_b && memcmp(serialized_a, serialized_b, size_a) == 0);
+    free(serialized_a);
+    free(serialized_b);
+}
+
+static void test_compact_counters() {
+    printf("\n=== Testing Compact Counters ===\n");
+
+    Heistogram* compact = heistogram_create_compact();
+    Heistogram* regular = heistogram_create();
+    assert(compact->count_size == 1);
+    for (int i = 0; i < 2000; i++) {
+        uint64_t value = 1000 + rand() % 100000;
+        heistogram_add(compact, value);
+        heistogram_add(regular, value);
+    }
+    assert(compact->count_size == 1);
+    assert_exact_window(compact);
+    assert_same_histogram(compact, regular);
+    printf("  Memory %u bytes, %u with 8 byte counters\n", heistogram_memory_size(compact), heistogram_memory_size(regular));
+    assert(heistogram_memory_size(compact) < heistogram_memory_size(regular));
+
+    // A bucket past 255 and then past 65535 widens every counter
+    for (int i = 0; i < 300; i++) {
+        heistogram_add(compact, 5000);
+        heistogram_add(regular, 5000);
+    }
+    assert(compact->count_size == 2);
+    assert_same_histogram(compact, regular);
+    uint64_t values[1000];
+    for (int i = 0; i < 1000; i++) values[i] = 7000;
+    for (int i = 0; i < 70; i++) {
+        assert(heistogram_add_batch(compact, values, 1000) == 1);
+        assert(heistogram_add_batch(regular, values, 1000) == 1);
+    }
+    assert(compact->count_size == 4);
+    assert_exact_window(compact);
+    assert_same_histogram(compact, regular);
+
+    // Removing never narrows, the counts stay right
+    for (int i = 0; i < 300; i++) {
+        heistogram_remove(compact, 5000);
+        heistogram_remove(regular, 5000);
+    }
+    assert(compact->count_size == 4);
+    assert_same_histogram(compact, regular);
+
+    // Merges across sizes widen where the sums need it
+    Heistogram* small = heistogram_create_compact();
+    Heistogram* small_regular = heistogram_create();
+    for (int i = 0; i < 200; i++) {
+        heistogram_add(small, 42);
+        heistogram_add(small_regular, 42);
+    }
+    Heistogram* merged = heistogram_merge(small, small);
+    assert(merged->count_size == 2);
+    Heistogram* expected = heistogram_merge(small_regular, small_regular);
+    assert_same_histogram(merged, expected);
+    heistogram_free(merged);
+    heistogram_free(expected);
+
+    merged = heistogram_merge(small, regular);
+    expected = heistogram_merge(small_regular, regular);
+    assert(merged->count_size == 8);
+    assert_same_histogram(merged, expected);
+    heistogram_free(expected);
+
+    assert(heistogram_merge_inplace(small, regular) == 1);
+    assert(small->count_size == 4);
+    assert_exact_window(small);
+    assert_same_histogram(small, merged);
+    assert(heistogram_merge_inplace(regular, small_regular) == 1);
+    assert_same_histogram(regular, merged);
+
+    // Serialized counts widen compact histograms as well
+    size_t size;
+    void* serialized = heistogram_serialize(merged, &size);
+    Heistogram* target = heistogram_create_compact();
+    assert(heistogram_deserialize_into(target, serialized, size) == 1);
+    assert(target->count_size == 4);
+    assert_same_histogram(target, merged);
+    Heistogram* accumulated = heistogram_create_compact();
+    assert(heistogram_merge_inplace_serialized(accumulated, serialized, size) == 1);
+    assert_same_histogram(accumulated, merged);
+    heistogram_free(accumulated);
+    accumulated = heistogram_merge_serialized(target, serialized, size);
+    expected = heistogram_merge(merged, merged);
+    assert_same_histogram(accumulated, expected);
+    free(serialized);
+
+    heistogram_free(accumulated);
+    heistogram_free(expected);
+    heistogram_free(target);
+    heistogram_free(merged);
+    heistogram_free(small_regular);
+    heistogram_free(small);
+    heistogram_free(regular);
+    heistogram_free(compact);
+
+    printf("Compact counters test passed!\n");
+}
+
+// Same ranks and percentiles as assert_same_histogram, for a sparse histogram and its regular twin
+static void assert_same_sparse(const Heistogram* sparse, const Heistogram* regular) {
+    assert_same_histogram(sparse, regular);
+    assert(heistogram_min(sparse) == heistogram_min(regular) && heistogram_max(sparse) == heistogram_max(regular));
+    for (uint64_t value = 1; value < (1ULL << 40); value = value * 3 + 1) {
+        assert(heistogram_prank(sparse, value) == heistogram_prank(regular, value));
+        assert(heistogram_count_upto(sparse, value) == heistogram_count_upto(regular, value));
+    }
+    double percentiles[] = {99.9, 0, 50, 25, 75, 99, 1}, a[7], b[7];
+    heistogram_percentiles(sparse, percentiles, 7, a);
+    heistogram_percentiles(regular, percentiles, 7, b);
+    assert(memcmp(a, b, sizeof a) == 0);
+}
+
+static void test_sparse_histograms() {
+    printf("\n=== Testing Sparse Histograms ===\n");
+
+    // 30 distinct values over six decades stay in pairs
+    Heistogram* sparse = heistogram_create_sparse();
+    Heistogram* regular = heistogram_create();
+    assert(heistogram_count(sparse) == 0 && heistogram_percentile(sparse, 50) == 0);
+    for (int i = 0; i < 1000; i++) {
+        uint64_t value = (uint64_t)pow(10, 1 + (i % 30) / 5.0);
+        heistogram_add(sparse, value);
+        heistogram_add(regular, value);
+    }
+    assert(sparse->flags & HEIST_FLAG_SPARSE);
+    assert(sparse->sparse_size == 30);
+    assert_same_sparse(sparse, regular);
+    printf("  Memory %u bytes, %u with a bucket array\n", heistogram_memory_size(sparse), heistogram_memory_size(regular));
+    assert(heistogram_memory_size(sparse) * 4 < heistogram_memory_size(regular));
+
+    // Emptying the lowest and highest buckets shrinks the window and the bounds
+    for (int i = 0; i < 34; i++) {
+        heistogram_remove(sparse, 10);
+        heistogram_remove(regular, 10);
+        heistogram_remove(sparse, (uint64_t)pow(10, 1 + 29 / 5.0));
+        heistogram_remove(regular, (uint64_t)pow(10, 1 + 29 / 5.0));
+    }
+    heistogram_remove(sparse, 12345);
+    assert(sparse->sparse_size == 28);
+    assert_same_sparse(sparse, regular);
+
+    // Merging two sparse histograms stays sparse, anything else gives a regular one
+    Heistogram* other = heistogram_create_sparse();
+    Heistogram* other_regular = heistogram_create();
+    uint64_t values[20];
+    for (int i = 0; i < 20; i++) values[i] = 7 + (uint64_t)i * i * i * 1000;
+    assert(heistogram_add_batch(other, values, 20) == 1);
+    assert(heistogram_add_batch(other_regular, values, 20) == 1);
+    assert(other->flags & HEIST_FLAG_SPARSE);
+    Heistogram* merged = heistogram_merge(sparse, other);
+    Heistogram* expected = heistogram_merge(regular, other_regular);
+    assert(merged->flags & HEIST_FLAG_SPARSE);
+    assert_same_sparse(merged, expected);
+    Heistogram* mixed = heistogram_merge(regular, other);
+    assert(!(mixed->flags & HEIST_FLAG_SPARSE));
+    assert_exact_window(mixed);
+    assert_same_sparse(mixed, expected);
+    heistogram_free(mixed);
+    mixed = heistogram_merge(other, regular);
+    assert_same_sparse(mixed, expected);
+    heistogram_free(mixed);
+
+    // Whether the result stays sparse is judged on both windows, not just the one merged last
+    Heistogram* narrow = heistogram_create_sparse();
+    Heistogram* narrow_regular = heistogram_create();
+    for (int i = 0; i < 5; i++) {
+        heistogram_add(narrow, 5000 + i * 100);
+        heistogram_add(narrow_regular, 5000 + i * 100);
+    }
+    mixed = heistogram_merge(sparse, narrow);
+    Heistogram* narrow_expected = heistogram_merge(regular, narrow_regular);
+    assert(mixed->flags & HEIST_FLAG_SPARSE);
+    assert_same_sparse(mixed, narrow_expected);
+    heistogram_free(mixed);
+    heistogram_free(narrow);
+    heistogram_free(narrow_regular);
+    heistogram_free(narrow_expected);
+
+    // A sparse histogram merged into a regular one in place, and the other way around
+    Heistogram* into_regular = heistogram_create();
+    assert(heistogram_merge_inplace(into_regular, sparse) == 1 && heistogram_merge_inplace(into_regular, other) == 1);
+    assert_exact_window(into_regular);
+    assert_same_sparse(into_regular, expected);
+    Heistogram* into_sparse = heistogram_create_sparse();
+    assert(heistogram_merge_inplace(into_sparse, other) == 1 && heistogram_merge_inplace(into_sparse, regular) == 1);
+    assert(!(into_sparse->flags & HEIST_FLAG_SPARSE));
+    assert_exact_window(into_sparse);
+    assert_same_sparse(into_sparse, expected);
+    heistogram_free(into_regular);
+    heistogram_free(into_sparse);
+
+    // Serialized counts load into pairs when they fit and into a bucket array when they don't
+    size_t size;
+    void* serialized = heistogram_serialize(expected, &size);
+    Heistogram* loaded = heistogram_create_sparse();
+    assert(heistogram_deserialize_into(loaded, serialized, size) == 1);
+    assert(loaded->flags & HEIST_FLAG_SPARSE);
+    assert_same_sparse(loaded, expected);
+    assert(heistogram_merge_inplace_serialized(loaded, serialized, size) == 1);
+    Heistogram* doubled = heistogram_merge(expected, expected);
+    assert_same_sparse(loaded, doubled);
+    Heistogram* from_serialized = heistogram_merge_serialized(sparse, serialized, size);
+    Heistogram* from_regular = heistogram_merge_serialized(regular, serialized, size);
+    assert(from_serialized->flags & HEIST_FLAG_SPARSE);
+    assert_same_sparse(from_serialized, from_regular);
+    assert(heistogram_merge_inplace_serialized(loaded, serialized, size - 1) == 0);
+    assert_same_sparse(loaded, doubled);
+    free(serialized);
+
+    Heistogram* wide = heistogram_create();
+    for (int i = 0; i < 5000; i++) heistogram_add(wide, 1000 + rand() % 100000);
+    serialized = heistogram_serialize(wide, &size);
+    assert(heistogram_deserialize_into(loaded, serialized, size) == 1);
+    assert(!(loaded->flags & HEIST_FLAG_SPARSE));
+    assert_exact_window(loaded);
+    assert_same_sparse(loaded, wide);
+    free(serialized);
+
+    // Many distinct buckets turn a sparse histogram dense for good
+    for (int i = 0; i < 5000; i++) {
+        uint64_t value = 1000 + rand() % 100000;
+        heistogram_add(sparse, value);
+        heistogram_add(regular, value);
+    }
+    assert(!(sparse->flags & HEIST_FLAG_SPARSE));
+    assert_exact_window(sparse);
+    assert_same_sparse(sparse, regular);
+
+    heistogram_free(wide);
+    heistogram_free(loaded);
+    heistogram_free(from_serialized);
+    heistogram_free(from_regular);
+    heistogram_free(doubled);
+    heistogram_free(merged);
+    heistogram_free(expected);
+    heistogram_free(other);
+    heistogram_free(other_regular);
+    heistogram_free(regular);
+    heistogram_free(sparse);
+
+    printf("Sparse histograms test passed!\n");
+}
+
+// Counts the calls and live blocks of an allocator backed by malloc
+typedef struct {
+    int allocs;
+    int frees;
+    int live;
+} CountingContext;
+
+static void* counting_alloc(void* ctx, size_t size) {
+    ((CountingContext*)ctx)->allocs++;
+    ((CountingContext*)ctx)->live++;
+    return malloc(size);
+}
+
+static void* counting_realloc(void* ctx, void* ptr, size_t old_size, size_t new_size) {
+    (void)old_size;
+    ((CountingContext*)ctx)->allocs++;
+    if (!ptr) ((CountingContext*)ctx)->live++;
+    return realloc(ptr, new_size);
+}
+
+static void counting_free(void* ctx, void* ptr) {
+    ((CountingContext*)ctx)->frees++;
+    ((CountingContext*)ctx)->live--;
+    free(ptr);
+}
+
+// A bump arena without realloc whose blocks are all released at once
+typedef struct {
+    uint8_t memory[1 << 22];
+    size_t used;
+} ArenaContext;
+
+static void* arena_alloc(void* ctx, size_t size) {
+    ArenaContext* arena = ctx;
+    size = (size + 7) & ~(size_t)7;
+    if (arena->used + size > sizeof(arena->memory)) return NULL;
+    arena->used += size;
+    return arena->memory + arena->used - size;
+}
+
+static void arena_free(void* ctx, void* ptr) {
+    (void)ctx;
+    (void)ptr;
+}
+
+static void test_allocator() {
+    printf("\n=== Testing Custom Allocators ===\n");
+
+    CountingContext counting = {0};
+    HeistAllocator counting_allocator = {counting_alloc, counting_realloc, counting_free, &counting};
+    Heistogram* regular = heistogram_create();
+    Heistogram* hooked = heistogram_create_with_allocator(&counting_allocator, 0);
+    assert(hooked->allocator == &counting_allocator && counting.live == 3);
+    for (int i = 0; i < 5000; i++) {
+        uint64_t value = 100 + rand() % 1000000;
+        heistogram_add(regular, value);
+        heistogram_add(hooked, value);
+    }
+    assert(counting.allocs > 3);
+    assert_exact_window(hooked);
+    assert_same_histogram(hooked, regular);
+    heistogram_free(hooked);
+    assert(counting.live == 0 && counting.frees == 3);
+
+    // Values within the inline window need a single allocation for everything
+    counting = (CountingContext){0};
+    Heistogram* inlined = heistogram_create_with_allocator(&counting_allocator, 256);
+    assert((inlined->flags & HEIST_FLAG_INLINE_BUCKETS) && (inlined->flags & HEIST_FLAG_INLINE_BITMAP));
+    assert((void*)inlined->buckets == (void*)(inlined + 1) && inlined->capacity == 256);
+    Heistogram* narrow = heistogram_create();
+    for (int i = 0; i < 5000; i++) {
+        uint64_t value = 1000 + rand() % 800;
+        heistogram_add(inlined, value);
+        heistogram_add(narrow, value);
+    }
+    assert(counting.allocs == 1 && (inlined->flags & HEIST_FLAG_INLINE_BUCKETS));
+    assert_same_histogram(inlined, narrow);
+    assert(heistogram_merge_inplace(inlined, narrow) == 1 && heistogram_merge_inplace(narrow, narrow) == 1);
+    assert(counting.allocs == 1);
+    assert_same_histogram(inlined, narrow);
+
+    // Growing past the window moves the buckets out of line, the histogram itself stays put
+    for (int i = 0; i < 1000; i++) {
+        heistogram_add(inlined, i * 1000000ULL);
+        heistogram_add(narrow, i * 1000000ULL);
+    }
+    assert(!(inlined->flags & HEIST_FLAG_INLINE_BUCKETS) && !(inlined->flags & HEIST_FLAG_INLINE_BITMAP));
+    assert_exact_window(inlined);
+    assert_same_histogram(inlined, narrow);
+    size_t size;
+    void* serialized = heistogram_serialize(narrow, &size);
+    assert(heistogram_deserialize_into(inlined, serialized, size) == 1);
+    assert_same_histogram(inlined, narrow);
+    free(serialized);
+    heistogram_free(inlined);
+    assert(counting.live == 0);
+
+    // An indexed histogram keeps its index in the allocator too
+    counting = (CountingContext){0};
+    Heistogram* indexed = heistogram_create_with_allocator(&counting_allocator, 64);
+    indexed->index_mode = HEIST_INDEX_LAZY;
+    indexed->index_dirty = 1;
+    for (int i = 0; i < 100; i++) heistogram_add(indexed, 500 + i);
+    assert(heistogram_percentile(indexed, 50) > 0 && indexed->index != NULL);
+    assert(counting.live == 2);
+    heistogram_free(indexed);
+    assert(counting.live == 0);
+
+    // Without realloc an arena gets fresh blocks and reclaims the whole window at once
+    ArenaContext* arena = calloc(1, sizeof(ArenaContext));
+    HeistAllocator arena_allocator = {arena_alloc, NULL, arena_free, arena};
+    Heistogram* window[8];
+    for (int w = 0; w < 8; w++) {
+        window[w] = heistogram_create_with_allocator(&arena_allocator, w % 2 ? 32 : 0);
+        for (int i = 0; i < 200; i++) heistogram_add(window[w], (uint64_t)(w + 1) * (10 + i * i));
+    }
+    Heistogram* total = heistogram_create();
+    Heistogram* expected = heistogram_create();
+    for (int w = 0; w < 8; w++) {
+        for (int i = 0; i < 200; i++) heistogram_add(expected, (uint64_t)(w + 1) * (10 + i * i));
+        assert(heistogram_merge_inplace(total, window[w]) == 1);
+    }
+    assert(arena->used > 0);
+    assert_same_histogram(total, expected);
+    arena->used = 0;
+
+    // A NULL allocator still gives a single allocation with malloc
+    Heistogram* plain = heistogram_create_with_allocator(NULL, 32);
+    heistogram_add(plain, 42);
+    heistogram_add(plain, 1ULL << 40);
+    assert(heistogram_count(plain) == 2 && heistogram_max(plain) == 1ULL << 40);
+    heistogram_free(plain);
+
+    heistogram_free(total);
+    heistogram_free(expected);
+    heistogram_free(narrow);
+    heistogram_free(regular);
+    free(arena);
+
+    printf("Custom allocators test passed!\n");
+}
+
+static void test_interval_rollover() {
+    printf("\n=== Testing Interval Rollover ===\n");
+
+    // A reset histogram refills without touching its bucket array
+    Heistogram* h = heistogram_create();
+    Heistogram* fresh = heistogram_create();
+    heistogram_add(h, 50);
+    heistogram_add(h, 100050);
+    for (int i = 0; i < 10000; i++) heistogram_add(h, 50 + rand() % 100000);
+    Bucket* buckets = h->buckets;
+    uint16_t capacity = h->capacity;
+    heistogram_reset(h);
+    assert(heistogram_count(h) == 0 && heistogram_min(h) == 0 && heistogram_max(h) == 0);
+    assert(heistogram_percentile(h, 50) == 0 && heistogram_count_upto(h, UINT64_MAX) == 0);
+    assert_exact_window(h);
+    for (int i = 0; i < 10000; i++) {
+        uint64_t value = 60 + rand() % 90000;
+        heistogram_add(h, value);
+        heistogram_add(fresh, value);
+    }
+    assert(h->buckets == buckets && h->capacity == capacity);
+    assert_exact_window(h);
+    assert_same_histogram(h, fresh);
+
+    // Compact and sparse histograms keep their kind
+    Heistogram* compact = heistogram_create_compact();
+    Heistogram* sparse = heistogram_create_sparse();
+    for (int i = 0; i < 300; i++) {
+        heistogram_add(compact, 1000 + i * 7);
+        heistogram_add(sparse, 1 + (i % 10) * 1000);
+    }
+    heistogram_reset(compact);
+    heistogram_reset(sparse);
+    assert(heistogram_count(compact) == 0 && compact->count_size == 1);
+    assert(heistogram_count(sparse) == 0 && sparse->sparse_size == 0 && (sparse->flags & HEIST_FLAG_SPARSE));
+    heistogram_add(sparse, 5);
+    assert(heistogram_count(sparse) == 1 && heistogram_min(sparse) == 5 && sparse->sparse_size == 1);
+
+    // Cloning into a histogram that already covers the source reuses its buckets
+    Heistogram* copy = heistogram_create();
+    assert(heistogram_clone_into(copy, h) == 1);
+    assert_exact_window(copy);
+    assert_same_histogram(copy, fresh);
+    buckets = copy->buckets;
+    assert(heistogram_clone_into(copy, fresh) == 1 && copy->buckets == buckets);
+    assert_same_histogram(copy, fresh);
+    assert(heistogram_clone_into(copy, copy) == 1);
+    assert_same_histogram(copy, fresh);
+    assert(heistogram_clone_into(copy, sparse) == 1);
+    assert(heistogram_count(copy) == 1 && heistogram_min(copy) == 5 && heistogram_max(copy) == 5);
+    assert_exact_window(copy);
+    assert(heistogram_clone_into(compact, fresh) == 1 && compact->count_size < 8);
+    assert_same_histogram(compact, fresh);
+    Heistogram* empty = heistogram_create();
+    assert(heistogram_clone_into(copy, empty) == 1 && heistogram_count(copy) == 0);
+    assert_exact_window(copy);
+
+    // Swapping hands the filled histogram over and keeps the empty one
+    assert(heistogram_swap(h, empty) == 1);
+    assert(heistogram_count(h) == 0 && heistogram_count(empty) == heistogram_count(fresh));
+    assert_same_histogram(empty, fresh);
+    assert(heistogram_swap(h, empty) == 1);
+    assert_same_histogram(h, fresh);
+    assert(heistogram_count(empty) == 0);
+    Heistogram* inlined = heistogram_create_with_allocator(NULL, 64);
+    assert(heistogram_swap(h, inlined) == 0 && heistogram_count(inlined) == 0);
+    assert_same_histogram(h, fresh);
+    heistogram_free(inlined);
+
+    // A pool hands the same histograms out again once they come back
+    HeistogramPool* pool = heistogram_pool_create(4, 100, 10000000);
+    Heistogram* taken[6];
+    for (int i = 0; i < 4; i++) {
+        taken[i] = heistogram_pool_acquire(pool);
+        assert(heistogram_count(taken[i]) == 0);
+        assert(heist_has_bucket(taken[i], get_bucket_id(100)) && heist_has_bucket(taken[i], get_bucket_id(10000000)));
+    }
+    assert(pool->size == 0);
+    taken[4] = heistogram_pool_acquire(pool);
+    taken[5] = heistogram_pool_acquire(pool);
+    Heistogram* first = taken[0];
+    for (int interval = 0; interval < 3; interval++) {
+        for (int i = 0; i < 6; i++) {
+            buckets = taken[i]->buckets;
+            for (int k = 0; k < 1000; k++) heistogram_add(taken[i], 100 + rand() % 9999900);
+            assert(taken[i]->buckets == buckets);
+        }
+        for (int i = 0; i < 6; i++) heistogram_pool_release(pool, taken[i]);
+        assert(pool->size == 6);
+        for (int i = 5; i >= 0; i--) {
+            assert(heistogram_pool_acquire(pool) == taken[i]);
+            assert(heistogram_count(taken[i]) == 0);
+            assert_exact_window(taken[i]);
+        }
+    }
+    assert(taken[0] == first);
+    heistogram_pool_release(pool, taken[0]);
+    for (int i = 1; i < 6; i++) heistogram_free(taken[i]);
+    heistogram_pool_free(pool);
+
+    heistogram_free(h);
+    heistogram_free(fresh);
+    heistogram_free(compact);
+    heistogram_free(sparse);
+    heistogram_free(copy);
+    heistogram_free(empty);
+
+    printf("Interval rollover test passed!\n");
+}
+
+static void test_merge_many() {
+    printf("\n=== Testing Merge Many ===\n");
+
+    // Regular, compact, sparse and empty sources, and a hole in the array
+    Heistogram* sources[40];
+    HeistBuffer buffers[40];
+    for (int i = 0; i < 40; i++) {
+        sources[i] = i % 4 == 1 ? heistogram_create_compact() : i % 4 == 2 ? heistogram_create_sparse() : heistogram_create();
+        int n = i % 10 == 9 ? 0 : 50 + rand() % 500;
+        uint64_t scale = 1 + i % 7 * 1000;
+        for (int k = 0; k < n; k++) heistogram_add(sources[i], scale * (1 + rand() % 1000));
+        buffers[i].data = heistogram_serialize(sources[i], &buffers[i].size);
+    }
+    Heistogram* expected = heistogram_create();
+    for (int i = 0; i < 40; i++) assert(heistogram_merge_inplace(expected, sources[i]) == 1);
+
+    Heistogram* merged = heistogram_create();
+    assert(heistogram_merge_many(merged, (const Heistogram* const*)sources, 40) == 1);
+    assert_exact_window(merged);
+    assert_same_histogram(merged, expected);
+    assert(heistogram_merge_many(merged, NULL, 0) == 1 && heistogram_merge_many(NULL, NULL, 0) == 0);
+    Heistogram* serialized = heistogram_create();
+    assert(heistogram_merge_many_serialized(serialized, buffers, 40) == 1);
+    assert_exact_window(serialized);
+    assert_same_histogram(serialized, expected);
+
+    // Merging into histograms that already hold counts, a compact one goes one source at a time
+    Heistogram* holes[3] = {sources[0], NULL, sources[5]};
+    Heistogram* expected_more = heistogram_merge(expected, sources[0]);
+    assert(heistogram_merge_inplace(expected_more, sources[5]) == 1);
+    assert(heistogram_merge_many(merged, (const Heistogram* const*)holes, 3) == 1);
+    assert_exact_window(merged);
+    assert_same_histogram(merged, expected_more);
+    Heistogram* compact = heistogram_create_compact();
+    assert(heistogram_merge_many(compact, (const Heistogram* const*)sources, 40) == 1);
+    assert(heistogram_merge_many_serialized(compact, buffers, 40) == 1);
+    Heistogram* doubled = heistogram_merge(expected, expected);
+    assert(compact->count_size < 8);
+    assert_same_histogram(compact, doubled);
+
+    // A histogram listed among its own sources adds what it held at that point, like a loop
+    Heistogram* twice[2] = {sources[3], merged};
+    Heistogram* expected_self = heistogram_merge(expected_more, sources[3]);
+    assert(heistogram_merge_inplace(expected_self, expected_self) == 1);
+    assert(heistogram_merge_many(merged, (const Heistogram* const*)twice, 2) == 1);
+    assert_same_histogram(merged, expected_self);
+
+    // A bad header is found before anything is merged, a truncated buffer stops the merge
+    HeistBuffer bad[3] = {buffers[0], {buffers[3].data, 2}, buffers[4]};
+    assert(heistogram_merge_many_serialized(serialized, bad, 3) == 0);
+    assert_same_histogram(serialized, expected);
+    HeistBuffer truncated[2] = {buffers[0], {buffers[3].data, buffers[3].size - 1}};
+    assert(heistogram_merge_many_serialized(serialized, truncated, 2) == 0);
+    assert(heistogram_count(serialized) == heistogram_count(expected) + heistogram_count(sources[0]));
+
+    for (int i = 0; i < 40; i++) {
+        heistogram_free(sources[i]);
+        free((void*)buffers[i].data);
+    }
+    heistogram_free(expected);
+    heistogram_free(expected_more);
+    heistogram_free(expected_self);
+    heistogram_free(merged);
+    heistogram_free(serialized);
+    heistogram_free(compact);
+    heistogram_free(doubled);
+
+    printf("Merge many test passed!\n");
+}
+
+static void test_streaming_merge() {
+    printf("\n=== Testing Streaming Serialized Merge ===\n");
+
+    // More inputs than fit on the stack, both formats, empty inputs and far apart ranges
+    HeistBuffer inputs[20];
+    Heistogram* expected = heistogram_create();
+    for (int i = 0; i < 20; i++) {
+        Heistogram* h = heistogram_create();
+        int n = i % 7 == 6 ? 0 : 1 + rand() % 800;
+        uint64_t scale = i % 5 == 4 ? 1000000000ULL : (uint64_t)(1 + i * 100);
+        for (int k = 0; k < n; k++) heistogram_add(h, scale * (1 + rand() % 1000));
+        inputs[i].data = heistogram_serialize_version(h, &inputs[i].size, i % 3 == 2 ? TEST_FORMAT_V1 : HEIST_FORMAT_V2);
+        assert(heistogram_merge_inplace(expected, h) == 1);
+        heistogram_free(h);
+    }
+
+    for (uint8_t version = TEST_FORMAT_V1; version <= HEIST_FORMAT_V2; version++) {
+        size_t expected_size;
+        void* expected_buffer = heistogram_serialize_version(expected, &expected_size, version);
+        for (size_t n = 1; n <= 20; n += 19) {
+            Heistogram* decoded = heistogram_create();
+            assert(heistogram_merge_many_serialized(decoded, inputs, n) == 1);
+            size_t want_size, size;
+            void* want = heistogram_serialize_version(n == 20 ? expected : decoded, &want_size, version);
+            void* merged = heistogram_serialized_merge_version(inputs, n, &size, version);
+            assert(merged && size == want_size && memcmp(merged, want, size) == 0);
+            free(want);
+            free(merged);
+            heistogram_free(decoded);
+        }
+
+        // Exactly enough space, one byte short, and the size bound
+        uint8_t buffer[20000];
+        assert(heistogram_serialized_merge_size_bound(inputs, 20) >= expected_size);
+        assert(heistogram_serialized_merge_into_version(inputs, 20, buffer, expected_size, version) == expected_size);
+        assert(memcmp(buffer, expected_buffer, expected_size) == 0);
+        assert(heistogram_serialized_merge_into_version(inputs, 20, buffer, expected_size - 1, version) == 0);
+        free(expected_buffer);
+    }
+
+    // Only empty inputs, or none, give an empty histogram
+    Heistogram* empty = heistogram_create();
+    size_t empty_size, size;
+    void* empty_buffer = heistogram_serialize(empty, &empty_size);
+    void* merged = heistogram_serialized_merge(&inputs[6], 1, &size);
+    assert(merged && size == empty_size && memcmp(merged, empty_buffer, size) == 0);
+    free(merged);
+    uint8_t empty_out[64];
+    assert(heistogram_serialized_merge_into(NULL, 0, empty_out, sizeof(empty_out)) == empty_size);
+    assert(memcmp(empty_out, empty_buffer, empty_size) == 0);
+
+    // A writer that pads the range with empty buckets still gives the trimmed result
+    Heistogram* single = heistogram_deserialize(inputs[2].data, inputs[2].size);
+    size_t single_size, padded_size;
+    void* single_buffer = heistogram_serialize(single, &single_size);
+    assert(heist_reserve(single, single->min_bucket_id - 3, single->max_bucket_id + 3) == 1);
+    single->min_bucket_id -= 3;
+    single->max_bucket_id += 3;
+    HeistBuffer pad;
+    pad.data = heistogram_serialize_version(single, &padded_size, TEST_FORMAT_V1);
+    pad.size = padded_size;
+    merged = heistogram_serialized_merge(&pad, 1, &size);
+    assert(merged && size == single_size && memcmp(merged, single_buffer, size) == 0);
+    free(merged);
+    free((void*)pad.data);
+
+    // Invalid and truncated inputs fail
+    HeistBuffer bad[2] = {inputs[0], {inputs[1].data, 2}};
+    assert(heistogram_serialized_merge(bad, 2, &size) == NULL);
+    HeistBuffer truncated[2] = {inputs[0], {inputs[1].data, inputs[1].size - 1}};
+    assert(heistogram_serialized_merge(truncated, 2, &size) == NULL);
+
+    for (int i = 0; i < 20; i++) free((void*)inputs[i].data);
+    free(empty_buffer);
+    free(single_buffer);
+    heistogram_free(empty);
+    heistogram_free(single);
+    heistogram_free(expected);
+
+    printf("Streaming serialized merge test passed!\n");
+}
+
+static void test_sliding_window() {
+    printf("\n=== Testing Sliding Window ===\n");
+
+    assert(heistogram_window_create(0, 100) == NULL && heistogram_window_create(5, 0) == NULL);
+    HeistogramWindow* w = heistogram_window_create(5, 100);
+    enum { EVENTS = 20000 };
+    uint64_t* times = malloc(EVENTS * sizeof(uint64_t));
+    uint64_t* values = malloc(EVENTS * sizeof(uint64_t));
+    uint64_t now = 1000000;
+    for (int i = 0; i < EVENTS; i++) {
+        // Mostly small steps, now and then a gap longer than the window
+        now += i % 2500 == 2499 ? 1000 : rand() % 3;
+        times[i] = now;
+        values[i] = i % 3 == 0 ? (uint64_t)(1 + rand() % 100) : (1 + rand() % 1000) * (1 + (now / 100) % 7 * 1000);
+        heistogram_window_add(w, values[i], now);
+        if (i % 97 != 0 && i != EVENTS - 1) continue;
+
+        // The window holds the values of the current slot and the four before it
+        Heistogram* expected = heistogram_create();
+        uint64_t first_slot = now / 100 >= 4 ? now / 100 - 4 : 0;
+        for (int k = i; k >= 0 && times[k] / 100 >= first_slot; k--) heistogram_add(expected, values[k]);
+        const Heistogram* aggregate = heistogram_window_histogram(w);
+        assert_exact_window(aggregate);
+        assert_same_histogram(aggregate, expected);
+        assert(heistogram_window_percentile(w, 99) == heistogram_percentile(expected, 99));
+        heistogram_free(expected);
+    }
+
+    // Going back in time stays in the current slot, explicit rotations expire one slot each
+    uint64_t count = heistogram_count(heistogram_window_histogram(w));
+    heistogram_window_advance(w, now - 50);
+    assert(heistogram_count(heistogram_window_histogram(w)) == count);
+    for (int k = 0; k < 5; k++) heistogram_window_rotate(w);
+    assert(heistogram_count(heistogram_window_histogram(w)) == 0);
+    assert_exact_window(heistogram_window_histogram(w));
+    heistogram_window_add(w, 42, now + 1000);
+    assert(heistogram_count(heistogram_window_histogram(w)) == 1 && heistogram_min(heistogram_window_histogram(w)) == 42);
+    heistogram_window_advance(w, now + 1500);
+    assert(heistogram_count(heistogram_window_histogram(w)) == 0);
+
+    // A value that doesn't fit the slot or the aggregate goes into neither, so later rotations
+    // still find every slot within the aggregate
+    assert(heistogram_window_add(NULL, 1, now) == 0);
+    assert(heistogram_window_add(w, 1000, now + 1500) == 1);
+    ArenaContext* arena = calloc(1, sizeof(ArenaContext));
+    HeistAllocator arena_allocator = {arena_alloc, NULL, arena_free, arena};
+    for (int k = 0; k < 2; k++) {
+        Heistogram** target = k == 0 ? &w->aggregate : &w->slots[w->current];
+        Heistogram* kept = *target;
+        Heistogram* full = heistogram_create_with_allocator(&arena_allocator, 0);
+        heistogram_add(full, 1000);
+        arena->used = sizeof(arena->memory);
+        *target = full;
+        assert(heistogram_window_add(w, 123456789, now + 1500) == 0);
+        assert(heistogram_count(w->aggregate) == 1 && heistogram_count(w->slots[w->current]) == 1);
+        *target = kept;
+        heistogram_free(full);
+        arena->used = 0;
+    }
+    assert(heistogram_count(w->aggregate) == 1 && heistogram_count(w->slots[w->current]) == 1);
+    for (int k = 0; k < 5; k++) heistogram_window_rotate(w);
+    assert(heistogram_count(heistogram_window_histogram(w)) == 0);
+    assert_exact_window(heistogram_window_histogram(w));
+    free(arena);
+
+    free(times);
+    free(values);
+    heistogram_window_free(w);
+
+    printf("Sliding window test passed!\n");
+}
+
+static void test_decaying_histogram() {
+    printf("\n=== Testing Decaying Histogram ===\n");
+
+    assert(heistogram_decaying_create(0) == NULL);
+    HeistogramDecaying* d = heistogram_decaying_create(1000);
+
+    // Values one half life newer weigh twice as much
+    for (int i = 0; i < 1000; i++) heistogram_decaying_add(d, 100, 5000);
+    for (int i = 0; i < 1000; i++) heistogram_decaying_add(d, 10000, 6000);
+    assert(fabs(heistogram_decaying_count(d, 6000) - 1500) < 1e-6);
+    assert(fabs(heistogram_decaying_count(d, 7000) - 750) < 1e-6);
+    assert(fabs(heistogram_decaying_prank(d, 1000) - 100.0 / 3) < 0.01);
+    assert(heistogram_decaying_percentile(d, 30) < 110 && heistogram_decaying_percentile(d, 40) > 9000);
+    double ps[2] = {30, 40}, results[2];
+    heistogram_decaying_percentiles(d, ps, 2, results);
+    assert(results[0] == heistogram_decaying_percentile(d, 30) && results[1] == heistogram_decaying_percentile(d, 40));
+    heistogram_decaying_free(d);
+
+    // Many half lives with renormalizations along the way, against weights kept in doubles
+    d = heistogram_decaying_create(1000);
+    double weights[4] = {0}, sum = 0;
+    uint64_t now = 0;
+    for (int i = 0; i < 200000; i++) {
+        now += rand() % 2;
+        int k = rand() % 4;
+        heistogram_decaying_add(d, 10 + k * 1000, now);
+        weights[k] += exp2(now / 1000.0);
+        sum += exp2(now / 1000.0);
+    }
+    const Heistogram* h = heistogram_decaying_histogram(d);
+    assert_exact_window(h);
+    for (int k = 0; k < 4; k++) {
+        double share = (double)heist_bucket_count(h, get_bucket_id(10 + k * 1000)) / h->total_count;
+        assert(fabs(share - weights[k] / sum) < 1e-3);
+    }
+    heistogram_decaying_free(d);
+
+    // Old values decay out of the window completely, and min and max follow
+    d = heistogram_decaying_create(10);
+    heistogram_decaying_add(d, 5, 0);
+    heistogram_decaying_add(d, 1000000, 0);
+    heistogram_decaying_add(d, 500, 200);
+    heistogram_decaying_add(d, 700, 250);  // 25 half lives: renormalizes, only 5 and 1000000 decay to zero
+    h = heistogram_decaying_histogram(d);
+    assert_exact_window(h);
+    assert(heistogram_min(h) == get_bucket_min(get_bucket_id(500)) && heistogram_max(h) == 700);
+    assert(fabs(heistogram_decaying_count(d, 250) - 1.03125) < 1e-6);
+    heistogram_decaying_free(d);
+
+    // Heavy weights renormalize before the total overflows
+    d = heistogram_decaying_create(1000);
+    heistogram_decaying_add(d, 1, 0);
+    for (int i = 0; i < 8000000; i++) heistogram_decaying_add(d, 1000 + i % 100, 23500);
+    h = heistogram_decaying_histogram(d);
+    assert(h->total_count < HEIST_DECAY_MAX_TOTAL);
+    assert(fabs(heistogram_decaying_count(d, 23500) / 8000000 - 1) < 1e-3);
+    assert(heistogram_decaying_percentile(d, 1) >= get_bucket_min(get_bucket_id(1000)));
+    heistogram_decaying_free(d);
+
+    printf("Decaying histogram test passed!\n");
+}
+
+static void test_precision_tiers() {
+    printf("\n=== Testing Precision Tiers (growth factor %g) ===\n", HEIST_GROWTH_FACTOR);
+
+    // Every bucket past the unmapped range stays within the tier's growth factor
+    assert(get_bucket_id(UINT64_MAX) == HEIST_MAX_BUCKET_ID);
+    for (uint16_t b = HEIST_MAX_UNMAPPED_BUCKET + 1; b < HEIST_MAX_BUCKET_ID; b++) {
+        uint64_t min = get_bucket_min(b), max = get_bucket_max(b);
+        assert((double)(max - min) <= (double)min * HEIST_GROWTH_FACTOR * 1.01 + 1);
+    }
+
+    Heistogram* h = heistogram_create();
+    for (uint64_t i = 1; i <= 10000; i++) heistogram_add(h, i * 37);
+    for (double p = 1; p <= 100; p += 1) {
+        // Off by at most the bucket width plus one rank
+        double exact = ceil(p / 100 * 10000) * 37;
+        assert(fabs(heistogram_percentile(h, p) - exact) <= exact * HEIST_GROWTH_FACTOR + 37);
+    }
+
+    // The tier travels with the serialized histogram and other tiers refuse it
+    size_t size;
+    uint8_t* serialized = heistogram_serialize_version(h, &size, HEIST_FORMAT_V2);
+    assert(heistogram_serialized_precision(serialized, size) == HEIST_PRECISION);
+    Heistogram* loaded = heistogram_deserialize(serialized, size);
+    assert(loaded && heistogram_count(loaded) == 10000);
+    heistogram_free(loaded);
+    serialized[2] = HEIST_PRECISION == HEIST_PRECISION_5 ? HEIST_PRECISION_2 : HEIST_PRECISION_5;
+    assert(heistogram_serialized_precision(serialized, size) == serialized[2]);
+    assert(heistogram_deserialize(serialized, size) == NULL);
+    assert(heistogram_percentile_serialized(serialized, size, 50) == 0);
+    serialized[2] = 200;
+    assert(heistogram_serialized_precision(serialized, size) == -1);
+    free(serialized);
+
+    serialized = heistogram_serialize_version(h, &size, HEIST_FORMAT_V1);
+#if HEIST_PRECISION == HEIST_PRECISION_2
+    assert(heistogram_serialized_precision(serialized, size) == HEIST_PRECISION_2);
+    free(serialized);
+#else
+    assert(serialized == NULL);
+#endif
+    assert(heistogram_serialized_precision(NULL, 0) == -1);
+
+    heistogram_free(h);
+    printf("Precision tiers test passed!\n");
+}
+
+// Compares against expected, through a snapshot when h is shared
+static void assert_same_counts(const Heistogram* h, const Heistogram* expected) {
+    Heistogram* snapshot = h->flags & HEIST_FLAG_SHARED ? heistogram_shared_snapshot(h) : NULL;
+    assert_same_sparse(snapshot ? snapshot : h, expected);
+    heistogram_free(snapshot);
+}
+
+static void test_weighted_inserts() {
+    printf("\n=== Testing Weighted Inserts ===\n");
+
+    // Every kind of histogram counts add_n and batches of pairs like repeated adds
+    Heistogram* single[5] = {heistogram_create(), heistogram_create_compact(), heistogram_create_sparse(),
+                             heistogram_create_indexed(HEIST_INDEX_FENWICK), heistogram_create_shared(10000000)};
+    Heistogram* batched[5] = {heistogram_create(), heistogram_create_compact(), heistogram_create_sparse(),
+                              heistogram_create_indexed(HEIST_INDEX_FENWICK), heistogram_create_shared(10000000)};
+    Heistogram* expected = heistogram_create();
+    uint64_t values[300], counts[300];
+    for (int i = 0; i < 300; i++) {
+        values[i] = i < 5 ? 1000 + i : 10 + rand() % 5000000;
+        counts[i] = i % 7 == 3 ? 0 : rand() % 400;
+        for (uint64_t c = 0; c < counts[i]; c++) heistogram_add(expected, values[i]);
+        for (int k = 0; k < 5; k++) assert(heistogram_add_n(single[k], values[i], counts[i]) == 1);
+    }
+    for (int k = 0; k < 5; k++) {
+        assert(heistogram_add_n_batch(batched[k], values, counts, 300) == 1);
+        assert_same_counts(single[k], expected);
+        assert_same_counts(batched[k], expected);
+    }
+    assert(heistogram_count_upto(single[3], 5000000) == heistogram_count_upto(expected, 5000000));
+
+    // Zero counts add nothing, not even to min and max, and totals never overflow
+    Heistogram* h = heistogram_create();
+    assert(heistogram_add_n(h, 7, 0) == 1 && heistogram_count(h) == 0);
+    uint64_t pair_values[] = {5, 1000000000, 2000}, pair_counts[] = {0, 3, 2};
+    assert(heistogram_add_n_batch(h, pair_values, pair_counts, 3) == 1);
+    assert(heistogram_count(h) == 5 && heistogram_min(h) == 2000 && heistogram_max(h) == 1000000000);
+    assert(heistogram_add_n(h, 1, UINT64_MAX) == 0 && heistogram_count(h) == 5 && heistogram_min(h) == 2000);
+    uint64_t huge[] = {UINT64_MAX - 10, 20};
+    assert(heistogram_add_n_batch(h, pair_values, huge, 2) == 0 && heistogram_count(h) == 5);
+    assert(heistogram_add_n_batch(h, NULL, NULL, 0) == 1 && heistogram_add_n_batch(h, NULL, pair_counts, 1) == 0);
+
+    // A scaled merge counts like merging scale times, in memory and serialized
+    Heistogram* sampled = heistogram_create();
+    for (int i = 0; i < 2000; i++) heistogram_add(sampled, 100 + rand() % 100000);
+    Heistogram* times_ten = heistogram_create();
+    for (int i = 0; i < 10; i++) assert(heistogram_merge_inplace(times_ten, sampled) == 1);
+    size_t size;
+    void* serialized = heistogram_serialize(sampled, &size);
+    for (int k = 0; k < 5; k++) {
+        Heistogram* kinds[2] = {heistogram_create(), heistogram_create_compact()};
+        if (k >= 2) {
+            heistogram_free(kinds[0]);
+            heistogram_free(kinds[1]);
+            kinds[0] = k == 2 ? heistogram_create_sparse() : k == 3 ? heistogram_create_indexed(HEIST_INDEX_LAZY) : heistogram_create_shared(10000000);
+            kinds[1] = k == 2 ? heistogram_create_sparse() : k == 3 ? heistogram_create_indexed(HEIST_INDEX_LAZY) : heistogram_create_shared(10000000);
+        }
+        assert(heistogram_merge_inplace_scaled(kinds[0], sampled, 10) == 1);
+        assert(heistogram_merge_inplace_serialized_scaled(kinds[1], serialized, size, 10) == 1);
+        assert_same_counts(kinds[0], times_ten);
+        assert_same_counts(kinds[1], times_ten);
+        heistogram_free(kinds[0]);
+        heistogram_free(kinds[1]);
+    }
+
+    // Sparse into sparse stays in pairs
+    Heistogram* few = heistogram_create_sparse();
+    Heistogram* target = heistogram_create_sparse();
+    Heistogram* few_expected = heistogram_create();
+    for (int i = 0; i < 5; i++) {
+        heistogram_add(few, 1000 * (i + 1));
+        heistogram_add(target, 1500 * (i + 1));
+        heistogram_add_n(few_expected, 1000 * (i + 1), 1000);
+        heistogram_add(few_expected, 1500 * (i + 1));
+    }
+    assert(heistogram_merge_inplace_scaled(target, few, 1000) == 1);
+    assert(target->flags & HEIST_FLAG_SPARSE);
+    assert_same_sparse(target, few_expected);
+
+    // Scale 0 merges nothing, a scaled total past 64 bits fails and changes nothing
+    uint64_t before = heistogram_count(times_ten);
+    assert(heistogram_merge_inplace_scaled(times_ten, sampled, 0) == 1 && heistogram_count(times_ten) == before);
+    assert(heistogram_merge_inplace_serialized_scaled(times_ten, serialized, size, 0) == 1 && heistogram_count(times_ten) == before);
+    assert(heistogram_merge_inplace_scaled(times_ten, sampled, UINT64_MAX / 1000) == 0 && heistogram_count(times_ten) == before);
+    assert(heistogram_merge_inplace_serialized_scaled(times_ten, serialized, size, UINT64_MAX / 1000) == 0 && heistogram_count(times_ten) == before);
+    uint64_t headroom = (UINT64_MAX - before) / heistogram_count(sampled);
+    assert(heistogram_merge_inplace_scaled(times_ten, sampled, headroom + 1) == 0 && heistogram_count(times_ten) == before);
+    assert(heistogram_merge_inplace_serialized_scaled(times_ten, serialized, size, headroom + 1) == 0 && heistogram_count(times_ten) == before);
+    assert(heistogram_merge_inplace_serialized_scaled(times_ten, serialized, size - 1, 2) == 0);
+
+    for (int k = 0; k < 5; k++) {
+        heistogram_free(single[k]);
+        heistogram_free(batched[k]);
+    }
+    heistogram_free(expected);
+    heistogram_free(h);
+    heistogram_free(sampled);
+    heistogram_free(times_ten);
+    heistogram_free(few);
+    heistogram_free(target);
+    heistogram_free(few_expected);
+    free(serialized);
+    printf("Weighted inserts test passed!\n");
+}
+
+// Serialized delta of two buffers, checked against subtracting in memory and serializing
+static void assert_serialized_delta(const void* later, size_t later_size, const void* earlier, size_t earlier_size) {
+    Heistogram* expected = heistogram_deserialize(later, later_size);
+    assert(heistogram_subtract_inplace_serialized(expected, earlier, earlier_size) == 1);
+    size_t expected_size, size;
+    void* expected_bytes = heistogram_serialize(expected, &expected_size);
+    void* delta = heistogram_serialized_subtract(later, later_size, earlier, earlier_size, &size);
+    assert(delta && size == expected_size && memcmp(delta, expected_bytes, size) == 0);
+
+    uint8_t v1[65536], v1_expected[65536];
+    size_t v1_size = heistogram_serialized_subtract_into_version(later, later_size, earlier, earlier_size, v1, sizeof(v1), TEST_FORMAT_V1);
+    assert(v1_size == heistogram_serialize_into_version(expected, v1_expected, sizeof(v1_expected), TEST_FORMAT_V1));
+    assert(memcmp(v1, v1_expected, v1_size) == 0);
+    assert(heistogram_serialized_subtract_into(later, later_size, earlier, earlier_size, v1, size - 1) == 0);
+    heistogram_free(expected);
+    free(expected_bytes);
+    free(delta);
+}
+
+static void test_subtraction() {
+    printf("\n=== Testing Subtraction ===\n");
+
+    // A later snapshot of a cumulative histogram minus an earlier one leaves the interval in
+    // between, for every kind of histogram, in memory and serialized
+    Heistogram* earlier = heistogram_create();
+    Heistogram* interval = heistogram_create();
+    for (int i = 0; i < 3000; i++) heistogram_add(earlier, 1000 + rand() % 100000);
+    heistogram_add(interval, 10);
+    heistogram_add(interval, 1000000000);
+    for (int i = 0; i < 2000; i++) heistogram_add(interval, 1000 + rand() % 200000);
+    size_t earlier_size;
+    void* earlier_bytes = heistogram_serialize(earlier, &earlier_size);
+    for (int k = 0; k < 5; k++) {
+        Heistogram* kinds[2];
+        for (int j = 0; j < 2; j++) {
+            kinds[j] = k == 0 ? heistogram_create() : k == 1 ? heistogram_create_compact() : k == 2 ? heistogram_create_sparse()
+                     : k == 3 ? heistogram_create_indexed(HEIST_INDEX_FENWICK) : heistogram_create_shared(2000000000);
+            assert(heistogram_merge_inplace(kinds[j], earlier) && heistogram_merge_inplace(kinds[j], interval));
+        }
+        if (k == 3) assert(heistogram_count_upto(kinds[0], 50000) > 0);  // Builds the index before it changes
+        assert(heistogram_subtract_inplace(kinds[0], earlier) == 1);
+        assert(heistogram_subtract_inplace_serialized(kinds[1], earlier_bytes, earlier_size) == 1);
+        assert_same_counts(kinds[0], interval);
+        assert_same_counts(kinds[1], interval);
+        heistogram_free(kinds[0]);
+        heistogram_free(kinds[1]);
+    }
+
+    // A shared histogram is subtracted through a snapshot, and a few pairs stay sparse
+    Heistogram* later = heistogram_create();
+    Heistogram* shared = heistogram_create_shared(2000000000);
+    heistogram_merge_inplace(later, earlier);
+    heistogram_merge_inplace(later, interval);
+    heistogram_merge_inplace(shared, earlier);
+    assert(heistogram_subtract_inplace(later, shared) == 1);
+    assert_same_histogram(later, interval);
+    Heistogram* few = heistogram_create_sparse();
+    Heistogram* few_earlier = heistogram_create_sparse();
+    for (int i = 1; i <= 6; i++) heistogram_add_n(few, 1000 * i, 10);
+    heistogram_add_n(few_earlier, 2000, 10);
+    heistogram_add_n(few_earlier, 3000, 4);
+    assert(heistogram_subtract_inplace(few, few_earlier) == 1);
+    assert((few->flags & HEIST_FLAG_SPARSE) && few->sparse_size == 5 && heistogram_count(few) == 46);
+
+    // Counts the minuend doesn't hold, as after a counter reset, fail and change nothing
+    Heistogram* before = heistogram_create();
+    heistogram_merge_inplace(before, later);
+    Heistogram* missing = heistogram_create();
+    heistogram_add(missing, 5);
+    assert(heistogram_subtract_inplace(later, missing) == 0);
+    heistogram_add_n(missing, 1000000000, 2);
+    assert(heistogram_subtract_inplace(later, missing) == 0);
+    Heistogram* larger = heistogram_create();
+    heistogram_merge_inplace(larger, later);
+    heistogram_add(larger, 1000);
+    assert(heistogram_subtract_inplace(later, larger) == 0 && heistogram_subtract_inplace(few, larger) == 0);
+    assert(heistogram_subtract_inplace_serialized(later, earlier_bytes, earlier_size - 1) == 0);
+    assert(heistogram_subtract_inplace(NULL, later) == 0 && heistogram_subtract_inplace(later, NULL) == 0);
+    assert_same_histogram(later, before);
+    assert(heistogram_subtract_inplace(before, before) == 1 && heistogram_count(before) == 0);
+
+    // Bounds whose bucket emptied become the edges of the new end buckets
+    Heistogram* bounds = heistogram_create();
+    Heistogram* outer = heistogram_create();
+    uint64_t spread[] = {100, 5000, 900000};
+    for (int i = 0; i < 3; i++) heistogram_add(bounds, spread[i]);
+    heistogram_add(outer, 100);
+    heistogram_add(outer, 900000);
+    size_t bounds_size, outer_size;
+    void* bounds_bytes = heistogram_serialize(bounds, &bounds_size);
+    void* outer_bytes = heistogram_serialize(outer, &outer_size);
+    assert(heistogram_subtract_inplace(bounds, outer) == 1 && heistogram_count(bounds) == 1);
+    assert(heistogram_min(bounds) == get_bucket_min(get_bucket_id(5000)) && heistogram_max(bounds) == get_bucket_max(get_bucket_id(5000)));
+    assert(bounds->min_bucket_id == get_bucket_id(5000) && bounds->max_bucket_id == get_bucket_id(5000));
+    assert(heistogram_subtract_inplace(bounds, bounds) == 1 && heistogram_min(bounds) == 0 && heistogram_max(bounds) == 0);
+
+    // Serialized deltas stream out the same bytes, whatever the formats of the inputs
+    heistogram_merge_inplace(later, earlier);
+    size_t later_size, v1_size;
+    void* later_bytes = heistogram_serialize(later, &later_size);
+    void* v1_bytes = heistogram_serialize_version(earlier, &v1_size, TEST_FORMAT_V1);
+    assert_serialized_delta(later_bytes, later_size, earlier_bytes, earlier_size);
+    assert_serialized_delta(later_bytes, later_size, v1_bytes, v1_size);
+    assert_serialized_delta(later_bytes, later_size, later_bytes, later_size);
+    assert_serialized_delta(bounds_bytes, bounds_size, outer_bytes, outer_size);
+    for (int round = 0; round < 50; round++) {
+        Heistogram* a = heistogram_create();
+        Heistogram* b = heistogram_create();
+        int scale = 1 + rand() % 6;
+        for (int i = 0; i < 200; i++) {
+            uint64_t value = rand() % 3 ? (uint64_t)(100 + rand() % (1 << (3 * scale))) : (uint64_t)rand() * (rand() % 1000);
+            heistogram_add(a, value);
+            if (rand() % 3 == 0) heistogram_add(b, value);
+        }
+        size_t a_size, b_size, reversed_size;
+        void* a_bytes = heistogram_serialize(a, &a_size);
+        void* b_bytes = heistogram_serialize_version(b, &b_size, round % 2 ? TEST_FORMAT_V1 : HEIST_FORMAT_V2);
+        assert_serialized_delta(a_bytes, a_size, b_bytes, b_size);
+        assert(heistogram_serialized_subtract(b_bytes, b_size, a_bytes, a_size, &reversed_size) == NULL);
+        heistogram_free(a);
+        heistogram_free(b);
+        free(a_bytes);
+        free(b_bytes);
+    }
+    size_t size;
+    assert(heistogram_serialized_subtract(earlier_bytes, earlier_size, later_bytes, later_size, &size) == NULL);
+    assert(heistogram_serialized_subtract(later_bytes, later_size - 1, earlier_bytes, earlier_size, &size) == NULL);
+    assert(heistogram_serialized_subtract(later_bytes, later_size, earlier_bytes, 2, &size) == NULL);
+
+    heistogram_free(earlier);
+    heistogram_free(interval);
+    heistogram_free(later);
+    heistogram_free(shared);
+    heistogram_free(few);
+    heistogram_free(few_earlier);
+    heistogram_free(before);
+    heistogram_free(missing);
+    heistogram_free(larger);
+    heistogram_free(bounds);
+    heistogram_free(outer);
+    free(earlier_bytes);
+    free(bounds_bytes);
+    free(outer_bytes);
+    free(later_bytes);
+    free(v1_bytes);
+    printf("Subtraction test passed!\n");
+}
+
+// A pool set up before any histogram exists still sizes the histograms it hands out
+static void test_pool_before_tables() {
+    printf("\n=== Testing Pool Created Before Any Histogram ===\n");
+
+    HeistogramPool* pool = heistogram_pool_create(2, 100, 10000000);
+    assert(pool && pool->lo == get_bucket_id(100) && pool->hi == get_bucket_id(10000000));
+    Heistogram* h = heistogram_pool_acquire(pool);
+    assert(heist_has_bucket(h, get_bucket_id(100)) && heist_has_bucket(h, get_bucket_id(10000000)));
+    heistogram_pool_release(pool, h);
+    heistogram_pool_free(pool);
+
+    printf("Pool created before any histogram test passed!\n");
+}
+
 int main() {
     printf("Starting Heistogram tests...\n");
     
+    // Must run first, before any other call builds the mapping tables
+    test_pool_before_tables();
     test_basic_functionality();
     test_serialization();
+    test_large_value_encoding();
     test_merge();
     test_serialized_merge();
     test_random_data();
@@ -635,6 +2646,30 @@ int main() {
     test_multi_step_workflow();
     test_skewed_distributions();
     test_extreme_percentiles();
+    test_batch_insert();
+    test_bucket_mapping();
+    test_bucket_bounds();
+    test_multi_percentiles();
+    test_cumulative_index();
+    test_sharded_histogram();
+    test_shared_histogram();
+    test_serialize_into();
+    test_serialized_view();
+    test_serialization_formats();
+    test_bucket_window();
+    test_occupancy_bitmap();
+    test_based_buckets();
+    test_compact_counters();
+    test_sparse_histograms();
+    test_allocator();
+    test_interval_rollover();
+    test_merge_many();
+    test_streaming_merge();
+    test_sliding_window();
+    test_decaying_histogram();
+    test_precision_tiers();
+    test_weighted_inserts();
+    test_subtraction();
     
     printf("\n=== All tests passed! ===\n");
     return 0;
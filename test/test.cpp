@@ -0,0 +1,272 @@
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <memory_resource>
+#include <type_traits>
+#include <vector>
+
+// Include the C++ wrapper, it brings every precision tier
+#include "../src/heistogram.hpp"
+
+static std::span<const std::byte> bytes_of(const void* data, size_t size) {
+    return {static_cast<const std::byte*>(data), size};
+}
+
+// A resource that counts what is outstanding, to check the histogram returns everything
+class CountingResource : public std::pmr::memory_resource {
+public:
+    size_t live = 0;
+    size_t allocations = 0;
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        live += bytes;
+        allocations++;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        live -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+static void test_histogram() {
+    printf("\n=== Testing C++ Histogram ===\n");
+
+    static_assert(!std::is_copy_constructible_v<heist::histogram>);
+    static_assert(std::is_nothrow_move_constructible_v<heist::histogram>);
+    static_assert(heist::tier<heist::precision::p2>::max_bucket_id == 2093);
+    static_assert(heist::tier<heist::precision::p5>::growth_factor > heist::tier<heist::precision::p0_5>::growth_factor);
+
+    // Same results as the C API
+    heist::histogram h;
+    heist::c::Heistogram* reference = heist::c::heistogram_create();
+    std::vector<uint64_t> values;
+    for (int i = 0; i < 5000; i++) values.push_back(10 + (uint64_t)rand() % 100000);
+    h.add(std::span<const uint64_t>(values).first(2500));
+    for (size_t i = 2500; i < values.size(); i++) h.add(values[i]);
+    for (uint64_t value : values) heist::c::heistogram_add(reference, value);
+    assert(h.count() == 5000 && h.min() == heist::c::heistogram_min(reference) && h.max() == heist::c::heistogram_max(reference));
+
+    const double ps[] = {1, 25, 50, 90, 99.9};
+    double results[5];
+    h.percentiles(ps, results);
+    for (int i = 0; i < 5; i++) {
+        assert(results[i] == heist::c::heistogram_percentile(reference, ps[i]));
+        assert(h.percentile(ps[i]) == results[i]);
+    }
+    assert(h.prank(50000) == heist::c::heistogram_prank(reference, 50000));
+    assert(h.count_upto(50000) == heist::c::heistogram_count_upto(reference, 50000));
+    bool threw = false;
+    try {
+        h.percentiles(ps, std::span<double>(results).first(4));
+    } catch (const std::length_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // Serialization round trips and matches the C output
+    std::vector<std::byte> serialized = h.serialize();
+    size_t c_size;
+    void* c_serialized = heist::c::heistogram_serialize(reference, &c_size);
+    assert(serialized.size() == c_size && memcmp(serialized.data(), c_serialized, c_size) == 0);
+    assert(heist::serialized_precision(serialized) == heist::precision::p2);
+    std::vector<std::byte> v2 = h.serialize(HEIST_FORMAT_V2);
+    assert(serialized[0] != std::byte{HEIST_FORMAT_MAGIC} && v2[0] == std::byte{HEIST_FORMAT_MAGIC});
+    assert(heist::serialized_precision(v2) == heist::precision::p2);
+
+    heist::histogram loaded;
+    loaded.add(1);
+    assert(loaded.deserialize(serialized));
+    assert(loaded.count() == 5000 && loaded.percentile(50) == h.percentile(50));
+    assert(loaded.merge(serialized) && loaded.count() == 10000);
+    assert(!loaded.deserialize(bytes_of("x", 1)) && loaded.count() == 0);
+    loaded.merge(h);
+    assert(loaded.count() == 5000);
+    loaded.assign(h);
+    assert(loaded.count() == 5000);
+    loaded.reset();
+    assert(loaded.count() == 0);
+
+    // Weighted inserts and scaled merges
+    heist::histogram weighted;
+    const uint64_t pair_values[] = {100, 2000, 30000};
+    const uint64_t pair_counts[] = {5, 0, 7};
+    weighted.add(pair_values, pair_counts);
+    assert(weighted.add(2000, 3) && weighted.count() == 15 && weighted.min() == 100);
+    assert(!weighted.add(1, UINT64_MAX) && weighted.count() == 15);
+    weighted.merge(h, 10);
+    assert(weighted.count() == 15 + 10 * 5000 && weighted.max() == h.max());
+    assert(weighted.merge(serialized, 3) && weighted.count() == 15 + 13 * 5000);
+    threw = false;
+    try {
+        weighted.merge(h, UINT64_MAX / 2);
+    } catch (const std::overflow_error&) {
+        threw = true;
+    }
+    assert(threw);
+    threw = false;
+    try {
+        weighted.add(std::span<const uint64_t>(pair_values), std::span<const uint64_t>(pair_counts).first(2));
+    } catch (const std::length_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // Subtracting a snapshot leaves what came after it
+    heist::histogram later;
+    later.merge(h);
+    assert(later.add(7, 3));
+    assert(later.subtract(h) && later.count() == 3 && later.min() == 7 && later.max() == 7);
+    assert(!later.subtract(h) && later.count() == 3);
+    later.merge(h);
+    assert(later.subtract(serialized) && later.count() == 3);
+
+    // Moves hand over the histogram, the moved-from one is empty
+    heist::histogram moved(std::move(h));
+    assert(moved.count() == 5000 && h.native_handle() == nullptr && h.count() == 0);
+    h = std::move(moved);
+    assert(h.count() == 5000);
+    swap(h, loaded);
+    assert(h.count() == 0 && loaded.count() == 5000);
+
+    heist::c::heistogram_free(reference);
+    free(c_serialized);
+    printf("C++ histogram test passed!\n");
+}
+
+static void test_precision_template() {
+    printf("\n=== Testing C++ Precision Tiers ===\n");
+
+    heist::basic_histogram<heist::precision::p0_5> fine;
+    heist::basic_histogram<heist::precision::p5> coarse;
+    heist::histogram regular;
+    for (uint64_t i = 1; i <= 100000; i++) {
+        fine.add(i);
+        coarse.add(i);
+        regular.add(i);
+    }
+    printf("  Memory %u bytes at 0.5%%, %u at 2%%, %u at 5%%\n", fine.memory_size(), regular.memory_size(), coarse.memory_size());
+    assert(fine.memory_size() > regular.memory_size() && regular.memory_size() > coarse.memory_size());
+    assert(std::fabs(fine.percentile(99) - 99000) <= 99000 * 0.005);
+    assert(std::fabs(coarse.percentile(99) - 99000) <= 99000 * 0.05);
+
+    // Each tier reads only its own buffers
+    std::vector<std::byte> fine_bytes = fine.serialize();
+    std::vector<std::byte> coarse_bytes = coarse.serialize();
+    assert(heist::serialized_precision(fine_bytes) == heist::precision::p0_5);
+    assert(heist::serialized_precision(coarse_bytes) == heist::precision::p5);
+    assert(!regular.merge(fine_bytes) && regular.count() == 100000);
+    assert(heist::percentile_serialized<heist::precision::p0_5>(fine_bytes, 99) == fine.percentile(99));
+    assert(heist::percentile_serialized(fine_bytes, 99) == 0);
+    assert(!heist::serialized_precision(bytes_of("", 0)));
+
+    bool threw = false;
+    try {
+        fine.serialize(HEIST_FORMAT_V1);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+
+    printf("C++ precision tiers test passed!\n");
+}
+
+static void test_memory_resource() {
+    printf("\n=== Testing C++ Memory Resources ===\n");
+
+    CountingResource counting;
+    {
+        heist::histogram h(&counting, 64);
+        assert(counting.allocations == 1);
+        for (uint64_t i = 0; i < 50; i++) h.add(i);
+        assert(counting.allocations == 1);
+
+        // Growing out of the inline buckets and moving keep the resource
+        for (uint64_t i = 0; i < 10000; i++) h.add(i * 997);
+        size_t allocations = counting.allocations;
+        assert(allocations > 1);
+        heist::histogram moved(std::move(h));
+        heist::histogram other(&counting);
+        other = std::move(moved);
+        for (uint64_t i = 0; i < 10000; i++) other.add(i * 100003);
+        assert(counting.allocations > allocations && other.count() == 20050);
+
+        std::pmr::polymorphic_allocator<std::byte> alloc(&counting);
+        std::pmr::vector<std::byte> serialized = other.serialize(HEIST_FORMAT_V2, alloc);
+        assert(heist::serialized_precision(serialized) == heist::precision::p2);
+    }
+    assert(counting.live == 0);
+
+    // A monotonic buffer never gives memory back, histograms just stop using it
+    std::byte arena[1 << 16];
+    std::pmr::monotonic_buffer_resource monotonic(arena, sizeof(arena), std::pmr::null_memory_resource());
+    std::vector<heist::histogram> windows;
+    for (int w = 0; w < 4; w++) {
+        windows.emplace_back(&monotonic, 128);
+        for (uint64_t i = 0; i < 100; i++) windows.back().add((w + 1) * (100 + i));
+    }
+    heist::histogram total;
+    for (const heist::histogram& window : windows) total.merge(window);
+    assert(total.count() == 400 && total.min() == 100 && total.max() == 4 * 199);
+
+    // An exhausted resource surfaces as std::bad_alloc
+    bool threw = false;
+    try {
+        for (int i = 0; i < 1000; i++) windows.emplace_back(&monotonic, 1024);
+    } catch (const std::bad_alloc&) {
+        threw = true;
+    }
+    assert(threw);
+
+    printf("C++ memory resources test passed!\n");
+}
+
+static void test_serialized_view() {
+    printf("\n=== Testing C++ Serialized View ===\n");
+
+    heist::histogram h;
+    for (uint64_t i = 0; i < 20000; i++) h.add(1000 + (uint64_t)rand() % 1000000);
+    std::vector<std::byte> serialized = h.serialize();
+
+    heist::serialized_view view(serialized);
+    view.build_index();
+    assert(view.count() == h.count() && view.min() == h.min() && view.max() == h.max());
+    const double ps[] = {0, 10, 50, 99, 100};
+    double from_view[5], from_buffer[5];
+    view.percentiles(ps, from_view);
+    heist::percentiles_serialized(serialized, ps, from_buffer);
+    for (int i = 0; i < 5; i++) {
+        assert(from_view[i] == h.percentile(ps[i]));
+        assert(from_buffer[i] == from_view[i]);
+        assert(view.percentile(ps[i]) == from_view[i]);
+    }
+    assert(view.prank(500000) == h.prank(500000));
+    assert(view.count_upto(500000) == h.count_upto(500000));
+
+    heist::serialized_view moved(std::move(view));
+    assert(moved.percentile(50) == h.percentile(50) && moved.data().data() == serialized.data());
+
+    bool threw = false;
+    try {
+        heist::serialized_view invalid(bytes_of("\xFE\x02\x07", 3));
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+
+    printf("C++ serialized view test passed!\n");
+}
+
+int main() {
+    printf("Starting Heistogram C++ tests...\n");
+
+    test_histogram();
+    test_precision_template();
+    test_memory_resource();
+    test_serialized_view();
+
+    printf("\n=== All C++ tests passed! ===\n");
+    return 0;
+}